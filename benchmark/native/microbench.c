@@ -0,0 +1,344 @@
+// Microbenchmarks of the native code on the hot paths of the source and the
+// sink, run on the frames of an FLV file. Built and run by
+// `benchmark/run.exs`, or by hand from the repository root with
+//
+//   cc -O2 -o microbench -Ic_src/membrane_rtmp_plugin
+//     benchmark/native/microbench.c c_src/membrane_rtmp_plugin/source/avc.c
+//     c_src/membrane_rtmp_plugin/sink/interleaver.c
+//     c_src/membrane_rtmp_plugin/sink/publisher.c
+//     c_src/membrane_rtmp_plugin/sink/tls.c
+//     c_src/membrane_rtmp_plugin/common/amf0.c
+//     $(pkg-config --cflags --libs libavformat libavutil openssl) -lpthread
+//
+// and `./microbench test/fixtures/bun33s.flv [iterations]`. Each result is
+// printed in a separate line as `name value unit`.
+#include "sink/interleaver.h"
+#include "sink/publisher.h"
+#include "source/avc.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define AVIO_BUFFER_SIZE 4096
+#define PUBLISH_CHUNK_SIZE 65536
+
+typedef struct Input {
+  uint8_t *data;
+  size_t size;
+  size_t pos;
+} Input;
+
+typedef struct Frames {
+  AVPacket **packets;
+  int count;
+  AVCodecParameters *codecpar[INTERLEAVER_MAX_STREAMS];
+  AVRational time_base[INTERLEAVER_MAX_STREAMS];
+  int video_stream_index;
+  size_t video_bytes;
+} Frames;
+
+static void report(const char *name, double value, const char *unit) {
+  printf("%s %.2f %s\n", name, value, unit);
+}
+
+static int read_file(const char *path, Input *input) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  input->size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  input->data = malloc(input->size);
+  input->pos = 0;
+  size_t read = input->data ? fread(input->data, 1, input->size, file) : 0;
+  fclose(file);
+  return read == input->size ? 0 : -1;
+}
+
+static int read_input(void *opaque, uint8_t *buf, int buf_size) {
+  Input *input = (Input *)opaque;
+  size_t size = FFMIN((size_t)buf_size, input->size - input->pos);
+  if (size == 0) {
+    return AVERROR_EOF;
+  }
+  memcpy(buf, input->data + input->pos, size);
+  input->pos += size;
+  return size;
+}
+
+// Demuxes the file from memory, so that the disk isn't measured, optionally
+// keeping the audio and video packets
+static int demux(Input *input, Frames *frames, int *frames_read) {
+  AVFormatContext *ctx = avformat_alloc_context();
+  uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+  input->pos = 0;
+  ctx->pb = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, input,
+                               read_input, NULL, NULL);
+
+  AVIOContext *pb = ctx->pb;
+  AVPacket *packet = av_packet_alloc();
+  *frames_read = 0;
+
+  int ret = avformat_open_input(&ctx, NULL, av_find_input_format("flv"), NULL);
+  if (ret < 0 || (ret = avformat_find_stream_info(ctx, NULL)) < 0) {
+    goto end;
+  }
+
+  while (av_read_frame(ctx, packet) >= 0) {
+    AVStream *stream = ctx->streams[packet->stream_index];
+    enum AVMediaType type = stream->codecpar->codec_type;
+    if ((type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) ||
+        packet->stream_index >= INTERLEAVER_MAX_STREAMS) {
+      av_packet_unref(packet);
+      continue;
+    }
+    (*frames_read)++;
+
+    if (frames) {
+      if (!frames->codecpar[packet->stream_index]) {
+        frames->codecpar[packet->stream_index] = avcodec_parameters_alloc();
+        avcodec_parameters_copy(frames->codecpar[packet->stream_index],
+                                stream->codecpar);
+        frames->time_base[packet->stream_index] = stream->time_base;
+      }
+      if (type == AVMEDIA_TYPE_VIDEO) {
+        frames->video_stream_index = packet->stream_index;
+        frames->video_bytes += packet->size;
+      }
+      frames->packets = realloc(frames->packets,
+                                (frames->count + 1) * sizeof(AVPacket *));
+      frames->packets[frames->count++] = av_packet_clone(packet);
+    }
+    av_packet_unref(packet);
+  }
+
+end:
+  av_packet_free(&packet);
+  // The custom IO context isn't freed with the format context
+  avformat_close_input(&ctx);
+  av_freep(&pb->buffer);
+  avio_context_free(&pb);
+  return ret;
+}
+
+// What the source does in read_frames, apart from receiving the data
+static void bench_demux(Input *input, int iterations) {
+  int64_t start = av_gettime_relative();
+  int frames = 0;
+  for (int i = 0; i < iterations; i++) {
+    int frames_read;
+    if (demux(input, NULL, &frames_read) < 0) {
+      fprintf(stderr, "Failed to demux the input\n");
+      exit(1);
+    }
+    frames += frames_read;
+  }
+  double seconds = (av_gettime_relative() - start) / 1e6;
+  report("demux_frames_per_second", frames / seconds, "frames/s");
+}
+
+// Conversion of the video frames to Annex-B, as done by the source
+static void bench_annex_b(Frames *frames, int iterations) {
+  size_t max_size = 0;
+  for (int i = 0; i < frames->count; i++) {
+    max_size = FFMAX(max_size, (size_t)frames->packets[i]->size);
+  }
+  uint8_t *scratch = malloc(max_size);
+
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < frames->count; j++) {
+      AVPacket *packet = frames->packets[j];
+      if (packet->stream_index != frames->video_stream_index) {
+        continue;
+      }
+      memcpy(scratch, packet->data, packet->size);
+      avc_to_annex_b_in_place(scratch, packet->size);
+    }
+  }
+  double seconds = (av_gettime_relative() - start) / 1e6;
+  report("annex_b_conversion", frames->video_bytes * iterations / seconds / 1e6,
+         "MB/s");
+  free(scratch);
+}
+
+static int discard_output(void *opaque, uint8_t *buf, int buf_size) {
+  *(uint64_t *)opaque += buf_size;
+  return buf_size;
+}
+
+// What the sink does in write_video_frame and write_audio_frame: copying the
+// frame to a pooled buffer, interleaving and muxing it
+static void bench_mux(Frames *frames, int iterations) {
+  AVBufferPool *pool = av_buffer_pool_init(1 << 22, NULL);
+  AVPacket *packet = av_packet_alloc();
+  uint64_t muxed_bytes = 0;
+  int64_t elapsed = 0;
+
+  for (int i = 0; i < iterations; i++) {
+    AVFormatContext *ctx;
+    avformat_alloc_output_context2(&ctx, NULL, "flv", NULL);
+    uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+    ctx->pb = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1,
+                                 &muxed_bytes, NULL, discard_output, NULL);
+    ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    for (int j = 0; j < INTERLEAVER_MAX_STREAMS; j++) {
+      if (frames->codecpar[j]) {
+        AVStream *stream = avformat_new_stream(ctx, NULL);
+        avcodec_parameters_copy(stream->codecpar, frames->codecpar[j]);
+        stream->codecpar->codec_tag = 0;
+      }
+    }
+    if (avformat_write_header(ctx, NULL) < 0) {
+      fprintf(stderr, "Failed to write the header\n");
+      exit(1);
+    }
+
+    Interleaver interleaver;
+    interleaver_init(&interleaver, 10000000);
+    int64_t start = av_gettime_relative();
+    for (int j = 0; j < frames->count; j++) {
+      AVPacket *frame = frames->packets[j];
+      packet->buf = av_buffer_pool_get(pool);
+      packet->data = packet->buf->data;
+      packet->size = frame->size;
+      memcpy(packet->data, frame->data, frame->size);
+      packet->stream_index = frame->stream_index;
+      if (frame->flags & AV_PKT_FLAG_KEY) {
+        packet->flags |= AV_PKT_FLAG_KEY;
+      }
+      AVRational time_base = frames->time_base[frame->stream_index];
+      packet->dts = packet->pts = av_rescale_q(
+          frame->dts, time_base, ctx->streams[frame->stream_index]->time_base);
+      interleaver_push(&interleaver, packet,
+                       ctx->streams[frame->stream_index]->time_base);
+
+      bool flush = j == frames->count - 1;
+      while (interleaver_pop(&interleaver, packet, flush)) {
+        av_write_frame(ctx, packet);
+        av_packet_unref(packet);
+        avio_flush(ctx->pb);
+      }
+    }
+    elapsed += av_gettime_relative() - start;
+
+    av_write_trailer(ctx);
+    interleaver_free(&interleaver);
+    av_freep(&ctx->pb->buffer);
+    avio_context_free(&ctx->pb);
+    avformat_free_context(ctx);
+  }
+
+  double seconds = elapsed / 1e6;
+  report("mux_frames_per_second", frames->count * iterations / seconds,
+         "frames/s");
+  av_packet_free(&packet);
+  av_buffer_pool_uninit(&pool);
+}
+
+static void *drain(void *opaque) {
+  int socket = *(int *)opaque;
+  uint8_t buffer[65536];
+  while (recv(socket, buffer, sizeof(buffer), 0) > 0) {
+  }
+  return NULL;
+}
+
+// Sending the FLV tags with the native publisher over loopback. The server
+// side only drains the socket, so the connection is set up by hand.
+static void bench_publish(Input *input, int iterations) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addr_len = sizeof(addr);
+  bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+  getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+  listen(listener, 1);
+
+  Publisher publisher;
+  publisher_init(&publisher);
+  publisher.socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(publisher.socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Failed to connect over loopback\n");
+    exit(1);
+  }
+  fcntl(publisher.socket, F_SETFL,
+        fcntl(publisher.socket, F_GETFL) | O_NONBLOCK);
+  publisher.out_chunk_size = PUBLISH_CHUNK_SIZE;
+  publisher.stream_id = 1;
+  publisher.published = true;
+
+  int server = accept(listener, NULL, NULL);
+  pthread_t thread;
+  pthread_create(&thread, NULL, drain, &server);
+
+  // The header is sent once, then the file is sent tag by tag, like the
+  // chunks written by the sink
+  size_t header_size = 9 + 4;
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < iterations; i++) {
+    size_t pos = header_size;
+    while (pos + 11 <= input->size) {
+      const uint8_t *tag = input->data + pos;
+      size_t tag_size = 11 + ((tag[1] << 16) | (tag[2] << 8) | tag[3]) + 4;
+      if (pos + tag_size > input->size ||
+          publisher_write(&publisher, tag, tag_size) < 0) {
+        break;
+      }
+      pos += tag_size;
+    }
+  }
+  double seconds = (av_gettime_relative() - start) / 1e6;
+  report("publish_throughput",
+         (input->size - header_size) * iterations / seconds / 1e6, "MB/s");
+
+  publisher_close(&publisher, false);
+  pthread_join(thread, NULL);
+  close(server);
+  close(listener);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FLV_FILE [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+  int iterations = argc > 2 ? atoi(argv[2]) : 20;
+
+  Input input;
+  if (read_file(argv[1], &input) < 0) {
+    fprintf(stderr, "Failed to read %s\n", argv[1]);
+    return 1;
+  }
+
+  Frames frames = {0};
+  int frames_read;
+  if (demux(&input, &frames, &frames_read) < 0) {
+    fprintf(stderr, "Failed to demux %s\n", argv[1]);
+    return 1;
+  }
+
+  bench_demux(&input, iterations);
+  bench_annex_b(&frames, iterations);
+  bench_mux(&frames, iterations);
+  bench_publish(&input, iterations);
+
+  for (int i = 0; i < frames.count; i++) {
+    av_packet_free(&frames.packets[i]);
+  }
+  free(frames.packets);
+  for (int i = 0; i < INTERLEAVER_MAX_STREAMS; i++) {
+    avcodec_parameters_free(&frames.codecpar[i]);
+  }
+  free(input.data);
+  return 0;
+}
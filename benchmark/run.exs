@@ -0,0 +1,552 @@
+# Benchmarks of the RTMP source and sink over loopback, see the Benchmarks section of README.md
+#
+#   elixir benchmark/run.exs [--quick] [--native] [--streams 1,10,100,1000]
+#                            [--save FILE] [--compare FILE] [--threshold PERCENT]
+#
+# Requires `ffmpeg` in PATH, which publishes the fixture to the source.
+
+Mix.install([
+  {:membrane_core, "~> 0.10.1"},
+  {:membrane_rtmp_plugin, path: __DIR__ |> Path.join("..") |> Path.expand()},
+  {:benchee, "~> 1.1"},
+  :membrane_realtimer_plugin
+])
+
+defmodule Bench.CountingSink do
+  @moduledoc false
+  # Counts the received buffers, notifying the parent about the first one and the end of stream
+  use Membrane.Sink
+
+  def_input_pad :input, caps: :any, demand_unit: :buffers
+
+  @impl true
+  def handle_init(_opts), do: {:ok, %{count: 0, last_dts: 0}}
+
+  @impl true
+  def handle_prepared_to_playing(_ctx, state), do: {{:ok, demand: {:input, 64}}, state}
+
+  @impl true
+  def handle_write_list(:input, buffers, _ctx, state) do
+    actions = if state.count == 0, do: [notify: :first_buffer], else: []
+    last_dts = List.last(buffers).dts || state.last_dts
+    state = %{state | count: state.count + length(buffers), last_dts: last_dts}
+    {{:ok, actions ++ [demand: {:input, 64}]}, state}
+  end
+
+  @impl true
+  def handle_end_of_stream(:input, _ctx, state) do
+    {{:ok, notify: {:end_of_stream, state.count, state.last_dts}}, state}
+  end
+end
+
+defmodule Bench.Collector do
+  @moduledoc false
+  # Keeps the caps and the buffers, to replay them to the sink
+  use Membrane.Sink
+
+  def_input_pad :input, caps: :any, demand_unit: :buffers
+
+  @impl true
+  def handle_init(_opts), do: {:ok, %{caps: nil, buffers: []}}
+
+  @impl true
+  def handle_prepared_to_playing(_ctx, state), do: {{:ok, demand: {:input, 64}}, state}
+
+  @impl true
+  def handle_caps(:input, caps, _ctx, state), do: {:ok, %{state | caps: caps}}
+
+  @impl true
+  def handle_write_list(:input, buffers, _ctx, state) do
+    {{:ok, demand: {:input, 64}}, %{state | buffers: Enum.reverse(buffers, state.buffers)}}
+  end
+
+  @impl true
+  def handle_end_of_stream(:input, _ctx, state) do
+    {{:ok, notify: {:collected, state.caps, Enum.reverse(state.buffers)}}, state}
+  end
+end
+
+defmodule Bench do
+  @moduledoc false
+  import Membrane.ParentSpec
+
+  alias Membrane.RTMP
+  alias Membrane.RTMP.Listener
+  alias Membrane.RTMP.Listener.Session
+  alias Membrane.Testing.Pipeline
+  alias Membrane.Time
+
+  @fixture Path.expand("../test/fixtures/bun33s.flv", __DIR__)
+  @port 9010
+  @timeout 60_000
+
+  ## Source
+
+  def start_source(source_opts) do
+    {:ok, pipeline} =
+      Pipeline.start_link(
+        children: [
+          src: struct!(RTMP.Source, [url: "rtmp://127.0.0.1:#{@port}"] ++ source_opts),
+          audio_sink: Bench.CountingSink,
+          video_sink: Bench.CountingSink
+        ],
+        links: [
+          link(:src) |> via_out(:audio) |> to(:audio_sink),
+          link(:src) |> via_out(:video) |> to(:video_sink)
+        ],
+        test_process: self()
+      )
+
+    await_playing(pipeline)
+    # There's no way to learn when the source starts listening
+    Process.sleep(200)
+    pipeline
+  end
+
+  def publish(opts \\ []) do
+    realtime = if opts[:realtime], do: ["-re"], else: []
+
+    Task.async(fn ->
+      System.cmd(
+        "ffmpeg",
+        ["-loglevel", "error"] ++
+          realtime ++ ["-i", @fixture, "-c", "copy", "-f", "flv", "rtmp://127.0.0.1:#{@port}/"]
+      )
+    end)
+  end
+
+  # Receives the whole stream, returning the number of frames and the duration of the media
+  def receive_stream(pipeline) do
+    publisher = publish()
+    {video_frames, duration} = await_end_of_stream(pipeline, :video_sink)
+    {audio_frames, _duration} = await_end_of_stream(pipeline, :audio_sink)
+    Task.await(publisher, @timeout)
+    {video_frames + audio_frames, duration}
+  end
+
+  def time_to_first_frame(pipeline) do
+    start = System.monotonic_time()
+    publisher = publish(realtime: true)
+
+    receive do
+      {Pipeline, ^pipeline, {:handle_notification, {:first_buffer, :video_sink}}} -> :ok
+    after
+      @timeout -> raise "No frame received"
+    end
+
+    elapsed = System.monotonic_time() - start
+    Task.shutdown(publisher, :brutal_kill)
+    System.convert_time_unit(elapsed, :native, :microsecond)
+  end
+
+  ## Sink
+
+  # Receives the stream with the source once, to replay it to the sink
+  def collect_stream() do
+    {:ok, pipeline} =
+      Pipeline.start_link(
+        children: [
+          src: %RTMP.SourceBin{port: @port, timeout: Time.seconds(10)},
+          video_payloader: Membrane.MP4.Payloader.H264,
+          audio: Bench.Collector,
+          video: Bench.Collector
+        ],
+        links: [
+          link(:src) |> via_out(:audio) |> to(:audio),
+          link(:src) |> via_out(:video) |> to(:video_payloader) |> to(:video)
+        ],
+        test_process: self()
+      )
+
+    await_playing(pipeline)
+    Process.sleep(200)
+    publisher = publish()
+    collected = for _pad <- 1..2, do: await_collected(pipeline)
+    Task.await(publisher, @timeout)
+    Pipeline.terminate(pipeline, blocking?: true)
+    Map.new(collected)
+  end
+
+  # With `realtime?`, the frames are sent at the pace of their timestamps
+  def start_sink(stream, rtmp_url, sink_opts \\ [], realtime? \\ false) do
+    realtimers =
+      if realtime?,
+        do: [video_realtimer: Membrane.Realtimer, audio_realtimer: Membrane.Realtimer],
+        else: []
+
+    {:ok, pipeline} =
+      Pipeline.start_link(
+        children:
+          [
+            video: replay_source(stream.video),
+            audio: replay_source(stream.audio),
+            sink: struct!(RTMP.Sink, [rtmp_url: rtmp_url, max_attempts: 10] ++ sink_opts)
+          ] ++ realtimers,
+        links: [
+          link(:video) |> pace(realtime?, :video_realtimer) |> via_in(:video) |> to(:sink),
+          link(:audio) |> pace(realtime?, :audio_realtimer) |> via_in(:audio) |> to(:sink)
+        ],
+        test_process: self()
+      )
+
+    pipeline
+  end
+
+  defp pace(link, false, _realtimer), do: link
+  defp pace(link, true, realtimer), do: to(link, realtimer)
+
+  defp replay_source({caps, buffers}) do
+    generator = fn buffers, size ->
+      {taken, rest} = Enum.split(buffers, size)
+      eos = if rest == [], do: [end_of_stream: :output], else: []
+      {[buffer: {:output, taken}] ++ eos, rest}
+    end
+
+    %Membrane.Testing.Source{output: {buffers, generator}, caps: caps}
+  end
+
+  # Sends the whole stream to a listener, whose sessions are drained without parsing the frames
+  def send_stream(stream, sink_opts) do
+    {:ok, listener} = Listener.start_link()
+    url = "rtmp://127.0.0.1:#{Listener.port(listener)}/bench/stream"
+    pipeline = start_sink(stream, url, sink_opts)
+    [drain] = await_drains(1)
+
+    frames =
+      receive do
+        {:drained, ^drain, frames} -> frames
+      after
+        @timeout -> raise "Stream not received"
+      end
+
+    Pipeline.terminate(pipeline, blocking?: true)
+    GenServer.stop(listener)
+    frames
+  end
+
+  def await_drains(count) do
+    parent = self()
+
+    for _i <- 1..count do
+      receive do
+        {Listener, :publish, %{session: session}} ->
+          spawn_link(fn -> drain(session, parent) end)
+      after
+        @timeout -> raise "Stream not published"
+      end
+    end
+  end
+
+  defp drain(session, parent) do
+    :ok = Session.attach(session, video_payload_format: :avcc)
+    drain_loop(session, parent, 0)
+  end
+
+  defp drain_loop(session, parent, frames) do
+    receive do
+      {RTMP.Source.Native, :format_info_ready, _audio, _video} ->
+        drain_loop(session, parent, frames)
+
+      {RTMP.Source.Native, :read_frames, {:ok, _, _, video, _, _, _, audio, _}} ->
+        send(session, {:get_frames, self()})
+        if frames == 0, do: send(parent, {:streaming, self()})
+        drain_loop(session, parent, frames + length(video) + length(audio))
+
+      {RTMP.Source.Native, :read_frames, :end_of_stream} ->
+        send(parent, {:drained, self(), frames})
+
+      {RTMP.Source.Native, :read_frames, {:error, reason}} ->
+        raise "Stream failed: #{reason}"
+    end
+  end
+
+  ## Concurrent streams
+
+  # Started in a separate OS process, so that the memory of the clients isn't counted.
+  # All the streams are sent in real time by a single sink, fanning out to the listener.
+  def run_client(count, port) do
+    stream = collect_stream()
+
+    urls = for i <- 1..count, do: "rtmp://127.0.0.1:#{port}/bench/stream_#{i}"
+    pipeline = start_sink(stream, urls, [io_mode: :native], true)
+    Process.monitor(pipeline)
+
+    receive do
+      {:DOWN, _ref, :process, ^pipeline, _reason} -> :ok
+    end
+  end
+
+  def memory_per_connection(count) do
+    {:ok, listener} = Listener.start_link()
+    port = Listener.port(listener)
+    :erlang.garbage_collect()
+    {beam_before, rss_before} = memory()
+
+    client =
+      Port.open({:spawn_executable, System.find_executable("elixir")},
+        args: [__ENV__.file, "--client", to_string(count), to_string(port)],
+        cd: File.cwd!()
+      )
+
+    drains = await_drains(count)
+
+    for drain <- drains do
+      receive do
+        {:streaming, ^drain} -> :ok
+      after
+        @timeout -> raise "Stream not received"
+      end
+    end
+
+    # Let the buffers settle in the steady state
+    Process.sleep(5_000)
+    {beam_after, rss_after} = memory()
+
+    {:os_pid, os_pid} = Port.info(client, :os_pid)
+    System.cmd("kill", [to_string(os_pid)])
+    Enum.each(drains, &Process.unlink/1)
+    GenServer.stop(listener)
+
+    {(beam_after - beam_before) / count, (rss_after - rss_before) / count}
+  end
+
+  # BEAM memory and the resident set size of the whole OS process, which includes the native
+  # allocations, in bytes
+  defp memory() do
+    {rss, 0} = System.cmd("ps", ["-o", "rss=", "-p", System.pid()])
+    {:erlang.memory(:total), String.to_integer(String.trim(rss)) * 1024}
+  end
+
+  ## Helpers
+
+  def await_playing(pipeline) do
+    receive do
+      {Pipeline, ^pipeline, {:playback_state_changed, :prepared, :playing}} -> :ok
+    after
+      @timeout -> raise "Pipeline didn't start playing"
+    end
+  end
+
+  defp await_end_of_stream(pipeline, sink) do
+    receive do
+      {Pipeline, ^pipeline, {:handle_notification, {{:end_of_stream, count, last_dts}, ^sink}}} ->
+        {count, last_dts}
+    after
+      @timeout -> raise "Stream didn't end"
+    end
+  end
+
+  defp await_collected(pipeline) do
+    receive do
+      {Pipeline, ^pipeline, {:handle_notification, {{:collected, caps, buffers}, pad}}} ->
+        {pad, {caps, buffers}}
+    after
+      @timeout -> raise "Stream not collected"
+    end
+  end
+
+  def cpu_time(fun) do
+    {runtime_before, _} = :erlang.statistics(:runtime)
+    result = fun.()
+    {runtime_after, _} = :erlang.statistics(:runtime)
+    {runtime_after - runtime_before, result}
+  end
+
+  def fixture(), do: @fixture
+end
+
+defmodule Bench.Runner do
+  @moduledoc false
+  alias Membrane.Testing.Pipeline
+  alias Membrane.Time
+
+  @source_modes [
+    ffmpeg: [io_mode: :ffmpeg],
+    native: [io_mode: :native],
+    ffmpeg_fast_start: [io_mode: :ffmpeg, fast_start: true]
+  ]
+  @sink_modes [ffmpeg: [io_mode: :ffmpeg], native: [io_mode: :native]]
+
+  def run(opts) do
+    benchee_opts =
+      if opts[:quick], do: [warmup: 1, time: 5], else: [warmup: 2, time: 20]
+
+    streams =
+      (opts[:streams] || "1,10,100,1000")
+      |> String.split(",", trim: true)
+      |> Enum.map(&String.to_integer/1)
+
+    results =
+      source_throughput(benchee_opts) ++
+        time_to_first_frame(benchee_opts) ++
+        sink_throughput(benchee_opts) ++
+        memory_per_connection(streams) ++
+        if(opts[:native], do: native_microbench(), else: [])
+
+    print(results)
+    if opts[:save], do: File.write!(opts[:save], :erlang.term_to_binary(results))
+
+    if opts[:compare] do
+      baseline = opts[:compare] |> File.read!() |> :erlang.binary_to_term()
+      regressions = compare(results, baseline, opts[:threshold] || 10.0)
+      if regressions != [], do: System.halt(1)
+    end
+  end
+
+  # Each result is `{name, value, unit, better}`, where `better` tells which direction
+  # is an improvement
+  defp source_throughput(benchee_opts) do
+    scenarios =
+      Map.new(@source_modes, fn {mode, source_opts} ->
+        receive_stream = fn pipeline ->
+          Bench.receive_stream(pipeline)
+          pipeline
+        end
+
+        {"source/#{mode}",
+         {receive_stream,
+          before_each: fn _input -> Bench.start_source(source_opts) end,
+          after_each: &Pipeline.terminate(&1, blocking?: true)}}
+      end)
+
+    suite = Benchee.run(scenarios, benchee_opts)
+
+    Enum.flat_map(@source_modes, fn {mode, source_opts} ->
+      pipeline = Bench.start_source(source_opts)
+      {cpu_ms, {frames, duration}} = Bench.cpu_time(fn -> Bench.receive_stream(pipeline) end)
+      Pipeline.terminate(pipeline, blocking?: true)
+      seconds = average(suite, "source/#{mode}") / 1.0e9
+      media_seconds = duration / Time.second()
+
+      [
+        {"source/#{mode} frames per second", frames / seconds, "frames/s", :higher},
+        {"source/#{mode} CPU per stream", cpu_ms / 10 / media_seconds, "% of a core",
+         :lower}
+      ]
+    end)
+  end
+
+  defp time_to_first_frame(benchee_opts) do
+    runs = if benchee_opts[:time] > 5, do: 10, else: 3
+
+    Enum.map(@source_modes, fn {mode, source_opts} ->
+      # Time to first frame is measured from starting the publisher, so it's timed here
+      # rather than by benchee, which would include starting the pipeline
+      samples =
+        for _i <- 1..runs do
+          pipeline = Bench.start_source(source_opts)
+          sample = Bench.time_to_first_frame(pipeline)
+          Pipeline.terminate(pipeline, blocking?: true)
+          sample
+        end
+
+      {"source/#{mode} time to first frame", Enum.sum(samples) / length(samples) / 1000, "ms",
+       :lower}
+    end)
+  end
+
+  defp sink_throughput(benchee_opts) do
+    stream = Bench.collect_stream()
+    frames = stream |> Map.values() |> Enum.map(fn {_caps, buffers} -> length(buffers) end)
+    frames = Enum.sum(frames)
+
+    scenarios =
+      Map.new(@sink_modes, fn {mode, sink_opts} ->
+        {"sink/#{mode}", fn -> Bench.send_stream(stream, sink_opts) end}
+      end)
+
+    suite = Benchee.run(scenarios, benchee_opts)
+
+    Enum.map(@sink_modes, fn {mode, _sink_opts} ->
+      seconds = average(suite, "sink/#{mode}") / 1.0e9
+      {"sink/#{mode} frames per second", frames / seconds, "frames/s", :higher}
+    end)
+  end
+
+  defp memory_per_connection(streams) do
+    Enum.flat_map(streams, fn count ->
+      {beam, rss} = Bench.memory_per_connection(count)
+
+      [
+        {"listener #{count} streams BEAM memory per connection", beam / 1024, "KiB", :lower},
+        {"listener #{count} streams RSS per connection", rss / 1024, "KiB", :lower}
+      ]
+    end)
+  end
+
+  defp native_microbench() do
+    root = Path.expand("..", __DIR__)
+    binary = Path.join(System.tmp_dir!(), "rtmp_plugin_microbench")
+    sources = ~w(source/avc.c sink/interleaver.c sink/publisher.c sink/tls.c common/amf0.c)
+    {pkg_config, 0} = System.cmd("pkg-config", ~w(--cflags --libs libavformat libavutil openssl))
+
+    {_output, 0} =
+      System.shell(
+        Enum.join(
+          ["cc -O2 -o #{binary} -I#{root}/c_src/membrane_rtmp_plugin",
+           Path.join(root, "benchmark/native/microbench.c")] ++
+            Enum.map(sources, &Path.join([root, "c_src/membrane_rtmp_plugin", &1])) ++
+            [String.trim(pkg_config), "-lpthread"],
+          " "
+        ),
+        stderr_to_stdout: true
+      )
+
+    {output, 0} = System.cmd(binary, [Bench.fixture()])
+
+    for line <- String.split(output, "\n", trim: true) do
+      [name, value, unit] = String.split(line, " ")
+      {"native/#{name}", String.to_float(value), unit, :higher}
+    end
+  end
+
+  defp average(suite, name) do
+    scenario = Enum.find(suite.scenarios, &(&1.name == name))
+    scenario.run_time_data.statistics.average
+  end
+
+  defp print(results) do
+    IO.puts("\n## Results\n")
+
+    for {name, value, unit, _better} <- results do
+      :io.format("~-56s ~12.2f ~s~n", [name, value / 1, unit])
+    end
+  end
+
+  defp compare(results, baseline, threshold) do
+    baseline = Map.new(baseline, fn {name, value, _unit, _better} -> {name, value} end)
+    IO.puts("\n## Comparison with the baseline (threshold #{threshold}%)\n")
+
+    results
+    |> Enum.filter(fn {name, _value, _unit, _better} ->
+      is_number(baseline[name]) and baseline[name] != 0
+    end)
+    |> Enum.filter(fn {name, value, _unit, better} ->
+      change = (value - baseline[name]) / baseline[name] * 100
+      regressed? = if better == :higher, do: change < -threshold, else: change > threshold
+      mark = if regressed?, do: "REGRESSION", else: ""
+      :io.format("~-56s ~8.1f% ~s~n", [name, change, mark])
+      regressed?
+    end)
+  end
+end
+
+case System.argv() do
+  ["--client", count, port] ->
+    Bench.run_client(String.to_integer(count), String.to_integer(port))
+
+  argv ->
+    {opts, _args} =
+      OptionParser.parse!(argv,
+        strict: [
+          quick: :boolean,
+          native: :boolean,
+          streams: :string,
+          save: :string,
+          compare: :string,
+          threshold: :float
+        ]
+      )
+
+    Bench.Runner.run(opts)
+end
@@ -10,18 +10,32 @@ defmodule Membrane.RTMP.BundlexProject do
   defp natives(_platform) do
     [
       rtmp_source: [
-        sources: ["source/rtmp_source.c"],
+        sources: ["source/rtmp_source.c", "source/avc.c"],
         deps: [unifex: :unifex],
         interface: [:nif],
         preprocessor: Unifex,
         pkg_configs: ["libavformat", "libavutil"]
       ],
+      rtmp_session: [
+        sources: ["source/rtmp_session.c", "source/avc.c", "common/amf0.c"],
+        deps: [unifex: :unifex],
+        interface: [:nif],
+        preprocessor: Unifex
+      ],
       rtmp_sink: [
-        sources: ["sink/rtmp_sink.c"],
+        sources: [
+          "sink/rtmp_sink.c",
+          "sink/destination.c",
+          "sink/interleaver.c",
+          "sink/publisher.c",
+          "sink/worker_pool.c",
+          "sink/tls.c",
+          "common/amf0.c"
+        ],
         deps: [unifex: :unifex],
         interface: [:nif],
         preprocessor: Unifex,
-        pkg_configs: ["libavformat", "libavutil"]
+        pkg_configs: ["libavformat", "libavutil", "openssl"]
       ]
     ]
   end
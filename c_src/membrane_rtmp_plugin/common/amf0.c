@@ -0,0 +1,287 @@
+#include "amf0.h"
+#include <stdlib.h>
+#include <string.h>
+
+void amf0_reader_init(AMF0Reader *reader, const uint8_t *data, size_t size) {
+  reader->data = data;
+  reader->size = size;
+  reader->pos = 0;
+}
+
+static size_t remaining(AMF0Reader *reader) {
+  return reader->size - reader->pos;
+}
+
+static uint32_t read_uint(const uint8_t *data, int size) {
+  uint32_t value = 0;
+  for (int i = 0; i < size; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+int amf0_read_number(AMF0Reader *reader, double *value) {
+  if (remaining(reader) < 9 || reader->data[reader->pos] != AMF0_NUMBER) {
+    return -1;
+  }
+
+  uint64_t bits = 0;
+  for (int i = 1; i <= 8; i++) {
+    bits = (bits << 8) | reader->data[reader->pos + i];
+  }
+  memcpy(value, &bits, sizeof(*value));
+  reader->pos += 9;
+  return 0;
+}
+
+int amf0_read_string(AMF0Reader *reader, const char **value, size_t *length) {
+  if (remaining(reader) < 3 || reader->data[reader->pos] != AMF0_STRING) {
+    return -1;
+  }
+
+  size_t string_length = read_uint(reader->data + reader->pos + 1, 2);
+  if (remaining(reader) < 3 + string_length) {
+    return -1;
+  }
+  *value = (const char *)reader->data + reader->pos + 3;
+  *length = string_length;
+  reader->pos += 3 + string_length;
+  return 0;
+}
+
+static int skip_value(AMF0Reader *reader, int depth);
+
+// Skips object properties up to and including the object end marker
+static int skip_properties(AMF0Reader *reader, int depth) {
+  while (true) {
+    if (remaining(reader) < 3) {
+      return -1;
+    }
+    size_t name_length = read_uint(reader->data + reader->pos, 2);
+    if (name_length == 0 &&
+        reader->data[reader->pos + 2] == AMF0_OBJECT_END) {
+      reader->pos += 3;
+      return 0;
+    }
+    if (remaining(reader) < 2 + name_length) {
+      return -1;
+    }
+    reader->pos += 2 + name_length;
+    if (skip_value(reader, depth) < 0) {
+      return -1;
+    }
+  }
+}
+
+// `depth` is the number of objects and arrays the value is nested in
+static int skip_value(AMF0Reader *reader, int depth) {
+  if (remaining(reader) < 1) {
+    return -1;
+  }
+
+  size_t start = reader->pos;
+  size_t length = 0;
+  int ret = 0;
+
+  switch (reader->data[start]) {
+  case AMF0_NUMBER:
+    length = 9;
+    break;
+  case AMF0_BOOLEAN:
+    length = 2;
+    break;
+  case AMF0_STRING:
+    if (remaining(reader) < 3) {
+      return -1;
+    }
+    length = 3 + read_uint(reader->data + start + 1, 2);
+    break;
+  case AMF0_LONG_STRING:
+    if (remaining(reader) < 5) {
+      return -1;
+    }
+    length = 5 + (size_t)read_uint(reader->data + start + 1, 4);
+    break;
+  case AMF0_NULL:
+  case AMF0_UNDEFINED:
+    length = 1;
+    break;
+  case AMF0_DATE:
+    length = 11;
+    break;
+  case AMF0_OBJECT:
+    if (depth >= AMF0_MAX_DEPTH) {
+      return -1;
+    }
+    reader->pos += 1;
+    ret = skip_properties(reader, depth + 1);
+    break;
+  case AMF0_ECMA_ARRAY:
+    if (remaining(reader) < 5 || depth >= AMF0_MAX_DEPTH) {
+      return -1;
+    }
+    reader->pos += 5;
+    ret = skip_properties(reader, depth + 1);
+    break;
+  case AMF0_STRICT_ARRAY: {
+    if (remaining(reader) < 5 || depth >= AMF0_MAX_DEPTH) {
+      return -1;
+    }
+    uint32_t count = read_uint(reader->data + start + 1, 4);
+    reader->pos += 5;
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+      ret = skip_value(reader, depth + 1);
+    }
+    break;
+  }
+  default:
+    return -1;
+  }
+
+  if (reader->pos != start) {
+    // nested value has been skipped
+    if (ret < 0) {
+      reader->pos = start;
+    }
+    return ret;
+  }
+
+  if (remaining(reader) < length) {
+    return -1;
+  }
+  reader->pos += length;
+  return 0;
+}
+
+int amf0_skip_value(AMF0Reader *reader) { return skip_value(reader, 0); }
+
+int amf0_read_object_string(AMF0Reader *reader, const char *name, char *value,
+                            size_t value_size) {
+  size_t start = reader->pos;
+  size_t name_size = strlen(name);
+  value[0] = '\0';
+
+  if (remaining(reader) < 1 || reader->data[reader->pos] != AMF0_OBJECT) {
+    return -1;
+  }
+  reader->pos += 1;
+
+  while (true) {
+    if (remaining(reader) < 3) {
+      goto error;
+    }
+    size_t property_length = read_uint(reader->data + reader->pos, 2);
+    if (property_length == 0 &&
+        reader->data[reader->pos + 2] == AMF0_OBJECT_END) {
+      reader->pos += 3;
+      return 0;
+    }
+    if (remaining(reader) < 2 + property_length) {
+      goto error;
+    }
+    const uint8_t *property = reader->data + reader->pos + 2;
+    reader->pos += 2 + property_length;
+
+    const char *string;
+    size_t string_length;
+    if (property_length == name_size &&
+        memcmp(property, name, name_size) == 0 &&
+        amf0_read_string(reader, &string, &string_length) == 0) {
+      size_t copied =
+          string_length < value_size - 1 ? string_length : value_size - 1;
+      memcpy(value, string, copied);
+      value[copied] = '\0';
+    } else if (amf0_skip_value(reader) < 0) {
+      goto error;
+    }
+  }
+
+error:
+  reader->pos = start;
+  value[0] = '\0';
+  return -1;
+}
+
+void amf0_buffer_init(AMF0Buffer *buffer) {
+  buffer->data = NULL;
+  buffer->size = 0;
+  buffer->capacity = 0;
+  buffer->failed = false;
+}
+
+void amf0_buffer_free(AMF0Buffer *buffer) {
+  free(buffer->data);
+  amf0_buffer_init(buffer);
+}
+
+int amf0_buffer_append(AMF0Buffer *buffer, const void *data, size_t size) {
+  if (buffer->failed) {
+    return -1;
+  }
+  if (buffer->size + size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < buffer->size + size) {
+      capacity *= 2;
+    }
+    uint8_t *grown = realloc(buffer->data, capacity);
+    if (!grown) {
+      buffer->failed = true;
+      return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+  return 0;
+}
+
+static void append_byte(AMF0Buffer *buffer, uint8_t byte) {
+  amf0_buffer_append(buffer, &byte, 1);
+}
+
+static void append_uint16(AMF0Buffer *buffer, uint16_t value) {
+  uint8_t bytes[2] = {value >> 8, value & 0xFF};
+  amf0_buffer_append(buffer, bytes, 2);
+}
+
+void amf0_write_number(AMF0Buffer *buffer, double value) {
+  uint64_t bits;
+  uint8_t bytes[8];
+  memcpy(&bits, &value, sizeof(bits));
+  for (int i = 7; i >= 0; i--) {
+    bytes[i] = bits & 0xFF;
+    bits >>= 8;
+  }
+  append_byte(buffer, AMF0_NUMBER);
+  amf0_buffer_append(buffer, bytes, 8);
+}
+
+void amf0_write_boolean(AMF0Buffer *buffer, bool value) {
+  append_byte(buffer, AMF0_BOOLEAN);
+  append_byte(buffer, value ? 1 : 0);
+}
+
+void amf0_write_string(AMF0Buffer *buffer, const char *value) {
+  size_t length = strlen(value);
+  append_byte(buffer, AMF0_STRING);
+  append_uint16(buffer, length);
+  amf0_buffer_append(buffer, value, length);
+}
+
+void amf0_write_null(AMF0Buffer *buffer) { append_byte(buffer, AMF0_NULL); }
+
+void amf0_write_object_start(AMF0Buffer *buffer) {
+  append_byte(buffer, AMF0_OBJECT);
+}
+
+void amf0_write_property(AMF0Buffer *buffer, const char *name) {
+  size_t length = strlen(name);
+  append_uint16(buffer, length);
+  amf0_buffer_append(buffer, name, length);
+}
+
+void amf0_write_object_end(AMF0Buffer *buffer) {
+  append_uint16(buffer, 0);
+  append_byte(buffer, AMF0_OBJECT_END);
+}
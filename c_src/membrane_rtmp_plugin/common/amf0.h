@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal AMF0 support, sufficient to exchange RTMP commands
+
+#define AMF0_NUMBER 0x00
+#define AMF0_BOOLEAN 0x01
+#define AMF0_STRING 0x02
+#define AMF0_OBJECT 0x03
+#define AMF0_NULL 0x05
+#define AMF0_UNDEFINED 0x06
+#define AMF0_ECMA_ARRAY 0x08
+#define AMF0_OBJECT_END 0x09
+#define AMF0_STRICT_ARRAY 0x0A
+#define AMF0_DATE 0x0B
+#define AMF0_LONG_STRING 0x0C
+
+#define AMF0_MAX_DEPTH 32
+
+typedef struct AMF0Reader {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+} AMF0Reader;
+
+void amf0_reader_init(AMF0Reader *reader, const uint8_t *data, size_t size);
+
+// All the reading functions return 0 on success and -1 if the value has
+// a different type or is malformed. The reader position is advanced only on
+// success.
+int amf0_read_number(AMF0Reader *reader, double *value);
+// The string is not copied nor NUL-terminated
+int amf0_read_string(AMF0Reader *reader, const char **value, size_t *length);
+// Objects and arrays nested deeper than AMF0_MAX_DEPTH are treated as
+// malformed, so that the values received from the clients can't exhaust
+// the stack
+int amf0_skip_value(AMF0Reader *reader);
+// Reads an object and copies the value of the string property `name` into
+// `value`, which is left empty if there is no such property.
+int amf0_read_object_string(AMF0Reader *reader, const char *name, char *value,
+                            size_t value_size);
+
+typedef struct AMF0Buffer {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  // Set once growing the buffer failed, after which nothing more is
+  // appended, so that the writers don't have to be checked one by one
+  bool failed;
+} AMF0Buffer;
+
+void amf0_buffer_init(AMF0Buffer *buffer);
+void amf0_buffer_free(AMF0Buffer *buffer);
+// Returns 0 on success and -1 if the buffer couldn't be grown
+int amf0_buffer_append(AMF0Buffer *buffer, const void *data, size_t size);
+
+void amf0_write_number(AMF0Buffer *buffer, double value);
+void amf0_write_boolean(AMF0Buffer *buffer, bool value);
+void amf0_write_string(AMF0Buffer *buffer, const char *value);
+void amf0_write_null(AMF0Buffer *buffer);
+void amf0_write_object_start(AMF0Buffer *buffer);
+// Writes the name of an object property, to be followed by its value
+void amf0_write_property(AMF0Buffer *buffer, const char *name);
+void amf0_write_object_end(AMF0Buffer *buffer);
@@ -0,0 +1,778 @@
+#include "destination.h"
+#include "tls.h"
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A write to a peer that doesn't read for that long, in microseconds, is
+// counted as blocked by the worker pool, so that it doesn't hold up the other
+// destinations
+#define BLOCKED_WRITE_THRESHOLD 20000
+
+// A callback invoked periodically by the blocking IO calls to check if they
+// should be interrupted. It's called by the thread doing the IO, the same one
+// that sets the deadline and starts the writes.
+static int interrupt_callback(void *opaque) {
+  Destination *destination = (Destination *)opaque;
+  if (destination->aborted) {
+    return 1;
+  }
+  int64_t now = av_gettime_relative();
+  if (destination->deadline > 0 && now > destination->deadline) {
+    return 1;
+  }
+  if (destination->write_started_at > 0 && !destination->write_blocked &&
+      now - destination->write_started_at > BLOCKED_WRITE_THRESHOLD) {
+    if (!worker_pool_block()) {
+      destination->blocked_writes_exceeded = true;
+      return 1;
+    }
+    destination->write_blocked = true;
+  }
+  return 0;
+}
+
+// Sets the deadline of the IO that follows, none for a timeout of 0
+static void set_deadline(Destination *destination, int64_t timeout) {
+  destination->deadline = timeout > 0 ? av_gettime_relative() + timeout : 0;
+}
+
+static bool deadline_passed(Destination *destination) {
+  return destination->deadline > 0 &&
+         av_gettime_relative() > destination->deadline;
+}
+
+static void set_failed(Destination *destination, const char *reason) {
+  if (destination->failed) {
+    return;
+  }
+  destination->failed = true;
+  snprintf(destination->error, sizeof(destination->error), "%s", reason);
+}
+
+static void free_chunk(Chunk *chunk) {
+  av_buffer_unref(&chunk->buffer);
+  free(chunk);
+}
+
+// Removes the first queued chunk, counting it as dropped if it's a frame
+static void drop_head(Destination *destination) {
+  Chunk *chunk = destination->head;
+  destination->head = chunk->next;
+  if (!destination->head) {
+    destination->tail = NULL;
+  }
+  destination->queued_bytes -= chunk->size;
+  if (chunk->info.type == CHUNK_VIDEO) {
+    destination->queued_video_chunks--;
+  }
+  if (chunk->info.type == CHUNK_VIDEO || chunk->info.type == CHUNK_AUDIO) {
+    destination->dropped_frames++;
+  }
+  free_chunk(chunk);
+}
+
+// Drops the chunks queued before the last key frame or all of them if there's
+// none, so that the stream can be resumed from the key frame. Called with the
+// mutex locked.
+static void trim_to_last_key_frame(Destination *destination) {
+  Chunk *key_frame = NULL;
+  for (Chunk *chunk = destination->head; chunk; chunk = chunk->next) {
+    if (chunk->info.type == CHUNK_VIDEO && chunk->info.key_frame) {
+      key_frame = chunk;
+    }
+  }
+  while (destination->head && destination->head != key_frame) {
+    drop_head(destination);
+  }
+  destination->skipping_video = !key_frame;
+}
+
+static void free_chunks(Destination *destination) {
+  while (destination->head) {
+    Chunk *chunk = destination->head;
+    destination->head = chunk->next;
+    free_chunk(chunk);
+  }
+  destination->tail = NULL;
+  destination->queued_bytes = 0;
+  destination->queued_video_chunks = 0;
+}
+
+int destination_init(Destination *destination, const char *url,
+                     bool native_io, uint32_t chunk_size,
+                     int64_t connect_timeout, const AVDictionary *options) {
+  memset(destination, 0, sizeof(Destination));
+  destination->native_io = native_io;
+  destination->chunk_size = chunk_size;
+  destination->connect_timeout = connect_timeout;
+  publisher_init(&destination->publisher);
+  destination->url = av_strdup(url);
+  destination->mutex = enif_mutex_create("rtmp_sink_destination_mutex");
+  destination->space_cond =
+      enif_cond_create("rtmp_sink_destination_space_cond");
+  if (!destination->url || !destination->mutex || !destination->space_cond ||
+      av_dict_copy(&destination->options, options, 0)) {
+    return AVERROR(ENOMEM);
+  }
+  // Holding the TLS context keeps the cached sessions, which would be
+  // dropped along with it when the last connection is closed to reconnect
+  if (native_io && av_strstart(url, "rtmps://", NULL)) {
+    int av_err = tls_context_acquire();
+    if (av_err < 0) {
+      return av_err;
+    }
+    destination->tls_context_acquired = true;
+  }
+  return 0;
+}
+
+static int acquire_pool(Destination *destination) {
+  if (destination->pool_acquired) {
+    return 0;
+  }
+  int av_err = worker_pool_acquire();
+  destination->pool_acquired = av_err >= 0;
+  return av_err;
+}
+
+static int get_int_option(const AVDictionary *options, const char *name,
+                          int default_value) {
+  AVDictionaryEntry *entry = av_dict_get(options, name, NULL, 0);
+  return entry ? atoi(entry->value) : default_value;
+}
+
+// Same options as the ones of FFmpeg's TCP and TLS protocols, apart from
+// `kernel_tls`
+static SocketOptions get_socket_options(const AVDictionary *options) {
+  return (SocketOptions){
+      .send_buffer_size = get_int_option(options, "send_buffer_size", 0),
+      .recv_buffer_size = get_int_option(options, "recv_buffer_size", 0),
+      // The publisher writes each message at once, so by default there's
+      // nothing to coalesce
+      .tcp_nodelay = get_int_option(options, "tcp_nodelay", 1),
+      .tls_verify = get_int_option(options, "tls_verify", 1),
+      .kernel_tls = get_int_option(options, "kernel_tls", 0)};
+}
+
+int destination_connect(Destination *destination) {
+  AVIOInterruptCB int_cb = {.callback = interrupt_callback,
+                            .opaque = destination};
+  int av_err;
+  // A server accepting the connection but never answering mustn't hold
+  // the thread forever
+  set_deadline(destination, destination->connect_timeout);
+  if (destination->native_io) {
+    av_err = publisher_open(&destination->publisher, destination->url,
+                            destination->chunk_size,
+                            get_socket_options(destination->options), int_cb);
+  } else {
+    // The options consumed by the protocols are removed from the dictionary
+    AVDictionary *options = NULL;
+    av_err = av_dict_copy(&options, destination->options, 0);
+    if (av_err >= 0) {
+      av_err = avio_open2(&destination->pb, destination->url, AVIO_FLAG_WRITE,
+                          &int_cb, &options);
+    }
+    av_dict_free(&options);
+  }
+  if (av_err < 0 && deadline_passed(destination)) {
+    av_err = AVERROR(ETIMEDOUT);
+  }
+  destination->deadline = 0;
+  if (av_err >= 0) {
+    destination->connected = true;
+  }
+  return av_err;
+}
+
+static void record_latency(Destination *destination, ChunkInfo *info) {
+  if (info->entry_time == 0) {
+    return;
+  }
+  int64_t latency = av_gettime_relative() - info->entry_time;
+  int bucket = 0;
+  for (int64_t bound = 1000; bucket < LATENCY_BUCKETS - 1 && latency >= bound;
+       bound *= 2) {
+    bucket++;
+  }
+  destination->latency_histogram[bucket]++;
+}
+
+static int send_data(Destination *destination, const uint8_t *data,
+                     int size) {
+  if (destination->native_io) {
+    return publisher_write(&destination->publisher, data, size);
+  }
+  avio_write(destination->pb, data, size);
+  avio_flush(destination->pb);
+  return destination->pb->error;
+}
+
+static void connect_in_background(PoolTask *task) {
+  Destination *destination = (Destination *)task->opaque;
+  int av_err = destination_connect(destination);
+
+  enif_mutex_lock(destination->mutex);
+  destination->connect_result = av_err;
+  destination->connecting = false;
+  enif_cond_broadcast(destination->space_cond);
+  enif_mutex_unlock(destination->mutex);
+}
+
+int destination_start_connecting(Destination *destination) {
+  if (destination->connected || destination->connect_pending) {
+    return 0;
+  }
+  int av_err = acquire_pool(destination);
+  if (av_err < 0) {
+    return av_err;
+  }
+
+  destination->connect_task = (PoolTask){
+      .run = connect_in_background, .opaque = destination, .blocking = true};
+  enif_mutex_lock(destination->mutex);
+  destination->connecting = true;
+  destination->connect_pending = true;
+  worker_pool_schedule(&destination->connect_task);
+  enif_mutex_unlock(destination->mutex);
+  return 0;
+}
+
+int destination_await_connection(Destination *destination) {
+  if (!destination->connect_pending) {
+    return destination->connected ? 0 : AVERROR(ENOTCONN);
+  }
+  enif_mutex_lock(destination->mutex);
+  while (destination->connecting) {
+    enif_cond_wait(destination->space_cond, destination->mutex);
+  }
+  destination->connect_pending = false;
+  int av_err = destination->connect_result;
+  enif_mutex_unlock(destination->mutex);
+  return av_err;
+}
+
+// Chunks written in a row before the thread is yielded to the other
+// destinations
+#define CHUNKS_PER_TURN 16
+
+// Called with the mutex locked
+static void schedule(Destination *destination) {
+  if (!destination->scheduled) {
+    destination->scheduled = true;
+    worker_pool_schedule(&destination->task);
+  }
+}
+
+// Called with the mutex locked
+static void wait_until_idle(Destination *destination) {
+  while (destination->scheduled) {
+    enif_cond_wait(destination->space_cond, destination->mutex);
+  }
+}
+
+// Task writing the queued chunks, run by the worker pool
+static void write_queued_chunks(PoolTask *task) {
+  Destination *destination = (Destination *)task->opaque;
+
+  enif_mutex_lock(destination->mutex);
+  for (int i = 0; i < CHUNKS_PER_TURN; i++) {
+    if (destination->aborted || !destination->head) {
+      break;
+    }
+
+    Chunk *chunk = destination->head;
+    destination->head = chunk->next;
+    if (!destination->head) {
+      destination->tail = NULL;
+    }
+    enif_mutex_unlock(destination->mutex);
+
+    set_deadline(destination, destination->limits.write_timeout);
+    destination->write_started_at = av_gettime_relative();
+    int av_err = send_data(destination, chunk->buffer->data, chunk->size);
+    bool timed_out = av_err < 0 && deadline_passed(destination);
+    destination->deadline = 0;
+    destination->write_started_at = 0;
+    if (destination->write_blocked) {
+      worker_pool_unblock();
+      destination->write_blocked = false;
+    }
+    bool blocked_writes_exceeded = destination->blocked_writes_exceeded;
+    destination->blocked_writes_exceeded = false;
+
+    enif_mutex_lock(destination->mutex);
+    if (av_err >= 0) {
+      record_latency(destination, &chunk->info);
+    }
+    destination->queued_bytes -= chunk->size;
+    if (chunk->info.type == CHUNK_VIDEO) {
+      destination->queued_video_chunks--;
+    }
+    free_chunk(chunk);
+    enif_cond_signal(destination->space_cond);
+
+    if (av_err < 0) {
+      if (blocked_writes_exceeded) {
+        set_failed(destination, "Too many blocked writes");
+      } else {
+        set_failed(destination,
+                   timed_out ? "Write timed out" : av_err2str(av_err));
+      }
+      break;
+    }
+  }
+
+  bool failed = destination->failed;
+  if (!failed && !destination->aborted && destination->head) {
+    // The rest is written in the next turn
+    worker_pool_schedule(task);
+    enif_mutex_unlock(destination->mutex);
+    return;
+  }
+
+  if (failed) {
+    if (destination->limits.resumable) {
+      trim_to_last_key_frame(destination);
+    }
+    // The destination can't be closed before the task stops, so it's safe
+    // to use it without the mutex
+    enif_mutex_unlock(destination->mutex);
+    if (destination->on_failure) {
+      destination->on_failure(destination, destination->on_failure_opaque);
+    }
+    enif_mutex_lock(destination->mutex);
+  }
+  destination->scheduled = false;
+  // Wake up the producer, so that it doesn't wait for the stopped task, and
+  // the ones waiting for the task to stop
+  enif_cond_broadcast(destination->space_cond);
+  enif_mutex_unlock(destination->mutex);
+}
+
+int destination_start_async(Destination *destination, QueueLimits limits,
+                            DestinationFailureCallback on_failure,
+                            void *opaque) {
+  int av_err = acquire_pool(destination);
+  if (av_err < 0) {
+    return av_err;
+  }
+
+  destination->task =
+      (PoolTask){.run = write_queued_chunks, .opaque = destination};
+  destination->limits = limits;
+  destination->on_failure = on_failure;
+  destination->on_failure_opaque = opaque;
+  destination->async = true;
+  return 0;
+}
+
+static int64_t oldest_queued_dts(Destination *destination) {
+  for (Chunk *chunk = destination->head; chunk; chunk = chunk->next) {
+    if (chunk->info.dts != AV_NOPTS_VALUE) {
+      return chunk->info.dts;
+    }
+  }
+  return AV_NOPTS_VALUE;
+}
+
+static bool fits_in_queue(Destination *destination, int size,
+                          ChunkInfo *info) {
+  if (!destination->head) {
+    return true;
+  }
+  if (destination->queued_bytes + size > destination->limits.max_bytes) {
+    return false;
+  }
+
+  int64_t oldest_dts = oldest_queued_dts(destination);
+  return destination->limits.max_duration <= 0 ||
+         info->dts == AV_NOPTS_VALUE || oldest_dts == AV_NOPTS_VALUE ||
+         info->dts - oldest_dts <= destination->limits.max_duration;
+}
+
+// Drops all the queued video when its oldest frame has waited too long, so
+// that the latency is brought back down by skipping the rest of the GOP. The
+// stream resumes at the next key frame, while the audio is kept. Called with
+// the mutex locked.
+static void shed_congestion(Destination *destination) {
+  OverflowPolicy policy = destination->limits.overflow_policy;
+  if (destination->limits.max_latency <= 0 ||
+      (policy != OVERFLOW_DROP_NON_KEY_FRAMES &&
+       policy != OVERFLOW_DROP_AUDIO_LAST)) {
+    return;
+  }
+
+  Chunk *oldest_video = destination->head;
+  while (oldest_video && oldest_video->info.type != CHUNK_VIDEO) {
+    oldest_video = oldest_video->next;
+  }
+  if (!oldest_video || av_gettime_relative() - oldest_video->queued_at <=
+                           destination->limits.max_latency) {
+    return;
+  }
+
+  Chunk **link = &destination->head;
+  destination->tail = NULL;
+  while (*link) {
+    Chunk *chunk = *link;
+    if (chunk->info.type != CHUNK_VIDEO) {
+      destination->tail = chunk;
+      link = &chunk->next;
+      continue;
+    }
+    *link = chunk->next;
+    destination->queued_bytes -= chunk->size;
+    destination->queued_video_chunks--;
+    destination->dropped_frames++;
+    free_chunk(chunk);
+  }
+  destination->skipping_video = true;
+  destination->congestion_drops++;
+  // The producer might be waiting for the space that's been freed
+  enif_cond_signal(destination->space_cond);
+}
+
+// Decides if the chunk should be queued when the queue is full.
+// Returns false if the chunk has to be dropped. Called with the mutex locked.
+static bool handle_overflow(Destination *destination, int size,
+                            ChunkInfo *info) {
+  OverflowPolicy policy = destination->limits.overflow_policy;
+  while (!fits_in_queue(destination, size, info)) {
+    if (destination->failed || destination->aborted) {
+      return false;
+    }
+
+    switch (policy) {
+    case OVERFLOW_BLOCK:
+      enif_cond_wait(destination->space_cond, destination->mutex);
+      break;
+
+    case OVERFLOW_DROP_NON_KEY_FRAMES:
+    case OVERFLOW_DROP_AUDIO_LAST:
+      if (info->type == CHUNK_VIDEO) {
+        // Once a frame is dropped, the following ones can't be decoded until
+        // the next key frame
+        destination->skipping_video = true;
+        return false;
+      }
+      if (info->type == CHUNK_AUDIO && policy == OVERFLOW_DROP_AUDIO_LAST &&
+          destination->queued_video_chunks == 0) {
+        return false;
+      }
+      // Audio, headers and trailer are let through, as they are small and
+      // dropping them would break the stream
+      return true;
+
+    case OVERFLOW_DISCONNECT:
+      // The task stops once the pending write is interrupted
+      set_failed(destination, "Send queue overflow");
+      destination->aborted = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decides if the chunk should be kept while the destination is waiting to be
+// reconnected. Only the chunks since the last key frame are kept, as the
+// stream can't be resumed from any earlier. Called with the mutex locked.
+static bool hold_for_reconnection(Destination *destination, int size,
+                                  ChunkInfo *info) {
+  if (info->type == CHUNK_VIDEO && info->key_frame) {
+    while (destination->head) {
+      drop_head(destination);
+    }
+    destination->skipping_video = false;
+  }
+  if (destination->skipping_video &&
+      (info->type == CHUNK_VIDEO || info->type == CHUNK_AUDIO)) {
+    return false;
+  }
+  if (destination->queued_bytes + size > destination->limits.max_bytes) {
+    while (destination->head) {
+      drop_head(destination);
+    }
+    destination->skipping_video = true;
+    return false;
+  }
+  return true;
+}
+
+// Writes the chunk or, if the destination is asynchronous, queues it.
+// Asynchronous destinations report their failures with the failure callback,
+// for them an error is returned only if the chunk couldn't be queued.
+int destination_write(Destination *destination, AVBufferRef *buffer, int size,
+                      ChunkInfo info) {
+  if (!destination->async) {
+    int av_err = send_data(destination, buffer->data, size);
+    if (av_err >= 0) {
+      record_latency(destination, &info);
+    }
+    return av_err;
+  }
+
+  Chunk *chunk = malloc(sizeof(Chunk));
+  if (!chunk) {
+    return AVERROR(ENOMEM);
+  }
+  chunk->buffer = av_buffer_ref(buffer);
+  chunk->size = size;
+  chunk->info = info;
+  chunk->queued_at = av_gettime_relative();
+  chunk->next = NULL;
+  if (!chunk->buffer) {
+    free(chunk);
+    return AVERROR(ENOMEM);
+  }
+
+  enif_mutex_lock(destination->mutex);
+  if (destination->failed && !destination->limits.resumable) {
+    enif_mutex_unlock(destination->mutex);
+    free_chunk(chunk);
+    return 0;
+  }
+
+  bool queued = true;
+  if (destination->failed) {
+    queued = hold_for_reconnection(destination, size, &info);
+  } else {
+    shed_congestion(destination);
+    if (info.type == CHUNK_VIDEO && destination->skipping_video) {
+      queued = info.key_frame && fits_in_queue(destination, size, &info);
+      destination->skipping_video = !queued;
+    }
+    queued = queued && handle_overflow(destination, size, &info);
+  }
+
+  if (!queued) {
+    if (info.type == CHUNK_VIDEO || info.type == CHUNK_AUDIO) {
+      destination->dropped_frames++;
+    }
+    enif_mutex_unlock(destination->mutex);
+    free_chunk(chunk);
+    return 0;
+  }
+
+  if (destination->tail) {
+    destination->tail->next = chunk;
+  } else {
+    destination->head = chunk;
+  }
+  destination->tail = chunk;
+  destination->queued_bytes += size;
+  if (info.type == CHUNK_VIDEO) {
+    destination->queued_video_chunks++;
+  }
+  // The chunks held for the reconnection are written once it succeeds
+  if (!destination->failed) {
+    schedule(destination);
+  }
+  enif_mutex_unlock(destination->mutex);
+  return 0;
+}
+
+// Puts the stream header in front of the chunks kept for the reconnection,
+// unless it's queued already because the destination failed before it was
+// written. Called with the mutex locked.
+static int queue_reconnection_header(Destination *destination) {
+  AVBufferRef *header = destination->reconnection_header;
+  bool header_queued =
+      destination->head && destination->head->info.type == CHUNK_HEADER;
+  if (!header || header_queued) {
+    return 0;
+  }
+
+  Chunk *chunk = malloc(sizeof(Chunk));
+  if (!chunk) {
+    return AVERROR(ENOMEM);
+  }
+  chunk->buffer = header;
+  destination->reconnection_header = NULL;
+  chunk->size = destination->reconnection_header_size;
+  chunk->info = (ChunkInfo){.type = CHUNK_HEADER, .dts = AV_NOPTS_VALUE};
+  chunk->queued_at = av_gettime_relative();
+  chunk->next = destination->head;
+  destination->head = chunk;
+  if (!destination->tail) {
+    destination->tail = chunk;
+  }
+  destination->queued_bytes += chunk->size;
+  return 0;
+}
+
+static void reconnect_in_background(PoolTask *task) {
+  Destination *destination = (Destination *)task->opaque;
+  // The broken connection is closed here too, as closing it might send
+  // the pending data
+  set_deadline(destination, destination->connect_timeout);
+  if (destination->pb) {
+    avio_closep(&destination->pb);
+  }
+  publisher_close(&destination->publisher, false);
+  destination->connected = false;
+
+  int av_err = destination_connect(destination);
+
+  enif_mutex_lock(destination->mutex);
+  if (av_err >= 0) {
+    av_err = queue_reconnection_header(destination);
+  }
+  if (av_err >= 0) {
+    destination->failed = false;
+    destination->error[0] = '\0';
+    if (destination->head) {
+      schedule(destination);
+    }
+  }
+  av_buffer_unref(&destination->reconnection_header);
+  enif_mutex_unlock(destination->mutex);
+
+  // The destination can't be closed before the task stops, so it's safe to
+  // use it without the mutex
+  destination->on_reconnection(destination, av_err,
+                               destination->on_failure_opaque);
+
+  enif_mutex_lock(destination->mutex);
+  destination->connecting = false;
+  enif_cond_broadcast(destination->space_cond);
+  enif_mutex_unlock(destination->mutex);
+}
+
+int destination_start_reconnecting(
+    Destination *destination, AVBufferRef *header, int header_size,
+    DestinationReconnectionCallback on_reconnection) {
+  // Only the asynchronous destinations can resume the stream
+  if (!destination->async) {
+    return AVERROR(EINVAL);
+  }
+  enif_mutex_lock(destination->mutex);
+  if (destination->connecting) {
+    enif_mutex_unlock(destination->mutex);
+    return AVERROR(EBUSY);
+  }
+  bool failed = destination->failed;
+  if (failed) {
+    // The task stops once the destination fails
+    wait_until_idle(destination);
+  }
+  enif_mutex_unlock(destination->mutex);
+  if (!failed) {
+    return 0;
+  }
+
+  if (header) {
+    destination->reconnection_header = av_buffer_ref(header);
+    if (!destination->reconnection_header) {
+      return AVERROR(ENOMEM);
+    }
+    destination->reconnection_header_size = header_size;
+  }
+  destination->on_reconnection = on_reconnection;
+  destination->aborted = false;
+  destination->connect_task = (PoolTask){
+      .run = reconnect_in_background, .opaque = destination, .blocking = true};
+
+  enif_mutex_lock(destination->mutex);
+  destination->connecting = true;
+  worker_pool_schedule(&destination->connect_task);
+  enif_mutex_unlock(destination->mutex);
+  return 0;
+}
+
+void destination_get_queue_stats(Destination *destination,
+                                 uint64_t *queued_bytes,
+                                 int64_t *queued_duration,
+                                 uint64_t *dropped_frames,
+                                 uint64_t *congestion_drops) {
+  *queued_bytes = 0;
+  *queued_duration = 0;
+  *dropped_frames = 0;
+  *congestion_drops = 0;
+  if (!destination->async) {
+    return;
+  }
+
+  enif_mutex_lock(destination->mutex);
+  *queued_bytes = destination->queued_bytes;
+  *dropped_frames = destination->dropped_frames;
+  *congestion_drops = destination->congestion_drops;
+  int64_t oldest_dts = oldest_queued_dts(destination);
+  for (Chunk *chunk = destination->head; chunk; chunk = chunk->next) {
+    if (oldest_dts != AV_NOPTS_VALUE && chunk->info.dts != AV_NOPTS_VALUE) {
+      *queued_duration = FFMAX(*queued_duration, chunk->info.dts - oldest_dts);
+    }
+  }
+  enif_mutex_unlock(destination->mutex);
+}
+
+void destination_get_latency_histogram(Destination *destination,
+                                       uint64_t *histogram) {
+  if (destination->async) {
+    enif_mutex_lock(destination->mutex);
+  }
+  memcpy(histogram, destination->latency_histogram,
+         sizeof(destination->latency_histogram));
+  if (destination->async) {
+    enif_mutex_unlock(destination->mutex);
+  }
+}
+
+// Blocks until all the queued chunks are written
+void destination_finish(Destination *destination) {
+  if (!destination->async) {
+    return;
+  }
+  enif_mutex_lock(destination->mutex);
+  wait_until_idle(destination);
+  enif_mutex_unlock(destination->mutex);
+}
+
+void destination_close(Destination *destination) {
+  if (destination->mutex) {
+    enif_mutex_lock(destination->mutex);
+    // The pending connection attempt and writes are interrupted, the tasks
+    // are waited for only if they're already running
+    if (destination->connecting || destination->scheduled) {
+      destination->aborted = true;
+    }
+    if (destination->connecting &&
+        worker_pool_unschedule(&destination->connect_task)) {
+      destination->connecting = false;
+    }
+    if (destination->scheduled &&
+        worker_pool_unschedule(&destination->task)) {
+      destination->scheduled = false;
+    }
+    while (destination->connecting || destination->scheduled) {
+      enif_cond_wait(destination->space_cond, destination->mutex);
+    }
+    enif_mutex_unlock(destination->mutex);
+  }
+  if (destination->pool_acquired) {
+    worker_pool_release();
+  }
+  free_chunks(destination);
+  av_buffer_unref(&destination->reconnection_header);
+
+  if (destination->mutex) {
+    enif_mutex_destroy(destination->mutex);
+  }
+  if (destination->space_cond) {
+    enif_cond_destroy(destination->space_cond);
+  }
+  if (destination->pb) {
+    avio_closep(&destination->pb);
+  }
+  // The stream is unpublished only if it was sent entirely
+  publisher_close(&destination->publisher,
+                  !destination->failed && !destination->aborted);
+  if (destination->tls_context_acquired) {
+    tls_context_release();
+  }
+  av_freep(&destination->url);
+  av_dict_free(&destination->options);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "publisher.h"
+#include "worker_pool.h"
+#include <libavformat/avformat.h>
+#include <stdbool.h>
+#include <unifex/unifex.h>
+
+typedef enum ChunkType {
+  CHUNK_HEADER,
+  // Sequence header with a codec configuration received mid-stream
+  CHUNK_CODEC_HEADER,
+  CHUNK_VIDEO,
+  CHUNK_AUDIO,
+  CHUNK_TRAILER
+} ChunkType;
+
+typedef struct ChunkInfo {
+  ChunkType type;
+  // In AV_TIME_BASE units, AV_NOPTS_VALUE for the headers and the trailer
+  int64_t dts;
+  bool key_frame;
+  // Time the frame was passed to the sink, as returned by
+  // av_gettime_relative, or 0 if its latency isn't traced
+  int64_t entry_time;
+} ChunkInfo;
+
+typedef struct Chunk Chunk;
+
+// Piece of the muxed stream - a reference to the buffer is shared by all the
+// destinations the chunk is queued for.
+struct Chunk {
+  AVBufferRef *buffer;
+  int size;
+  ChunkInfo info;
+  // Time the chunk was queued, as returned by av_gettime_relative
+  int64_t queued_at;
+  Chunk *next;
+};
+
+// What happens to a chunk that doesn't fit in the send queue
+typedef enum OverflowPolicy {
+  // Wait until the queue has room for it
+  OVERFLOW_BLOCK,
+  // Drop video until the next key frame that fits, audio is always queued
+  OVERFLOW_DROP_NON_KEY_FRAMES,
+  // Like OVERFLOW_DROP_NON_KEY_FRAMES, but also drop audio when there's no
+  // video left in the queue
+  OVERFLOW_DROP_AUDIO_LAST,
+  // Abort the destination
+  OVERFLOW_DISCONNECT
+} OverflowPolicy;
+
+typedef struct QueueLimits {
+  size_t max_bytes;
+  // Maximal span of the queued media in AV_TIME_BASE units, 0 for unlimited
+  int64_t max_duration;
+  OverflowPolicy overflow_policy;
+  // With the dropping policies, the queued video is dropped once its oldest
+  // frame has waited longer than that, in microseconds, 0 for unlimited
+  int64_t max_latency;
+  // The destination fails when writing a chunk takes longer than that, in
+  // microseconds, so that a peer that stops reading doesn't hold a thread of
+  // the worker pool forever, 0 for unlimited
+  int64_t write_timeout;
+  // Whether a failed destination keeps the chunks since the last key frame,
+  // up to max_bytes, to send them once it's reconnected
+  bool resumable;
+} QueueLimits;
+
+// Buckets of the latency histograms are consecutive powers of two
+// milliseconds: the first one counts the latencies below 1 ms and the last one
+// those of 2^(LATENCY_BUCKETS - 2) ms or more
+#define LATENCY_BUCKETS 16
+
+typedef struct Destination Destination;
+
+typedef void (*DestinationFailureCallback)(Destination *destination,
+                                           void *opaque);
+
+// Called with the result of reconnecting, 0 on success or an AVERROR code
+typedef void (*DestinationReconnectionCallback)(Destination *destination,
+                                                int result, void *opaque);
+
+struct Destination {
+  char *url;
+  AVIOContext *pb;
+  bool connected;
+  // When set, the stream is sent with the native publisher instead of
+  // FFmpeg's RTMP protocol
+  bool native_io;
+  uint32_t chunk_size;
+  Publisher publisher;
+  // Protocol options of FFmpeg, the socket ones apply to the publisher too
+  AVDictionary *options;
+  // Whether a reference to the worker pool is held
+  bool pool_acquired;
+  // Whether a reference to the TLS context of the native publishers is held
+  bool tls_context_acquired;
+
+  // Connecting in the background, with the result kept until it's awaited
+  PoolTask connect_task;
+  // Time given to connecting and publishing the stream, in microseconds,
+  // 0 for unlimited
+  int64_t connect_timeout;
+  bool connecting;
+  bool connect_pending;
+  int connect_result;
+  // Stream header sent first once reconnected
+  AVBufferRef *reconnection_header;
+  int reconnection_header_size;
+  DestinationReconnectionCallback on_reconnection;
+
+  // When asynchronous, chunks are written by the threads of the worker pool
+  bool async;
+  PoolTask task;
+  // Set while the task writing the queued chunks is scheduled or running
+  bool scheduled;
+  ErlNifMutex *mutex;
+  // Signalled when a chunk is written, for the blocked producer, and when
+  // one of the tasks stops
+  ErlNifCond *space_cond;
+  Chunk *head;
+  Chunk *tail;
+  size_t queued_bytes;
+  int queued_video_chunks;
+  QueueLimits limits;
+  // Set when video is dropped until the next key frame
+  bool skipping_video;
+  uint64_t dropped_frames;
+  // Number of times the queued video was dropped because of the latency
+  uint64_t congestion_drops;
+  // Time from passing the frames to the sink until they're handed to the
+  // socket
+  uint64_t latency_histogram[LATENCY_BUCKETS];
+  // Set when the pending IO has to be interrupted
+  volatile bool aborted;
+  // Time by which connecting or sending the chunk being written by
+  // the worker pool has to complete, as returned by av_gettime_relative, or 0
+  // if there's no deadline
+  int64_t deadline;
+  // Time the chunk being written by the worker pool started being sent, as
+  // returned by av_gettime_relative, or 0 if nothing is being sent
+  int64_t write_started_at;
+  // Whether the pending write is counted as blocked by the worker pool
+  bool write_blocked;
+  // Set when the pending write is interrupted, as too many are blocked
+  bool blocked_writes_exceeded;
+
+  bool failed;
+  char error[128];
+  DestinationFailureCallback on_failure;
+  void *on_failure_opaque;
+};
+
+int destination_init(Destination *destination, const char *url,
+                     bool native_io, uint32_t chunk_size,
+                     int64_t connect_timeout, const AVDictionary *options);
+
+int destination_connect(Destination *destination);
+
+// Starts connecting with the worker pool, unless the destination is connected
+// or the result of connecting is still to be awaited
+int destination_start_connecting(Destination *destination);
+
+// Waits until the connection started with destination_start_connecting is
+// established and returns its result
+int destination_await_connection(Destination *destination);
+
+// Makes the destination asynchronous, with the queued chunks written by
+// the worker pool
+int destination_start_async(Destination *destination, QueueLimits limits,
+                            DestinationFailureCallback on_failure,
+                            void *opaque);
+
+int destination_write(Destination *destination, AVBufferRef *buffer, int size,
+                      ChunkInfo info);
+
+// Starts connecting the failed destination again with the worker pool. Once
+// it's connected, writing is resumed, starting with the stream header
+// followed by the chunks kept since the last key frame. The result is passed
+// to `on_reconnection`, called with the opaque of the failure callback.
+// Returns 0 without calling it if the destination hasn't failed.
+int destination_start_reconnecting(
+    Destination *destination, AVBufferRef *header, int header_size,
+    DestinationReconnectionCallback on_reconnection);
+
+void destination_get_queue_stats(Destination *destination,
+                                 uint64_t *queued_bytes,
+                                 int64_t *queued_duration,
+                                 uint64_t *dropped_frames,
+                                 uint64_t *congestion_drops);
+
+void destination_get_latency_histogram(Destination *destination,
+                                       uint64_t *histogram);
+
+void destination_finish(Destination *destination);
+
+void destination_close(Destination *destination);
@@ -0,0 +1,124 @@
+#include "interleaver.h"
+#include <stdlib.h>
+#include <string.h>
+
+static AVPacket *queue_at(PacketQueue *queue, int idx) {
+  return queue->packets[(queue->start + idx) % queue->capacity];
+}
+
+static int queue_grow(PacketQueue *queue) {
+  int capacity = queue->capacity ? queue->capacity * 2 : 16;
+  AVPacket **packets = malloc(capacity * sizeof(AVPacket *));
+  if (!packets) {
+    return AVERROR(ENOMEM);
+  }
+
+  // Unwind the ring, so that the queued packets start at the beginning
+  for (int i = 0; i < queue->capacity; i++) {
+    packets[i] = queue_at(queue, i);
+  }
+  for (int i = queue->capacity; i < capacity; i++) {
+    packets[i] = av_packet_alloc();
+    if (!packets[i]) {
+      for (int j = queue->capacity; j < i; j++) {
+        av_packet_free(&packets[j]);
+      }
+      free(packets);
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  free(queue->packets);
+  queue->packets = packets;
+  queue->capacity = capacity;
+  queue->start = 0;
+  return 0;
+}
+
+void interleaver_init(Interleaver *interleaver, int64_t max_delta) {
+  memset(interleaver, 0, sizeof(Interleaver));
+  interleaver->max_delta = max_delta;
+}
+
+// Takes over the packet's reference
+int interleaver_push(Interleaver *interleaver, AVPacket *packet,
+                     AVRational time_base) {
+  if (packet->stream_index < 0 ||
+      packet->stream_index >= INTERLEAVER_MAX_STREAMS) {
+    return AVERROR(EINVAL);
+  }
+
+  PacketQueue *queue = &interleaver->queues[packet->stream_index];
+  if (queue->size == queue->capacity) {
+    int ret = queue_grow(queue);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  queue->time_base = time_base;
+  av_packet_move_ref(queue_at(queue, queue->size), packet);
+  queue->size++;
+  return 0;
+}
+
+static int64_t queue_dts(PacketQueue *queue, int idx) {
+  return av_rescale_q(queue_at(queue, idx)->dts, queue->time_base,
+                      AV_TIME_BASE_Q);
+}
+
+// Moves the next packet in the DTS order to `packet`, if it can be released.
+// When flushing, the queued packets are released unconditionally.
+bool interleaver_pop(Interleaver *interleaver, AVPacket *packet, bool flush) {
+  PacketQueue *next = NULL;
+  bool all_queued = true;
+  for (int i = 0; i < INTERLEAVER_MAX_STREAMS; i++) {
+    PacketQueue *queue = &interleaver->queues[i];
+    if (queue->size == 0) {
+      all_queued = false;
+    } else if (!next || queue_dts(queue, 0) < queue_dts(next, 0)) {
+      next = queue;
+    }
+  }
+  if (!next) {
+    return false;
+  }
+
+  bool ready = flush || all_queued;
+  for (int i = 0; i < INTERLEAVER_MAX_STREAMS && !ready; i++) {
+    PacketQueue *queue = &interleaver->queues[i];
+    if (queue->size > 0 && queue_dts(queue, queue->size - 1) -
+                                   queue_dts(next, 0) >
+                               interleaver->max_delta) {
+      ready = true;
+    }
+  }
+  if (!ready) {
+    return false;
+  }
+
+  av_packet_move_ref(packet, queue_at(next, 0));
+  next->start = (next->start + 1) % next->capacity;
+  next->size--;
+  return true;
+}
+
+int interleaver_queued_packets(Interleaver *interleaver) {
+  int queued = 0;
+  for (int i = 0; i < INTERLEAVER_MAX_STREAMS; i++) {
+    queued += interleaver->queues[i].size;
+  }
+  return queued;
+}
+
+void interleaver_free(Interleaver *interleaver) {
+  for (int i = 0; i < INTERLEAVER_MAX_STREAMS; i++) {
+    PacketQueue *queue = &interleaver->queues[i];
+    for (int j = 0; j < queue->capacity; j++) {
+      av_packet_free(&queue->packets[j]);
+    }
+    free(queue->packets);
+    queue->packets = NULL;
+    queue->capacity = queue->size = queue->start = 0;
+  }
+}
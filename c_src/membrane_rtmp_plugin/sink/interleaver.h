@@ -0,0 +1,36 @@
+#pragma once
+
+#include <libavformat/avformat.h>
+#include <stdbool.h>
+
+#define INTERLEAVER_MAX_STREAMS 2
+
+typedef struct PacketQueue {
+  // Ring buffer of packets, which are allocated once and reused
+  AVPacket **packets;
+  int capacity;
+  int start;
+  int size;
+  AVRational time_base;
+} PacketQueue;
+
+// Orders packets of all the streams by their DTS before they are muxed,
+// similarly to av_interleaved_write_frame. A packet is released once every
+// stream has a packet queued, or when the queued packets span more than
+// max_delta.
+typedef struct Interleaver {
+  PacketQueue queues[INTERLEAVER_MAX_STREAMS];
+  // In AV_TIME_BASE units
+  int64_t max_delta;
+} Interleaver;
+
+void interleaver_init(Interleaver *interleaver, int64_t max_delta);
+
+int interleaver_push(Interleaver *interleaver, AVPacket *packet,
+                     AVRational time_base);
+
+bool interleaver_pop(Interleaver *interleaver, AVPacket *packet, bool flush);
+
+int interleaver_queued_packets(Interleaver *interleaver);
+
+void interleaver_free(Interleaver *interleaver);
@@ -0,0 +1,1079 @@
+#include "publisher.h"
+#include "../common/amf0.h"
+#include "tls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libavutil/avstring.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RTMP_DEFAULT_PORT 1935
+#define RTMPS_DEFAULT_PORT 443
+#define RTMP_VERSION 3
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+// basic header, type 0 message header and extended timestamp
+#define MAX_CHUNK_HEADER_SIZE (1 + 11 + 4)
+#define RECEIVE_SIZE 4096
+// How often the interrupt callback is checked while waiting for the socket
+#define POLL_INTERVAL_MS 100
+
+#define MESSAGE_SET_CHUNK_SIZE 1
+#define MESSAGE_ABORT 2
+#define MESSAGE_USER_CONTROL 4
+#define MESSAGE_AUDIO 8
+#define MESSAGE_VIDEO 9
+#define MESSAGE_DATA 18
+#define MESSAGE_AMF0_COMMAND 20
+
+#define CONTROL_CHUNK_STREAM 2
+#define COMMAND_CHUNK_STREAM 3
+#define AUDIO_CHUNK_STREAM 4
+#define DATA_CHUNK_STREAM 5
+#define VIDEO_CHUNK_STREAM 6
+
+#define USER_CONTROL_PING_REQUEST 6
+#define USER_CONTROL_PING_RESPONSE 7
+
+#define TRANSACTION_CONNECT 1
+#define TRANSACTION_RELEASE_STREAM 2
+#define TRANSACTION_FC_PUBLISH 3
+#define TRANSACTION_CREATE_STREAM 4
+#define TRANSACTION_PUBLISH 5
+#define TRANSACTION_FC_UNPUBLISH 6
+#define TRANSACTION_DELETE_STREAM 7
+
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_PREVIOUS_TAG_SIZE_SIZE 4
+
+// Script data tags are sent as `@setDataFrame` data messages
+static const uint8_t SET_DATA_FRAME[] = {AMF0_STRING, 0, 13,  '@', 's', 'e',
+                                         't',         'D', 'a', 't', 'a', 'F',
+                                         'r',         'a', 'm', 'e'};
+
+static uint32_t read_uint(const uint8_t *data, int size) {
+  uint32_t value = 0;
+  for (int i = 0; i < size; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static void write_uint(uint8_t *data, uint32_t value, int size) {
+  for (int i = size - 1; i >= 0; i--) {
+    data[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+void publisher_init(Publisher *publisher) {
+  memset(publisher, 0, sizeof(Publisher));
+  publisher->socket = -1;
+  publisher->in_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+  publisher->out_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+}
+
+// Waits until the socket is ready for `events`, checking periodically if the
+// wait should be interrupted
+static int wait_socket(Publisher *publisher, short events) {
+  struct pollfd pollfd = {.fd = publisher->socket, .events = events};
+  AVIOInterruptCB *int_cb = &publisher->interrupt_callback;
+  while (true) {
+    if (int_cb->callback && int_cb->callback(int_cb->opaque)) {
+      return AVERROR_EXIT;
+    }
+    int ret = poll(&pollfd, 1, POLL_INTERVAL_MS);
+    if (ret > 0) {
+      return 0;
+    } else if (ret < 0 && errno != EINTR) {
+      return AVERROR(errno);
+    }
+  }
+}
+
+static int connect_socket(Publisher *publisher, const char *hostname,
+                          int port) {
+  char port_str[8];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addresses;
+  if (getaddrinfo(hostname, port_str, &hints, &addresses)) {
+    return AVERROR(EHOSTUNREACH);
+  }
+
+  int av_err = AVERROR(ECONNREFUSED);
+  for (struct addrinfo *address = addresses; address;
+       address = address->ai_next) {
+    publisher->socket =
+        socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (publisher->socket < 0) {
+      av_err = AVERROR(errno);
+      continue;
+    }
+    fcntl(publisher->socket, F_SETFL,
+          fcntl(publisher->socket, F_GETFL) | O_NONBLOCK);
+    // The buffer sizes have to be set before connecting, as they determine
+    // the TCP window scale
+    SocketOptions *options = &publisher->socket_options;
+    if (options->send_buffer_size > 0) {
+      setsockopt(publisher->socket, SOL_SOCKET, SO_SNDBUF,
+                 &options->send_buffer_size,
+                 sizeof(options->send_buffer_size));
+    }
+    if (options->recv_buffer_size > 0) {
+      setsockopt(publisher->socket, SOL_SOCKET, SO_RCVBUF,
+                 &options->recv_buffer_size,
+                 sizeof(options->recv_buffer_size));
+    }
+
+    if (connect(publisher->socket, address->ai_addr, address->ai_addrlen) <
+            0 &&
+        errno != EINPROGRESS) {
+      av_err = AVERROR(errno);
+    } else if ((av_err = wait_socket(publisher, POLLOUT)) == 0) {
+      int error = 0;
+      socklen_t error_size = sizeof(error);
+      getsockopt(publisher->socket, SOL_SOCKET, SO_ERROR, &error, &error_size);
+      av_err = AVERROR(error);
+    }
+    if (av_err == 0 || av_err == AVERROR_EXIT) {
+      break;
+    }
+    close(publisher->socket);
+    publisher->socket = -1;
+  }
+  freeaddrinfo(addresses);
+
+  if (av_err == 0) {
+    int enabled = publisher->socket_options.tcp_nodelay;
+    setsockopt(publisher->socket, IPPROTO_TCP, TCP_NODELAY, &enabled,
+               sizeof(enabled));
+  }
+  return av_err;
+}
+
+// Waits for the socket after a TLS call failed with `error`, if the call
+// can be retried. Returns a negative AVERROR code otherwise.
+static int wait_tls(Publisher *publisher, int error) {
+  switch (error) {
+  case SSL_ERROR_WANT_READ:
+    return wait_socket(publisher, POLLIN);
+  case SSL_ERROR_WANT_WRITE:
+    return wait_socket(publisher, POLLOUT);
+  case SSL_ERROR_ZERO_RETURN:
+    return AVERROR_EOF;
+  case SSL_ERROR_SYSCALL:
+    if (errno == EINTR) {
+      return 0;
+    }
+    return errno ? AVERROR(errno) : AVERROR_EOF;
+  default:
+    return AVERROR(EPROTO);
+  }
+}
+
+// Sets up TLS over the connected socket. With a session kept from a previous
+// connection to the server, the handshake resumes it instead of repeating
+// the key exchange and the certificate verification.
+static int connect_tls(Publisher *publisher, const char *hostname, int port) {
+  int ret = tls_context_acquire();
+  if (ret < 0) {
+    return ret;
+  }
+  publisher->tls_context_acquired = true;
+
+  publisher->tls_session_key = av_asprintf("%s:%d", hostname, port);
+  if (!publisher->tls_session_key) {
+    return AVERROR(ENOMEM);
+  }
+  SocketOptions *options = &publisher->socket_options;
+  publisher->tls = tls_connection_new(publisher->socket, hostname,
+                                      publisher->tls_session_key,
+                                      options->tls_verify, options->kernel_tls);
+  if (!publisher->tls) {
+    return AVERROR(ENOMEM);
+  }
+
+  while (true) {
+    // The error queue is per thread and shared by all the connections
+    // written by it, so it's cleared before each call
+    ERR_clear_error();
+    int result = SSL_connect(publisher->tls);
+    if (result == 1) {
+      break;
+    }
+    ret = wait_tls(publisher, SSL_get_error(publisher->tls, result));
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  publisher->kernel_tls = tls_kernel_send(publisher->tls);
+  return 0;
+}
+
+static int send_tls(Publisher *publisher, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ERR_clear_error();
+    int written = SSL_write(publisher->tls, data, FFMIN(size, INT_MAX));
+    if (written > 0) {
+      data += written;
+      size -= written;
+      continue;
+    }
+    // The call is retried with the same arguments, as OpenSSL requires
+    int ret = wait_tls(publisher, SSL_get_error(publisher->tls, written));
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+// Gathers the vectors into a single write, so that the chunks of a message
+// are encrypted in as few records as possible
+static int send_iov_tls(Publisher *publisher, const struct iovec *iov,
+                        int count) {
+  size_t size = 0;
+  for (int i = 0; i < count; i++) {
+    size += iov[i].iov_len;
+  }
+  if (publisher->tls_output_capacity < size) {
+    uint8_t *output = av_realloc(publisher->tls_output, size);
+    if (!output) {
+      return AVERROR(ENOMEM);
+    }
+    publisher->tls_output = output;
+    publisher->tls_output_capacity = size;
+  }
+
+  size_t offset = 0;
+  for (int i = 0; i < count; i++) {
+    memcpy(publisher->tls_output + offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+  return send_tls(publisher, publisher->tls_output, size);
+}
+
+static int send_iov(Publisher *publisher, struct iovec *iov, int count) {
+  if (publisher->tls && !publisher->kernel_tls) {
+    return send_iov_tls(publisher, iov, count);
+  }
+  while (count > 0) {
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = count < IOV_MAX ? count : IOV_MAX};
+    ssize_t sent = sendmsg(publisher->socket, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        int ret = wait_socket(publisher, POLLOUT);
+        if (ret < 0) {
+          return ret;
+        }
+        continue;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      return AVERROR(errno);
+    }
+
+    // Skip the fully sent vectors and the sent part of the next one
+    while (count > 0 && (size_t)sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+static int send_buffer(Publisher *publisher, const uint8_t *data,
+                       size_t size) {
+  struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+  return send_iov(publisher, &iov, 1);
+}
+
+static int ensure_iov_capacity(Publisher *publisher, int count) {
+  if (publisher->iov_capacity >= count) {
+    return 0;
+  }
+  struct iovec *iov = av_realloc_array(publisher->iov, count, sizeof(*iov));
+  if (!iov) {
+    return AVERROR(ENOMEM);
+  }
+  publisher->iov = iov;
+  publisher->iov_capacity = count;
+  return 0;
+}
+
+// Sends a message split into chunks. The chunks are written directly from
+// the payload vectors, interleaved with their headers. Consecutive media
+// messages on a chunk stream get compressed headers, omitting the fields
+// that didn't change since the previous message.
+static int send_message(Publisher *publisher, int chunk_stream_id,
+                        uint8_t message_type, uint32_t message_stream_id,
+                        uint32_t timestamp, const struct iovec *payload,
+                        int payload_count) {
+  uint32_t length = 0;
+  for (int i = 0; i < payload_count; i++) {
+    length += payload[i].iov_len;
+  }
+
+  OutChunkStream *chunk_stream = &publisher->out_chunk_streams[chunk_stream_id];
+  uint32_t delta = timestamp - chunk_stream->timestamp;
+  int fmt = 0;
+  // Commands are sent on different message streams, so their headers are
+  // never compressed
+  if (chunk_stream_id > COMMAND_CHUNK_STREAM && chunk_stream->initialized &&
+      timestamp >= chunk_stream->timestamp) {
+    fmt = 1;
+    if (length == chunk_stream->message_length &&
+        message_type == chunk_stream->message_type) {
+      // A type 3 header repeats the previous delta, which is ambiguous after
+      // a type 0 header carrying an absolute timestamp
+      fmt = chunk_stream->has_delta && delta == chunk_stream->timestamp_delta &&
+                    delta < 0xFFFFFF
+                ? 3
+                : 2;
+    }
+  }
+  uint32_t timestamp_field = fmt == 0 ? timestamp : delta;
+  bool extended_timestamp = fmt != 3 && timestamp_field >= 0xFFFFFF;
+
+  uint8_t header[MAX_CHUNK_HEADER_SIZE];
+  int header_size = 0;
+  header[header_size++] = (fmt << 6) | chunk_stream_id;
+  if (fmt <= 2) {
+    write_uint(header + header_size,
+               extended_timestamp ? 0xFFFFFF : timestamp_field, 3);
+    header_size += 3;
+  }
+  if (fmt <= 1) {
+    write_uint(header + header_size, length, 3);
+    header[header_size + 3] = message_type;
+    header_size += 4;
+  }
+  if (fmt == 0) {
+    // message stream id is the only little endian field
+    for (int i = 0; i < 4; i++) {
+      header[header_size + i] = (message_stream_id >> (8 * i)) & 0xFF;
+    }
+    header_size += 4;
+  }
+  if (extended_timestamp) {
+    write_uint(header + header_size, timestamp_field, 4);
+    header_size += 4;
+  }
+
+  // All the following chunks of the message have the same type 3 header
+  uint8_t continuation[5];
+  int continuation_size = 1;
+  continuation[0] = 0xC0 | chunk_stream_id;
+  if (extended_timestamp) {
+    write_uint(continuation + 1, timestamp_field, 4);
+    continuation_size += 4;
+  }
+
+  int chunks = length == 0 ? 1
+                           : (length + publisher->out_chunk_size - 1) /
+                                 publisher->out_chunk_size;
+  int ret = ensure_iov_capacity(publisher, 2 * chunks + payload_count);
+  if (ret < 0) {
+    return ret;
+  }
+
+  struct iovec *iov = publisher->iov;
+  int iov_count = 0;
+  iov[iov_count++] = (struct iovec){.iov_base = header, .iov_len = header_size};
+
+  int segment = 0;
+  size_t segment_offset = 0;
+  uint32_t chunk_filled = 0;
+  for (uint32_t sent = 0; sent < length;) {
+    if (chunk_filled == publisher->out_chunk_size) {
+      iov[iov_count++] = (struct iovec){.iov_base = continuation,
+                                        .iov_len = continuation_size};
+      chunk_filled = 0;
+    }
+    size_t piece = FFMIN(payload[segment].iov_len - segment_offset,
+                         publisher->out_chunk_size - chunk_filled);
+    if (piece == 0) {
+      segment++;
+      segment_offset = 0;
+      continue;
+    }
+    iov[iov_count++] = (struct iovec){
+        .iov_base = (uint8_t *)payload[segment].iov_base + segment_offset,
+        .iov_len = piece};
+    segment_offset += piece;
+    chunk_filled += piece;
+    sent += piece;
+  }
+
+  chunk_stream->initialized = true;
+  chunk_stream->has_delta = fmt != 0;
+  chunk_stream->timestamp_delta = fmt == 0 ? 0 : delta;
+  chunk_stream->timestamp = timestamp;
+  chunk_stream->message_length = length;
+  chunk_stream->message_type = message_type;
+  return send_iov(publisher, iov, iov_count);
+}
+
+static int send_control_message(Publisher *publisher, uint8_t message_type,
+                                const uint8_t *payload, size_t size) {
+  struct iovec iov = {.iov_base = (void *)payload, .iov_len = size};
+  return send_message(publisher, CONTROL_CHUNK_STREAM, message_type, 0, 0,
+                      &iov, 1);
+}
+
+static int send_command(Publisher *publisher, uint32_t message_stream_id,
+                        AMF0Buffer *command) {
+  if (command->failed) {
+    amf0_buffer_free(command);
+    return AVERROR(ENOMEM);
+  }
+  struct iovec iov = {.iov_base = command->data, .iov_len = command->size};
+  int ret = send_message(publisher, COMMAND_CHUNK_STREAM, MESSAGE_AMF0_COMMAND,
+                         message_stream_id, 0, &iov, 1);
+  amf0_buffer_free(command);
+  return ret;
+}
+
+// Receives the data available in the socket, waiting for it if requested.
+// Returns 1 if some data was received, 0 if none was available and
+// a negative AVERROR code on error.
+static int receive(Publisher *publisher, bool wait) {
+  if (publisher->input_capacity - publisher->input_size < RECEIVE_SIZE) {
+    size_t capacity = publisher->input_size + RECEIVE_SIZE;
+    uint8_t *input = av_realloc(publisher->input, capacity);
+    if (!input) {
+      return AVERROR(ENOMEM);
+    }
+    publisher->input = input;
+    publisher->input_capacity = capacity;
+  }
+
+  while (publisher->tls) {
+    ERR_clear_error();
+    int received =
+        SSL_read(publisher->tls, publisher->input + publisher->input_size,
+                 publisher->input_capacity - publisher->input_size);
+    if (received > 0) {
+      publisher->input_size += received;
+      return 1;
+    }
+    int error = SSL_get_error(publisher->tls, received);
+    if (error == SSL_ERROR_WANT_READ && !wait) {
+      return 0;
+    }
+    int ret = wait_tls(publisher, error);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  while (true) {
+    ssize_t received =
+        recv(publisher->socket, publisher->input + publisher->input_size,
+             publisher->input_capacity - publisher->input_size, 0);
+    if (received > 0) {
+      publisher->input_size += received;
+      return 1;
+    } else if (received == 0) {
+      return AVERROR_EOF;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return AVERROR(errno);
+    } else if (!wait) {
+      return 0;
+    }
+
+    int ret = wait_socket(publisher, POLLIN);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+}
+
+static void consume_input(Publisher *publisher, size_t size) {
+  publisher->input_size -= size;
+  if (publisher->input_size > 0) {
+    memmove(publisher->input, publisher->input + size, publisher->input_size);
+  }
+}
+
+static int handshake(Publisher *publisher) {
+  // C0: version, C1: time, zeros and random bytes
+  uint8_t c0c1[1 + RTMP_HANDSHAKE_SIZE];
+  memset(c0c1, 0, sizeof(c0c1));
+  c0c1[0] = RTMP_VERSION;
+  for (int i = 9; i < 1 + RTMP_HANDSHAKE_SIZE; i++) {
+    c0c1[i] = rand() & 0xFF;
+  }
+  int ret = send_buffer(publisher, c0c1, sizeof(c0c1));
+
+  // S0, S1 and S2
+  while (ret >= 0 && publisher->input_size < 1 + 2 * RTMP_HANDSHAKE_SIZE) {
+    ret = receive(publisher, true);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+  if (publisher->input[0] != RTMP_VERSION) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  // C2: echo of S1
+  ret = send_buffer(publisher, publisher->input + 1, RTMP_HANDSHAKE_SIZE);
+  consume_input(publisher, 1 + 2 * RTMP_HANDSHAKE_SIZE);
+  return ret;
+}
+
+static InChunkStream *get_in_chunk_stream(Publisher *publisher, uint32_t id) {
+  for (int i = 0; i < publisher->in_chunk_streams_count; i++) {
+    if (publisher->in_chunk_streams[i].id == id) {
+      return &publisher->in_chunk_streams[i];
+    }
+  }
+
+  InChunkStream *chunk_streams = av_realloc_array(
+      publisher->in_chunk_streams, publisher->in_chunk_streams_count + 1,
+      sizeof(InChunkStream));
+  if (!chunk_streams) {
+    return NULL;
+  }
+  publisher->in_chunk_streams = chunk_streams;
+  InChunkStream *chunk_stream =
+      &chunk_streams[publisher->in_chunk_streams_count++];
+  memset(chunk_stream, 0, sizeof(*chunk_stream));
+  chunk_stream->id = id;
+  return chunk_stream;
+}
+
+// Parses a single chunk from the input. Returns 0 if more data is needed,
+// 1 if a chunk was parsed, 2 if it completed a message, which is then stored
+// in `message`, and a negative AVERROR code on error.
+static int parse_chunk(Publisher *publisher, InMessage *message) {
+  static const size_t message_header_sizes[] = {11, 7, 3, 0};
+
+  const uint8_t *data = publisher->input;
+  size_t available = publisher->input_size;
+  if (available < 1) {
+    return 0;
+  }
+
+  uint8_t fmt = data[0] >> 6;
+  uint32_t id = data[0] & 0x3F;
+  size_t header_size = 1;
+  if (id == 0) {
+    if (available < 2) {
+      return 0;
+    }
+    id = 64 + data[1];
+    header_size = 2;
+  } else if (id == 1) {
+    if (available < 3) {
+      return 0;
+    }
+    id = 64 + data[1] + 256 * data[2];
+    header_size = 3;
+  }
+
+  const uint8_t *message_header = data + header_size;
+  header_size += message_header_sizes[fmt];
+  if (available < header_size) {
+    return 0;
+  }
+
+  InChunkStream *chunk_stream = get_in_chunk_stream(publisher, id);
+  if (!chunk_stream) {
+    return AVERROR(ENOMEM);
+  }
+  bool extended_timestamp = chunk_stream->extended_timestamp;
+  uint32_t timestamp = chunk_stream->timestamp_delta;
+  uint32_t message_length = chunk_stream->message_length;
+  uint8_t message_type = chunk_stream->message_type;
+
+  if (fmt <= 2) {
+    timestamp = read_uint(message_header, 3);
+    extended_timestamp = timestamp == 0xFFFFFF;
+  }
+  if (fmt <= 1) {
+    message_length = read_uint(message_header + 3, 3);
+    message_type = message_header[6];
+  }
+  if (extended_timestamp) {
+    if (available < header_size + 4) {
+      return 0;
+    }
+    if (fmt <= 2) {
+      timestamp = read_uint(data + header_size, 4);
+    }
+    header_size += 4;
+  }
+
+  bool new_message = fmt != 3 || chunk_stream->received == 0;
+  uint32_t received = new_message ? 0 : chunk_stream->received;
+  if (message_length > MAX_MESSAGE_SIZE) {
+    return AVERROR_INVALIDDATA;
+  }
+  uint32_t chunk_size =
+      FFMIN(message_length - received, publisher->in_chunk_size);
+  if (available < header_size + chunk_size) {
+    return 0;
+  }
+
+  if (new_message) {
+    chunk_stream->timestamp =
+        fmt == 0 ? timestamp : chunk_stream->timestamp + timestamp;
+    chunk_stream->timestamp_delta = timestamp;
+    chunk_stream->extended_timestamp = extended_timestamp;
+    chunk_stream->message_length = message_length;
+    chunk_stream->message_type = message_type;
+    chunk_stream->received = 0;
+
+    if (chunk_stream->message_capacity < message_length) {
+      uint8_t *buffer = av_realloc(chunk_stream->message, message_length);
+      if (!buffer) {
+        return AVERROR(ENOMEM);
+      }
+      chunk_stream->message = buffer;
+      chunk_stream->message_capacity = message_length;
+    }
+  }
+
+  if (chunk_size > 0) {
+    memcpy(chunk_stream->message + chunk_stream->received, data + header_size,
+           chunk_size);
+  }
+  chunk_stream->received += chunk_size;
+  consume_input(publisher, header_size + chunk_size);
+
+  if (chunk_stream->received < chunk_stream->message_length) {
+    return 1;
+  }
+  chunk_stream->received = 0;
+  message->type = chunk_stream->message_type;
+  message->data = chunk_stream->message;
+  message->size = chunk_stream->message_length;
+  return 2;
+}
+
+// Reads the next message from the server. The message data is valid until
+// the next read. Returns 1 if a message was read, 0 if there was none
+// available without waiting and a negative AVERROR code on error.
+static int read_message(Publisher *publisher, InMessage *message, bool wait) {
+  while (true) {
+    int ret = parse_chunk(publisher, message);
+    if (ret == 2) {
+      return 1;
+    } else if (ret < 0) {
+      return ret;
+    } else if (ret == 1) {
+      continue;
+    }
+
+    ret = receive(publisher, wait);
+    if (ret <= 0) {
+      return ret;
+    }
+  }
+}
+
+static int handle_control_message(Publisher *publisher, InMessage *message) {
+  switch (message->type) {
+  case MESSAGE_SET_CHUNK_SIZE:
+    if (message->size < 4 || (read_uint(message->data, 4) & 0x7FFFFFFF) == 0) {
+      return AVERROR_INVALIDDATA;
+    }
+    publisher->in_chunk_size = read_uint(message->data, 4) & 0x7FFFFFFF;
+    return 0;
+
+  case MESSAGE_ABORT:
+    if (message->size >= 4) {
+      InChunkStream *chunk_stream =
+          get_in_chunk_stream(publisher, read_uint(message->data, 4));
+      if (chunk_stream) {
+        chunk_stream->received = 0;
+      }
+    }
+    return 0;
+
+  case MESSAGE_USER_CONTROL:
+    if (message->size >= 6 &&
+        read_uint(message->data, 2) == USER_CONTROL_PING_REQUEST) {
+      uint8_t response[6];
+      write_uint(response, USER_CONTROL_PING_RESPONSE, 2);
+      memcpy(response + 2, message->data + 2, 4);
+      return send_control_message(publisher, MESSAGE_USER_CONTROL, response,
+                                  sizeof(response));
+    }
+    return 0;
+
+  default:
+    // Acknowledgements and bandwidth limits are not needed for publishing
+    return 0;
+  }
+}
+
+static bool string_is(const char *value, size_t length, const char *expected) {
+  return strlen(expected) == length && memcmp(value, expected, length) == 0;
+}
+
+// Waits for the response to the command with the given transaction id.
+// On success, the reader is positioned after the transaction id.
+static int await_result(Publisher *publisher, double transaction_id,
+                        InMessage *message, AMF0Reader *reader) {
+  while (true) {
+    int ret = read_message(publisher, message, true);
+    if (ret < 0) {
+      return ret;
+    }
+    if (message->type != MESSAGE_AMF0_COMMAND) {
+      ret = handle_control_message(publisher, message);
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    const char *name;
+    size_t name_length;
+    double id;
+    amf0_reader_init(reader, message->data, message->size);
+    if (amf0_read_string(reader, &name, &name_length) < 0 ||
+        amf0_read_number(reader, &id) < 0 || id != transaction_id) {
+      continue;
+    }
+    if (string_is(name, name_length, "_result")) {
+      return 0;
+    } else if (string_is(name, name_length, "_error")) {
+      return AVERROR(EACCES);
+    }
+  }
+}
+
+static int await_publish_status(Publisher *publisher) {
+  InMessage message;
+  while (true) {
+    int ret = read_message(publisher, &message, true);
+    if (ret < 0) {
+      return ret;
+    }
+    if (message.type != MESSAGE_AMF0_COMMAND) {
+      ret = handle_control_message(publisher, &message);
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    AMF0Reader reader;
+    const char *name;
+    size_t name_length;
+    double transaction_id;
+    amf0_reader_init(&reader, message.data, message.size);
+    if (amf0_read_string(&reader, &name, &name_length) < 0 ||
+        amf0_read_number(&reader, &transaction_id) < 0) {
+      continue;
+    }
+    if (string_is(name, name_length, "_error") &&
+        transaction_id == TRANSACTION_PUBLISH) {
+      return AVERROR(EACCES);
+    } else if (!string_is(name, name_length, "onStatus")) {
+      continue;
+    }
+
+    // command object is null
+    char level[32], code[64];
+    AMF0Reader info_reader;
+    if (amf0_skip_value(&reader) < 0) {
+      return AVERROR_INVALIDDATA;
+    }
+    info_reader = reader;
+    if (amf0_read_object_string(&reader, "level", level, sizeof(level)) < 0 ||
+        amf0_read_object_string(&info_reader, "code", code, sizeof(code)) <
+            0) {
+      return AVERROR_INVALIDDATA;
+    }
+    if (strcmp(code, "NetStream.Publish.Start") == 0) {
+      return 0;
+    } else if (strcmp(level, "error") == 0) {
+      return AVERROR(EACCES);
+    }
+  }
+}
+
+static int send_connect(Publisher *publisher) {
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, "connect");
+  amf0_write_number(&command, TRANSACTION_CONNECT);
+  amf0_write_object_start(&command);
+  amf0_write_property(&command, "app");
+  amf0_write_string(&command, publisher->app);
+  amf0_write_property(&command, "type");
+  amf0_write_string(&command, "nonprivate");
+  amf0_write_property(&command, "flashVer");
+  amf0_write_string(&command, "FMLE/3.0 (compatible; FMSc/1.0)");
+  amf0_write_property(&command, "tcUrl");
+  amf0_write_string(&command, publisher->tc_url);
+  amf0_write_object_end(&command);
+  return send_command(publisher, 0, &command);
+}
+
+// Sends a command with a null command object and an optional string argument
+static int send_stream_command(Publisher *publisher, const char *name,
+                               double transaction_id,
+                               uint32_t message_stream_id,
+                               const char *argument) {
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, name);
+  amf0_write_number(&command, transaction_id);
+  amf0_write_null(&command);
+  if (argument) {
+    amf0_write_string(&command, argument);
+  }
+  return send_command(publisher, message_stream_id, &command);
+}
+
+static int publish(Publisher *publisher) {
+  InMessage message;
+  AMF0Reader reader;
+
+  int ret = send_connect(publisher);
+  if (ret < 0 ||
+      (ret = await_result(publisher, TRANSACTION_CONNECT, &message, &reader)) <
+          0) {
+    return ret;
+  }
+
+  if ((ret = send_stream_command(publisher, "releaseStream",
+                                 TRANSACTION_RELEASE_STREAM, 0,
+                                 publisher->stream_key)) < 0 ||
+      (ret = send_stream_command(publisher, "FCPublish",
+                                 TRANSACTION_FC_PUBLISH, 0,
+                                 publisher->stream_key)) < 0 ||
+      (ret = send_stream_command(publisher, "createStream",
+                                 TRANSACTION_CREATE_STREAM, 0, NULL)) < 0 ||
+      (ret = await_result(publisher, TRANSACTION_CREATE_STREAM, &message,
+                          &reader)) < 0) {
+    return ret;
+  }
+
+  double stream_id;
+  if (amf0_skip_value(&reader) < 0 ||
+      amf0_read_number(&reader, &stream_id) < 0) {
+    return AVERROR_INVALIDDATA;
+  }
+  publisher->stream_id = stream_id;
+
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, "publish");
+  amf0_write_number(&command, TRANSACTION_PUBLISH);
+  amf0_write_null(&command);
+  amf0_write_string(&command, publisher->stream_key);
+  amf0_write_string(&command, "live");
+  ret = send_command(publisher, publisher->stream_id, &command);
+  if (ret < 0 || (ret = await_publish_status(publisher)) < 0) {
+    return ret;
+  }
+  publisher->published = true;
+  return 0;
+}
+
+// Splits the URL into the address and the application and stream key that
+// the stream is published with: rtmp[s]://host[:port]/app/stream_key
+static int parse_url(Publisher *publisher, const char *url, char *hostname,
+                     size_t hostname_size, int *port, bool *tls) {
+  char protocol[16], path[1024];
+  av_url_split(protocol, sizeof(protocol), NULL, 0, hostname, hostname_size,
+               port, path, sizeof(path), url);
+  if (strcmp(protocol, "rtmp") != 0 && strcmp(protocol, "rtmps") != 0) {
+    return AVERROR_PROTOCOL_NOT_FOUND;
+  }
+  *tls = strcmp(protocol, "rtmps") == 0;
+  if (*port < 0) {
+    *port = *tls ? RTMPS_DEFAULT_PORT : RTMP_DEFAULT_PORT;
+  }
+
+  const char *app = path[0] == '/' ? path + 1 : path;
+  const char *stream_key = strchr(app, '/');
+  if (!stream_key || stream_key[1] == '\0') {
+    return AVERROR(EINVAL);
+  }
+  publisher->app = av_strndup(app, stream_key - app);
+  publisher->stream_key = av_strdup(stream_key + 1);
+  publisher->tc_url = av_asprintf(
+      strchr(hostname, ':') ? "%s://[%s]:%d/%s" : "%s://%s:%d/%s", protocol,
+      hostname, *port, publisher->app);
+  if (!publisher->app || !publisher->stream_key || !publisher->tc_url) {
+    return AVERROR(ENOMEM);
+  }
+  return 0;
+}
+
+int publisher_open(Publisher *publisher, const char *url,
+                   uint32_t chunk_size, SocketOptions socket_options,
+                   AVIOInterruptCB interrupt_callback) {
+  char hostname[256];
+  int port;
+  bool tls;
+  publisher->socket_options = socket_options;
+  publisher->interrupt_callback = interrupt_callback;
+
+  int ret = parse_url(publisher, url, hostname, sizeof(hostname), &port, &tls);
+  if (ret < 0 || (ret = connect_socket(publisher, hostname, port)) < 0 ||
+      (tls && (ret = connect_tls(publisher, hostname, port)) < 0) ||
+      (ret = handshake(publisher)) < 0) {
+    goto err;
+  }
+
+  uint8_t payload[4];
+  write_uint(payload, chunk_size, 4);
+  ret = send_control_message(publisher, MESSAGE_SET_CHUNK_SIZE, payload,
+                             sizeof(payload));
+  if (ret < 0) {
+    goto err;
+  }
+  publisher->out_chunk_size = chunk_size;
+
+  if ((ret = publish(publisher)) < 0) {
+    goto err;
+  }
+  return 0;
+
+err:
+  publisher_close(publisher, false);
+  return ret;
+}
+
+int publisher_write(Publisher *publisher, const uint8_t *data, int size) {
+  // Handle the messages sent by the server in the meantime, such as pings,
+  // without waiting for them
+  InMessage message;
+  int ret;
+  while ((ret = read_message(publisher, &message, false)) > 0) {
+    if ((ret = handle_control_message(publisher, &message)) < 0) {
+      return ret;
+    }
+  }
+  if (ret < 0) {
+    return ret;
+  }
+
+  // FLV header and the first previous tag size
+  int pos = 0;
+  if (size >= 9 && memcmp(data, "FLV", 3) == 0) {
+    pos = read_uint(data + 5, 4) + FLV_PREVIOUS_TAG_SIZE_SIZE;
+  }
+
+  while (pos < size) {
+    if (size - pos < FLV_TAG_HEADER_SIZE) {
+      return AVERROR_INVALIDDATA;
+    }
+    const uint8_t *tag = data + pos;
+    uint8_t tag_type = tag[0] & 0x1F;
+    uint32_t data_size = read_uint(tag + 1, 3);
+    // the 24-bit timestamp is followed by its upper 8 bits
+    uint32_t timestamp = read_uint(tag + 4, 3) | ((uint32_t)tag[7] << 24);
+    if ((uint32_t)(size - pos) <
+        FLV_TAG_HEADER_SIZE + data_size + FLV_PREVIOUS_TAG_SIZE_SIZE) {
+      return AVERROR_INVALIDDATA;
+    }
+    pos += FLV_TAG_HEADER_SIZE + data_size + FLV_PREVIOUS_TAG_SIZE_SIZE;
+
+    struct iovec payload[2];
+    int payload_count = 0;
+    int chunk_stream_id;
+    switch (tag_type) {
+    case MESSAGE_AUDIO:
+      chunk_stream_id = AUDIO_CHUNK_STREAM;
+      break;
+    case MESSAGE_VIDEO:
+      chunk_stream_id = VIDEO_CHUNK_STREAM;
+      break;
+    case MESSAGE_DATA:
+      chunk_stream_id = DATA_CHUNK_STREAM;
+      payload[payload_count++] =
+          (struct iovec){.iov_base = (void *)SET_DATA_FRAME,
+                         .iov_len = sizeof(SET_DATA_FRAME)};
+      break;
+    default:
+      continue;
+    }
+    payload[payload_count++] = (struct iovec){
+        .iov_base = (void *)(tag + FLV_TAG_HEADER_SIZE), .iov_len = data_size};
+
+    ret = send_message(publisher, chunk_stream_id, tag_type,
+                       publisher->stream_id, timestamp, payload,
+                       payload_count);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+void publisher_close(Publisher *publisher, bool unpublish) {
+  if (publisher->socket >= 0) {
+    if (unpublish && publisher->published) {
+      send_stream_command(publisher, "FCUnpublish", TRANSACTION_FC_UNPUBLISH,
+                          0, publisher->stream_key);
+      AMF0Buffer command;
+      amf0_buffer_init(&command);
+      amf0_write_string(&command, "deleteStream");
+      amf0_write_number(&command, TRANSACTION_DELETE_STREAM);
+      amf0_write_null(&command);
+      amf0_write_number(&command, publisher->stream_id);
+      send_command(publisher, 0, &command);
+    }
+    if (publisher->tls) {
+      // Sends close_notify without waiting for the server's, the socket
+      // isn't read any further
+      ERR_clear_error();
+      SSL_shutdown(publisher->tls);
+      SSL_free(publisher->tls);
+    }
+    close(publisher->socket);
+  }
+  if (publisher->tls_context_acquired) {
+    tls_context_release();
+  }
+
+  av_freep(&publisher->app);
+  av_freep(&publisher->stream_key);
+  av_freep(&publisher->tc_url);
+  for (int i = 0; i < publisher->in_chunk_streams_count; i++) {
+    av_freep(&publisher->in_chunk_streams[i].message);
+  }
+  av_freep(&publisher->in_chunk_streams);
+  av_freep(&publisher->input);
+  av_freep(&publisher->iov);
+  av_freep(&publisher->tls_session_key);
+  av_freep(&publisher->tls_output);
+  publisher_init(publisher);
+}
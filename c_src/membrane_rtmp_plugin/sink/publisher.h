@@ -0,0 +1,116 @@
+#pragma once
+
+#include <libavformat/avformat.h>
+#include <openssl/ssl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// State of a chunk stream the messages are sent on, used to compress the
+// headers of the consecutive messages
+typedef struct OutChunkStream {
+  bool initialized;
+  uint32_t timestamp;
+  // Whether the previous header carried a delta, not an absolute timestamp
+  bool has_delta;
+  uint32_t timestamp_delta;
+  uint32_t message_length;
+  uint8_t message_type;
+} OutChunkStream;
+
+// State of a chunk stream the server's messages are received on
+typedef struct InChunkStream {
+  uint32_t id;
+  uint32_t timestamp;
+  uint32_t timestamp_delta;
+  bool extended_timestamp;
+  uint32_t message_length;
+  uint8_t message_type;
+
+  uint8_t *message;
+  uint32_t message_capacity;
+  uint32_t received;
+} InChunkStream;
+
+typedef struct InMessage {
+  uint8_t type;
+  const uint8_t *data;
+  uint32_t size;
+} InMessage;
+
+#define PUBLISHER_OUT_CHUNK_STREAMS 8
+
+// Options of the publisher's socket, buffer sizes of 0 meaning the system
+// defaults, and of the TLS layer of the rtmps connections
+typedef struct SocketOptions {
+  int send_buffer_size;
+  int recv_buffer_size;
+  bool tcp_nodelay;
+  bool tls_verify;
+  // Whether the kernel is asked to encrypt the data, which keeps it from
+  // being copied into TLS records in user space
+  bool kernel_tls;
+} SocketOptions;
+
+// Native RTMP client publishing an FLV stream. Instead of going through
+// FFmpeg's RTMP protocol, FLV tags are sent as RTMP messages split into
+// chunks of `out_chunk_size` bytes with compressed headers. The headers and
+// the tag data are written together with a single vectored write.
+//
+// rtmps streams are encrypted with a TLS context shared by all the
+// publishers, resuming the previous sessions with the same server.
+typedef struct Publisher {
+  int socket;
+  SocketOptions socket_options;
+  AVIOInterruptCB interrupt_callback;
+
+  SSL *tls;
+  bool tls_context_acquired;
+  // host:port the TLS sessions are cached for
+  char *tls_session_key;
+  // Set when the kernel encrypts the data written to the socket, which is
+  // then written directly, as with plain RTMP
+  bool kernel_tls;
+  // Without kernel TLS, the vectors of a message are gathered here and
+  // encrypted with a single write
+  uint8_t *tls_output;
+  size_t tls_output_capacity;
+
+  char *app;
+  char *stream_key;
+  char *tc_url;
+
+  uint32_t out_chunk_size;
+  uint32_t in_chunk_size;
+  uint32_t stream_id;
+  bool published;
+
+  OutChunkStream out_chunk_streams[PUBLISHER_OUT_CHUNK_STREAMS];
+  InChunkStream *in_chunk_streams;
+  int in_chunk_streams_count;
+
+  // Data received from the server that hasn't been parsed yet
+  uint8_t *input;
+  size_t input_size;
+  size_t input_capacity;
+
+  // Reused between the messages, so that sending doesn't allocate
+  struct iovec *iov;
+  int iov_capacity;
+} Publisher;
+
+void publisher_init(Publisher *publisher);
+
+// Connects to the server and publishes the stream given by the URL.
+// Returns 0 on success or a negative AVERROR code.
+int publisher_open(Publisher *publisher, const char *url,
+                   uint32_t chunk_size, SocketOptions socket_options,
+                   AVIOInterruptCB interrupt_callback);
+
+// Sends a part of the FLV stream consisting of whole tags, optionally
+// preceded by the FLV header
+int publisher_write(Publisher *publisher, const uint8_t *data, int size);
+
+// Unpublishes the stream, unless the connection already failed, and closes
+// the connection
+void publisher_close(Publisher *publisher, bool unpublish);
@@ -1,4 +1,6 @@
 #include "rtmp_sink.h"
+#include <libavutil/time.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 const AVRational MEMBRANE_TIME_BASE = (AVRational){1, 1000000000};
@@ -7,49 +9,364 @@ void handle_init_state(State *state);
 
 void handle_destroy_state(UnifexEnv *env, State *state);
 
-UNIFEX_TERM create(UnifexEnv *env, char *rtmp_url) {
+#define AVIO_BUFFER_SIZE 4096
+#define FLV_HEADER_SIZE 9
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_TAG_TYPE_MASK 0x1f
+#define FLV_PREVIOUS_TAG_SIZE_SIZE 4
+
+static AVBufferRef *get_pooled_buffer(State *state, int size) {
+  int padded_size = size + AV_INPUT_BUFFER_PADDING_SIZE;
+  int size_class = 0;
+  while (size_class < PACKET_POOL_CLASSES &&
+         (1 << (PACKET_POOL_MIN_SIZE_LOG2 + size_class)) < padded_size) {
+    size_class++;
+  }
+  if (size_class == PACKET_POOL_CLASSES) {
+    state->stats.allocations++;
+    return av_buffer_alloc(padded_size);
+  }
+
+  if (!state->buffer_pools[size_class]) {
+    state->buffer_pools[size_class] = av_buffer_pool_init(
+        1 << (PACKET_POOL_MIN_SIZE_LOG2 + size_class), NULL);
+    if (!state->buffer_pools[size_class]) {
+      return NULL;
+    }
+  }
+  return av_buffer_pool_get(state->buffer_pools[size_class]);
+}
+
+// Called by the muxer with the next part of the muxed stream, which is
+// accumulated until all the data produced by the muxer call is written to the
+// destinations
+static int buffer_muxed_data(void *opaque, uint8_t *buf, int buf_size) {
+  State *state = (State *)opaque;
+  if (state->muxed_size + buf_size > state->muxed_capacity) {
+    int capacity = FFMAX(2 * state->muxed_capacity,
+                         state->muxed_size + buf_size);
+    uint8_t *muxed_data = av_realloc(state->muxed_data, capacity);
+    if (!muxed_data) {
+      return AVERROR(ENOMEM);
+    }
+    state->muxed_data = muxed_data;
+    state->muxed_capacity = capacity;
+    state->stats.allocations++;
+  }
+  memcpy(state->muxed_data + state->muxed_size, buf, buf_size);
+  state->muxed_size += buf_size;
+  return buf_size;
+}
+
+static void on_destination_failure(Destination *destination, void *opaque) {
+  State *state = (State *)opaque;
+  UnifexEnv *env = enif_alloc_env();
+  send_destination_failed(env, state->owner, UNIFEX_SEND_THREADED,
+                          destination->url, destination->error);
+  enif_free_env(env);
+}
+
+static void on_reconnection(Destination *destination, int result,
+                            void *opaque) {
+  State *state = (State *)opaque;
+  UnifexEnv *env = enif_alloc_env();
+  if (result < 0) {
+    send_reconnection_failed(env, state->owner, UNIFEX_SEND_THREADED,
+                             destination->url, av_err2str(result));
+  } else {
+    send_reconnected(env, state->owner, UNIFEX_SEND_THREADED,
+                     destination->url);
+  }
+  enif_free_env(env);
+}
+
+// Writes a piece of the muxed stream to all the destinations, sharing
+// a single copy of it between them
+static int write_chunk(State *state, const uint8_t *data, int size,
+                       ChunkInfo info) {
+  AVBufferRef *chunk = get_pooled_buffer(state, size);
+  if (!chunk) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(chunk->data, data, size);
+  state->stats.muxed_bytes += size;
+  if (info.type == CHUNK_HEADER) {
+    av_buffer_unref(&state->header);
+    state->header = av_buffer_ref(chunk);
+    state->header_size = size;
+  }
+
+  int ret = 0;
+  for (unsigned int i = 0; i < state->destinations_count && ret >= 0; i++) {
+    ret = destination_write(&state->destinations[i], chunk, size, info);
+  }
+  av_buffer_unref(&chunk);
+  return ret;
+}
+
+// Writes the data muxed so far to all the destinations
+static int write_muxed_data(State *state, ChunkInfo info) {
+  avio_flush(state->output_ctx->pb);
+  if (state->output_ctx->pb->error < 0) {
+    return state->output_ctx->pb->error;
+  }
+  if (state->muxed_size == 0) {
+    return 0;
+  }
+
+  int ret = write_chunk(state, state->muxed_data, state->muxed_size, info);
+  state->muxed_size = 0;
+  return ret;
+}
+
+static int parse_overflow_policy(const char *name, OverflowPolicy *policy) {
+  if (strcmp(name, "block") == 0) {
+    *policy = OVERFLOW_BLOCK;
+  } else if (strcmp(name, "drop_non_key_frames") == 0) {
+    *policy = OVERFLOW_DROP_NON_KEY_FRAMES;
+  } else if (strcmp(name, "drop_audio_last") == 0) {
+    *policy = OVERFLOW_DROP_AUDIO_LAST;
+  } else if (strcmp(name, "disconnect") == 0) {
+    *policy = OVERFLOW_DISCONNECT;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+UNIFEX_TERM create(UnifexEnv *env, char **rtmp_urls,
+                   unsigned int rtmp_urls_length, int async,
+                   uint64_t max_queued_bytes, int64_t max_queued_duration,
+                   int64_t max_queued_latency, int64_t write_timeout,
+                   char *overflow_policy, int reconnect, int native_io,
+                   int chunk_size, int64_t connect_timeout, int trace_latency,
+                   int64_t max_interleave_delta, char **option_names,
+                   unsigned int option_names_length, char **option_values,
+                   unsigned int option_values_length) {
   State *state = unifex_alloc_state(env);
   handle_init_state(state);
+  unifex_self(env, &state->owner);
+  AVDictionary *options = NULL;
 
   UNIFEX_TERM create_result;
-  avformat_alloc_output_context2(&state->output_ctx, NULL, "flv", rtmp_url);
+  if (rtmp_urls_length == 0) {
+    create_result = create_result_error(env, "No destination URL provided");
+    goto end;
+  }
+  if (option_names_length != option_values_length) {
+    create_result = create_result_error(env, "Option lists lengths differ");
+    goto end;
+  }
+  for (unsigned int i = 0; i < option_names_length; i++) {
+    av_dict_set(&options, option_names[i], option_values[i], 0);
+  }
+
+  // When fanning out, each destination is always written by its own thread,
+  // so that a slow one doesn't hold up the others
+  state->async = async || rtmp_urls_length > 1;
+  state->trace_latency = trace_latency;
+  state->interleaver.max_delta =
+      av_rescale_q(max_interleave_delta, MEMBRANE_TIME_BASE, AV_TIME_BASE_Q);
+  state->queue_limits.max_bytes = max_queued_bytes;
+  state->queue_limits.max_duration =
+      av_rescale_q(max_queued_duration, MEMBRANE_TIME_BASE, AV_TIME_BASE_Q);
+  state->queue_limits.max_latency =
+      av_rescale_q(max_queued_latency, MEMBRANE_TIME_BASE, AV_TIME_BASE_Q);
+  state->queue_limits.write_timeout =
+      av_rescale_q(write_timeout, MEMBRANE_TIME_BASE, AV_TIME_BASE_Q);
+  if (parse_overflow_policy(overflow_policy,
+                            &state->queue_limits.overflow_policy)) {
+    create_result = create_result_error(env, "Invalid overflow policy");
+    goto end;
+  }
+  state->queue_limits.resumable = reconnect;
+
+  avformat_alloc_output_context2(&state->output_ctx, NULL, "flv",
+                                 rtmp_urls[0]);
   if (!state->output_ctx) {
     create_result =
         create_result_error(env, "Failed to initialize output context");
     goto end;
   }
+
+  uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+  if (avio_buffer) {
+    state->output_ctx->pb = avio_alloc_context(
+        avio_buffer, AVIO_BUFFER_SIZE, 1, state, NULL, buffer_muxed_data, NULL);
+  }
+  if (!state->output_ctx->pb) {
+    av_free(avio_buffer);
+    create_result = create_result_error(env, "Failed to initialize output IO");
+    goto end;
+  }
+  state->output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  state->destinations = calloc(rtmp_urls_length, sizeof(Destination));
+  if (!state->destinations) {
+    create_result = create_result_error(env, "Failed to allocate destinations");
+    goto end;
+  }
+  for (unsigned int i = 0; i < rtmp_urls_length; i++) {
+    if (destination_init(
+            &state->destinations[i], rtmp_urls[i], native_io, chunk_size,
+            av_rescale_q(connect_timeout, MEMBRANE_TIME_BASE, AV_TIME_BASE_Q),
+            options)) {
+      create_result =
+          create_result_error(env, "Failed to allocate destinations");
+      goto end;
+    }
+    state->destinations_count++;
+  }
+
+  state->packet = av_packet_alloc();
+  if (!state->packet) {
+    create_result = create_result_error(env, "Failed to allocate packet");
+    goto end;
+  }
   create_result = create_result_ok(env, state);
 end:
+  av_dict_free(&options);
   unifex_release_state(env, state);
   return create_result;
 }
 
+UNIFEX_TERM start_connecting(UnifexEnv *env, State *state) {
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    int av_err = destination_start_connecting(&state->destinations[i]);
+    if (av_err < 0) {
+      return start_connecting_result_error(env, av_err2str(av_err));
+    }
+  }
+  return start_connecting_result_ok(env);
+}
+
 UNIFEX_TERM try_connect(UnifexEnv *env, State *state) {
-  const char *rtmp_url = state->output_ctx->url;
-  if (!(state->output_ctx->oformat->flags & AVFMT_NOFILE)) {
-    int av_err = avio_open(&state->output_ctx->pb, rtmp_url, AVIO_FLAG_WRITE);
+  // All the destinations are connected at once, so that their handshakes
+  // don't add up
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    int av_err = destination_start_connecting(&state->destinations[i]);
+    if (av_err < 0) {
+      return try_connect_result_error(env, av_err2str(av_err));
+    }
+  }
+
+  // Each of the attempts is awaited, even if another one fails
+  bool refused = false;
+  char error[AV_ERROR_MAX_STRING_SIZE] = "";
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    Destination *destination = &state->destinations[i];
+    if (!destination->connect_pending) {
+      continue;
+    }
+
+    int av_err = destination_await_connection(destination);
     if (av_err == AVERROR(ECONNREFUSED)) {
-      return try_connect_result_error_econnrefused(env);
+      refused = true;
     } else if (av_err < 0) {
-      return try_connect_result_error(env, av_err2str(av_err));
+      if (!error[0]) {
+        av_strerror(av_err, error, sizeof(error));
+      }
+    } else if (state->async &&
+               destination_start_async(destination, state->queue_limits,
+                                       on_destination_failure, state)) {
+      snprintf(error, sizeof(error), "Failed to start the send queue");
     }
   }
+
+  if (error[0]) {
+    return try_connect_result_error(env, error);
+  }
+  if (refused) {
+    return try_connect_result_error_econnrefused(env);
+  }
   return try_connect_result_ok(env);
 }
 
+UNIFEX_TERM reconnect(UnifexEnv *env, State *state, char *url) {
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    Destination *destination = &state->destinations[i];
+    if (strcmp(destination->url, url) != 0) {
+      continue;
+    }
+    int av_err = destination_start_reconnecting(
+        destination, state->header, state->header_size, on_reconnection);
+    if (av_err < 0) {
+      return reconnect_result_error(env, av_err2str(av_err));
+    }
+    return reconnect_result_ok(env);
+  }
+  return reconnect_result_error(env, "Unknown destination");
+}
+
+static const char *write_ready_packets(State *state, bool flush);
+
 UNIFEX_TERM finalize_stream(UnifexEnv *env, State *state) {
-  if (av_write_trailer(state->output_ctx)) {
+  if (write_ready_packets(state, true)) {
+    return unifex_raise(env, "Failed writing queued frames");
+  }
+  ChunkInfo trailer = {.type = CHUNK_TRAILER, .dts = AV_NOPTS_VALUE};
+  if (av_write_trailer(state->output_ctx) ||
+      write_muxed_data(state, trailer) < 0) {
     return unifex_raise(env, "Failed writing stream trailer");
   }
-  avio_flush(state->output_ctx->pb);
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    destination_finish(&state->destinations[i]);
+  }
   return finalize_stream_result_ok(env);
 }
 
+// Keeps the configuration received mid-stream until the muxer is passed
+// a frame it can be sent with, unless it's the current one
+static int set_pending_config(uint8_t **pending, int *pending_size,
+                              const AVCodecParameters *par,
+                              const UnifexPayload *config) {
+  av_freep(pending);
+  *pending_size = 0;
+  if (config->size == (unsigned int)par->extradata_size &&
+      memcmp(config->data, par->extradata, config->size) == 0) {
+    return 0;
+  }
+
+  *pending = av_malloc(config->size);
+  if (!*pending) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(*pending, config->data, config->size);
+  *pending_size = config->size;
+  return 0;
+}
+
+// The FLV muxer writes a new sequence header tag before the packet carrying
+// the new configuration in its side data
+static int attach_pending_config(AVPacket *packet, uint8_t **pending,
+                                 int *pending_size) {
+  if (!*pending) {
+    return 0;
+  }
+  uint8_t *side_data = av_packet_new_side_data(
+      packet, AV_PKT_DATA_NEW_EXTRADATA, *pending_size);
+  if (!side_data) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(side_data, *pending, *pending_size);
+  av_freep(pending);
+  *pending_size = 0;
+  return 0;
+}
+
 UNIFEX_TERM init_video_stream(UnifexEnv *env, State *state, int width,
                               int height, UnifexPayload *avc_config) {
   AVStream *video_stream;
   if (state->video_stream_index != -1) {
-    return init_video_stream_result_error_caps_resent(env);
+    AVCodecParameters *par =
+        state->output_ctx->streams[state->video_stream_index]->codecpar;
+    if (set_pending_config(&state->pending_video_config,
+                           &state->pending_video_config_size, par,
+                           avc_config)) {
+      return unifex_raise(env, "Failed allocating video stream configuration");
+    }
+    return init_video_stream_result_ok(env, state->audio_stream_index != -1,
+                                       state);
   }
 
   video_stream = avformat_new_stream(state->output_ctx, NULL);
@@ -75,7 +392,9 @@ UNIFEX_TERM init_video_stream(UnifexEnv *env, State *state, int width,
   bool ready =
       (state->video_stream_index != -1 && state->audio_stream_index != -1);
   if (ready && !state->header_written) {
-    if (avformat_write_header(state->output_ctx, NULL) < 0) {
+    ChunkInfo header = {.type = CHUNK_HEADER, .dts = AV_NOPTS_VALUE};
+    if (avformat_write_header(state->output_ctx, NULL) < 0 ||
+        write_muxed_data(state, header) < 0) {
       return unifex_raise(env, "Failed writing header");
     }
     state->header_written = true;
@@ -87,7 +406,15 @@ UNIFEX_TERM init_audio_stream(UnifexEnv *env, State *state, int channels,
                               int sample_rate, UnifexPayload *aac_config) {
   AVStream *audio_stream;
   if (state->audio_stream_index != -1) {
-    return init_audio_stream_result_error_caps_resent(env);
+    AVCodecParameters *par =
+        state->output_ctx->streams[state->audio_stream_index]->codecpar;
+    if (set_pending_config(&state->pending_audio_config,
+                           &state->pending_audio_config_size, par,
+                           aac_config)) {
+      return unifex_raise(env, "Failed allocating audio stream configuration");
+    }
+    return init_audio_stream_result_ok(env, state->video_stream_index != -1,
+                                       state);
   }
 
   audio_stream = avformat_new_stream(state->output_ctx, NULL);
@@ -112,7 +439,9 @@ UNIFEX_TERM init_audio_stream(UnifexEnv *env, State *state, int channels,
   bool ready =
       (state->video_stream_index != -1 && state->audio_stream_index != -1);
   if (ready && !state->header_written) {
-    if (avformat_write_header(state->output_ctx, NULL) < 0) {
+    ChunkInfo header = {.type = CHUNK_HEADER, .dts = AV_NOPTS_VALUE};
+    if (avformat_write_header(state->output_ctx, NULL) < 0 ||
+        write_muxed_data(state, header) < 0) {
       return unifex_raise(env, "Failed writing header");
     }
     state->header_written = true;
@@ -120,83 +449,201 @@ UNIFEX_TERM init_audio_stream(UnifexEnv *env, State *state, int channels,
   return init_audio_stream_result_ok(env, ready, state);
 }
 
-UNIFEX_TERM write_video_frame(UnifexEnv *env, State *state,
-                              UnifexPayload *frame, int64_t dts,
-                              int is_key_frame) {
+// Fills the state's packet with a copy of the frame stored in a pooled buffer.
+// The muxer takes over the reference to the buffer, which gets back to the
+// pool once the packet is written, so no allocations happen in steady state.
+static int fill_packet(State *state, UnifexPayload *frame) {
+  AVPacket *packet = state->packet;
+  packet->buf = get_pooled_buffer(state, frame->size);
+  if (!packet->buf) {
+    return AVERROR(ENOMEM);
+  }
+  packet->data = packet->buf->data;
+  packet->size = frame->size;
+  memcpy(packet->data, frame->data, frame->size);
+  memset(packet->data + frame->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  return 0;
+}
+
+static int get_flv_tag_size(const uint8_t *tag) {
+  return FLV_TAG_HEADER_SIZE + ((tag[1] << 16) | (tag[2] << 8) | tag[3]) +
+         FLV_PREVIOUS_TAG_SIZE_SIZE;
+}
+
+// Replaces the sequence header of the stream in the saved stream header with
+// the tag written by the muxer with a new codec configuration, so that the
+// reconnected destinations get only the configuration of the frames that
+// follow
+static int save_codec_header(State *state, const uint8_t *tag, int tag_size) {
+  if (!state->header) {
+    return 0;
+  }
+
+  // Apart from the metadata, the stream header holds only the sequence
+  // headers, one for each stream
+  const uint8_t *header = state->header->data;
+  int header_size = state->header_size;
+  int old_tag_pos = header_size;
+  int old_tag_size = 0;
+  int pos = FLV_HEADER_SIZE + FLV_PREVIOUS_TAG_SIZE_SIZE;
+  while (pos + FLV_TAG_HEADER_SIZE <= header_size) {
+    int size = get_flv_tag_size(header + pos);
+    if ((header[pos] & FLV_TAG_TYPE_MASK) == (tag[0] & FLV_TAG_TYPE_MASK)) {
+      old_tag_pos = pos;
+      old_tag_size = FFMIN(size, header_size - pos);
+      break;
+    }
+    pos += size;
+  }
+
+  int new_header_size = header_size - old_tag_size + tag_size;
+  AVBufferRef *new_header = get_pooled_buffer(state, new_header_size);
+  if (!new_header) {
+    return AVERROR(ENOMEM);
+  }
+  int tail_pos = old_tag_pos + old_tag_size;
+  memcpy(new_header->data, header, old_tag_pos);
+  memcpy(new_header->data + old_tag_pos, tag, tag_size);
+  memcpy(new_header->data + old_tag_pos + tag_size, header + tail_pos,
+         header_size - tail_pos);
+  av_buffer_unref(&state->header);
+  state->header = new_header;
+  state->header_size = new_header_size;
+  return 0;
+}
+
+// Writes the sequence header tag muxed before the frame with a new codec
+// configuration as a separate chunk. Unlike the frames, it's never dropped by
+// the send queues, as the configuration is written only once.
+static int write_codec_header(State *state) {
+  avio_flush(state->output_ctx->pb);
+  if (state->output_ctx->pb->error < 0) {
+    return state->output_ctx->pb->error;
+  }
+  if (state->muxed_size < FLV_TAG_HEADER_SIZE) {
+    return 0;
+  }
+  const uint8_t *tag = state->muxed_data;
+  int tag_size = get_flv_tag_size(tag);
+  if (tag_size > state->muxed_size) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  ChunkInfo info = {.type = CHUNK_CODEC_HEADER, .dts = AV_NOPTS_VALUE};
+  int ret = save_codec_header(state, tag, tag_size);
+  if (ret >= 0) {
+    ret = write_chunk(state, tag, tag_size, info);
+  }
+  // The frame is left to be written next
+  state->muxed_size -= tag_size;
+  memmove(state->muxed_data, state->muxed_data + tag_size, state->muxed_size);
+  return ret;
+}
+
+// Muxes the packets released by the interleaver one by one, so that each
+// chunk written to the destinations holds a single FLV tag
+static const char *write_ready_packets(State *state, bool flush) {
+  AVPacket *packet = state->packet;
+  int64_t write_start = av_gettime_relative();
+  while (interleaver_pop(&state->interleaver, packet, flush)) {
+    AVStream *stream = state->output_ctx->streams[packet->stream_index];
+    ChunkInfo info = {
+        .type = packet->stream_index == state->video_stream_index
+                    ? CHUNK_VIDEO
+                    : CHUNK_AUDIO,
+        .dts = av_rescale_q(packet->dts, stream->time_base, AV_TIME_BASE_Q),
+        .key_frame = packet->flags & AV_PKT_FLAG_KEY,
+        .entry_time = packet->pos};
+    bool new_config = av_packet_get_side_data(
+                          packet, AV_PKT_DATA_NEW_EXTRADATA, NULL) != NULL;
+
+    int av_err = av_write_frame(state->output_ctx, packet);
+    av_packet_unref(packet);
+    if (av_err < 0 || (new_config && write_codec_header(state) < 0) ||
+        write_muxed_data(state, info) < 0) {
+      return "Failed writing frame";
+    }
+  }
+  state->stats.write_time += av_gettime_relative() - write_start;
+  return NULL;
+}
+
+static const char *write_video_frame(State *state, UnifexPayload *frame,
+                                     int64_t dts, int64_t pts,
+                                     int is_key_frame, int64_t entry_time) {
   if (state->video_stream_index == -1) {
-    return write_video_frame_result_error(
-        env, "Video stream is not initialized. Caps has not been received");
+    return "Video stream is not initialized. Caps has not been received";
   }
 
   AVRational video_stream_time_base =
       state->output_ctx->streams[state->video_stream_index]->time_base;
-  AVPacket *packet = av_packet_alloc();
+  AVPacket *packet = state->packet;
 
-  UNIFEX_TERM write_frame_result;
+  if (fill_packet(state, frame)) {
+    return "Failed allocating video frame data";
+  }
 
   if (is_key_frame) {
     packet->flags |= AV_PKT_FLAG_KEY;
+    // The frames preceding the key frame can't be decoded with the new
+    // configuration
+    if (attach_pending_config(packet, &state->pending_video_config,
+                              &state->pending_video_config_size)) {
+      av_packet_unref(packet);
+      return "Failed attaching new video configuration";
+    }
   }
 
   packet->stream_index = state->video_stream_index;
-  packet->size = frame->size;
-  packet->data = (uint8_t *)av_malloc(frame->size);
-
-  if (!packet->data) {
-    write_frame_result =
-        unifex_raise(env, "Failed allocating video frame data");
-    goto end;
-  }
-
-  memcpy(packet->data, frame->data, frame->size);
 
   int64_t dts_scaled =
       av_rescale_q(dts, MEMBRANE_TIME_BASE, video_stream_time_base);
-  // Packet PTS is set to DTS since PTS coming with H264 buffer can be out of
-  // order which is not accepted by FFmpeg.
+  int64_t pts_scaled =
+      av_rescale_q(pts, MEMBRANE_TIME_BASE, video_stream_time_base);
+  // PTS is out of order when there are B-frames, the FLV muxer writes its
+  // difference from DTS as the composition time. The interleaver orders the
+  // packets by DTS. FFmpeg rejects frames presented before they're decoded.
   packet->dts = dts_scaled;
-  packet->pts = dts_scaled;
+  packet->pts = FFMAX(pts_scaled, dts_scaled);
 
   packet->duration = dts_scaled - state->current_video_dts;
   state->current_video_dts = dts_scaled;
+  // The position isn't used by the FLV muxer, so it carries the entry time
+  // through the interleaver
+  packet->pos = entry_time;
 
-  if (av_interleaved_write_frame(state->output_ctx, packet)) {
-    write_frame_result =
-        write_video_frame_result_error(env, "Failed writing video frame");
-    goto end;
-  }
-  write_frame_result = write_video_frame_result_ok(env, state);
+  state->stats.video_frames++;
+  state->stats.video_bytes += frame->size;
+  state->stats.last_video_dts = dts;
 
-end:
-  av_packet_unref(packet);
-  av_packet_free(&packet);
-  return write_frame_result;
+  if (interleaver_push(&state->interleaver, packet, video_stream_time_base)) {
+    av_packet_unref(packet);
+    return "Failed queueing video frame";
+  }
+  return write_ready_packets(state, false);
 }
 
-UNIFEX_TERM write_audio_frame(UnifexEnv *env, State *state,
-                              UnifexPayload *frame, int64_t pts) {
+static const char *write_audio_frame(State *state, UnifexPayload *frame,
+                                     int64_t pts, int64_t entry_time) {
   if (state->audio_stream_index == -1) {
-    return write_audio_frame_result_error(
-        env,
-        "Audio stream has not been initialized. Caps has not been received");
+    return "Audio stream has not been initialized. Caps has not been "
+           "received";
   }
 
   AVRational audio_stream_time_base =
       state->output_ctx->streams[state->audio_stream_index]->time_base;
-  AVPacket *packet = av_packet_alloc();
-
-  UNIFEX_TERM write_frame_result;
+  AVPacket *packet = state->packet;
 
+  if (fill_packet(state, frame)) {
+    return "Failed allocating audio frame data.";
+  }
+  if (attach_pending_config(packet, &state->pending_audio_config,
+                            &state->pending_audio_config_size)) {
+    av_packet_unref(packet);
+    return "Failed attaching new audio configuration";
+  }
   packet->stream_index = state->audio_stream_index;
-  packet->size = frame->size;
 
-  packet->data = (uint8_t *)av_malloc(frame->size);
-  if (!packet->data) {
-    write_frame_result =
-        unifex_raise(env, "Failed allocating audio frame data.");
-    goto end;
-  }
-  memcpy(packet->data, frame->data, frame->size);
   int64_t pts_scaled =
       av_rescale_q(pts, MEMBRANE_TIME_BASE, audio_stream_time_base);
   // Packet DTS is set to PTS since AAC buffers do not contain DTS
@@ -205,39 +652,183 @@ UNIFEX_TERM write_audio_frame(UnifexEnv *env, State *state,
 
   packet->duration = pts_scaled - state->current_audio_pts;
   state->current_audio_pts = pts_scaled;
+  packet->pos = entry_time;
+
+  state->stats.audio_frames++;
+  state->stats.audio_bytes += frame->size;
+  state->stats.last_audio_dts = pts;
+
+  if (interleaver_push(&state->interleaver, packet, audio_stream_time_base)) {
+    av_packet_unref(packet);
+    return "Failed queueing audio frame";
+  }
+  return write_ready_packets(state, false);
+}
+
+UNIFEX_TERM write_frames(UnifexEnv *env, State *state,
+                         UnifexPayload **video_frames,
+                         unsigned int video_frames_length, int64_t *video_dts,
+                         unsigned int video_dts_length, int64_t *video_pts,
+                         unsigned int video_pts_length, int *video_key_frames,
+                         unsigned int video_key_frames_length,
+                         UnifexPayload **audio_frames,
+                         unsigned int audio_frames_length, int64_t *audio_pts,
+                         unsigned int audio_pts_length) {
+  if (video_dts_length != video_frames_length ||
+      video_pts_length != video_frames_length ||
+      video_key_frames_length != video_frames_length ||
+      audio_pts_length != audio_frames_length) {
+    return write_frames_result_error(env, "Frame lists lengths differ");
+  }
+
+  int64_t entry_time = state->trace_latency ? av_gettime_relative() : 0;
+
+  // Both lists are ordered by their timestamps, so they are merged to pass
+  // the frames to the muxer in the decoding order
+  unsigned int video_idx = 0, audio_idx = 0;
+  while (video_idx < video_frames_length || audio_idx < audio_frames_length) {
+    const char *error;
+    if (audio_idx == audio_frames_length ||
+        (video_idx < video_frames_length &&
+         video_dts[video_idx] <= audio_pts[audio_idx])) {
+      error = write_video_frame(state, video_frames[video_idx],
+                                video_dts[video_idx], video_pts[video_idx],
+                                video_key_frames[video_idx], entry_time);
+      video_idx++;
+    } else {
+      error = write_audio_frame(state, audio_frames[audio_idx],
+                                audio_pts[audio_idx], entry_time);
+      audio_idx++;
+    }
+
+    if (error) {
+      return write_frames_result_error(env, error);
+    }
+  }
+  return write_frames_result_ok(env, state);
+}
 
-  if (av_interleaved_write_frame(state->output_ctx, packet)) {
-    write_frame_result =
-        write_audio_frame_result_error(env, "Failed writing audio frame");
+UNIFEX_TERM get_queue_stats(UnifexEnv *env, State *state) {
+  unsigned int count = state->destinations_count;
+  uint64_t *queued_bytes = unifex_alloc(count * sizeof(uint64_t));
+  int64_t *queued_durations = unifex_alloc(count * sizeof(int64_t));
+  uint64_t *dropped_frames = unifex_alloc(count * sizeof(uint64_t));
+  uint64_t *congestion_drops = unifex_alloc(count * sizeof(uint64_t));
+  UNIFEX_TERM result;
+  if (!queued_bytes || !queued_durations || !dropped_frames ||
+      !congestion_drops) {
+    result = unifex_raise(env, "Failed allocating queue stats");
     goto end;
   }
-  write_frame_result = write_audio_frame_result_ok(env, state);
+
+  for (unsigned int i = 0; i < count; i++) {
+    int64_t queued_duration;
+    destination_get_queue_stats(&state->destinations[i], &queued_bytes[i],
+                                &queued_duration, &dropped_frames[i],
+                                &congestion_drops[i]);
+    queued_durations[i] =
+        av_rescale_q(queued_duration, AV_TIME_BASE_Q, MEMBRANE_TIME_BASE);
+  }
+
+  result = get_queue_stats_result_ok(env, queued_bytes, count,
+                                     queued_durations, count, dropped_frames,
+                                     count, congestion_drops, count);
 
 end:
-  av_packet_unref(packet);
-  av_packet_free(&packet);
-  return write_frame_result;
+  if (queued_bytes) {
+    unifex_free(queued_bytes);
+  }
+  if (queued_durations) {
+    unifex_free(queued_durations);
+  }
+  if (dropped_frames) {
+    unifex_free(dropped_frames);
+  }
+  if (congestion_drops) {
+    unifex_free(congestion_drops);
+  }
+  return result;
+}
+
+UNIFEX_TERM get_latency_histograms(UnifexEnv *env, State *state) {
+  unsigned int length = state->destinations_count * LATENCY_BUCKETS;
+  uint64_t *histograms = unifex_alloc(length * sizeof(uint64_t));
+  if (!histograms) {
+    return unifex_raise(env, "Failed allocating latency histograms");
+  }
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    destination_get_latency_histogram(&state->destinations[i],
+                                      &histograms[i * LATENCY_BUCKETS]);
+  }
+
+  UNIFEX_TERM result =
+      get_latency_histograms_result_ok(env, histograms, length);
+  unifex_free(histograms);
+  return result;
+}
+
+UNIFEX_TERM get_stats(UnifexEnv *env, State *state) {
+  SinkStats *stats = &state->stats;
+  return get_stats_result_ok(
+      env, stats->video_frames, stats->video_bytes, stats->audio_frames,
+      stats->audio_bytes, stats->muxed_bytes, stats->write_time,
+      stats->allocations, interleaver_queued_packets(&state->interleaver),
+      stats->last_video_dts, stats->last_audio_dts);
 }
 
 void handle_init_state(State *state) {
   state->video_stream_index = -1;
   state->current_video_dts = 0;
+  state->pending_video_config = NULL;
+  state->pending_video_config_size = 0;
 
   state->audio_stream_index = -1;
   state->current_audio_pts = 0;
+  state->pending_audio_config = NULL;
+  state->pending_audio_config_size = 0;
 
   state->header_written = false;
+  state->header = NULL;
+  state->header_size = 0;
+  memset(&state->stats, 0, sizeof(state->stats));
 
   state->output_ctx = NULL;
+  state->destinations = NULL;
+  state->destinations_count = 0;
+  state->async = false;
+  state->trace_latency = false;
+  state->muxed_data = NULL;
+  state->muxed_size = 0;
+  state->muxed_capacity = 0;
+  interleaver_init(&state->interleaver, 0);
+  state->packet = NULL;
+  for (int i = 0; i < PACKET_POOL_CLASSES; i++) {
+    state->buffer_pools[i] = NULL;
+  }
 }
 
 void handle_destroy_state(UnifexEnv *env, State *state) {
   UNIFEX_UNUSED(env);
-  if (state->output_ctx &&
-      !(state->output_ctx->oformat->flags & AVFMT_NOFILE)) {
-    avio_closep(&state->output_ctx->pb);
+  for (unsigned int i = 0; i < state->destinations_count; i++) {
+    destination_close(&state->destinations[i]);
   }
+  free(state->destinations);
+
   if (state->output_ctx) {
+    if (state->output_ctx->pb) {
+      av_freep(&state->output_ctx->pb->buffer);
+      avio_context_free(&state->output_ctx->pb);
+    }
     avformat_free_context(state->output_ctx);
   }
+  av_freep(&state->muxed_data);
+  av_buffer_unref(&state->header);
+  av_freep(&state->pending_video_config);
+  av_freep(&state->pending_audio_config);
+  interleaver_free(&state->interleaver);
+  av_packet_free(&state->packet);
+  // Pools are freed once all the buffers taken from them are released
+  for (int i = 0; i < PACKET_POOL_CLASSES; i++) {
+    av_buffer_pool_uninit(&state->buffer_pools[i]);
+  }
 }
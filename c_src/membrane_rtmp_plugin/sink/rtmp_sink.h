@@ -1,22 +1,81 @@
 #pragma once
 
+#include "destination.h"
+#include "interleaver.h"
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 #include <stdbool.h>
 #include <unifex/unifex.h>
 
+// Frame buffers are taken from pools of buffers with sizes being consecutive
+// powers of two, from 2^PACKET_POOL_MIN_SIZE_LOG2 to
+// 2^PACKET_POOL_MAX_SIZE_LOG2 bytes. Larger frames are allocated separately.
+#define PACKET_POOL_MIN_SIZE_LOG2 10
+#define PACKET_POOL_MAX_SIZE_LOG2 22
+#define PACKET_POOL_CLASSES                                                   \
+  (PACKET_POOL_MAX_SIZE_LOG2 - PACKET_POOL_MIN_SIZE_LOG2 + 1)
+
 typedef struct State State;
 
+// Counters reported by get_stats
+typedef struct SinkStats {
+  uint64_t video_frames;
+  uint64_t video_bytes;
+  uint64_t audio_frames;
+  uint64_t audio_bytes;
+  // Size of the muxed stream passed to the destinations
+  uint64_t muxed_bytes;
+  // Time spent muxing the frames and, unless the destinations are
+  // asynchronous, sending them, in microseconds
+  int64_t write_time;
+  // Buffers allocated outside of the pools
+  uint64_t allocations;
+  // In Membrane time units
+  int64_t last_video_dts;
+  int64_t last_audio_dts;
+} SinkStats;
+
 struct State {
   AVFormatContext *output_ctx;
 
+  // The stream is muxed once and written to each of the destinations
+  Destination *destinations;
+  unsigned int destinations_count;
+  UnifexPid owner;
+  // Whether the destinations are written by their own threads
+  bool async;
+  QueueLimits queue_limits;
+  // Whether the frames are stamped with the time they're passed to the sink,
+  // to measure their latency until they're handed to the sockets
+  bool trace_latency;
+
+  uint8_t *muxed_data;
+  int muxed_size;
+  int muxed_capacity;
+
+  Interleaver interleaver;
+
+  AVPacket *packet;
+  AVBufferPool *buffer_pools[PACKET_POOL_CLASSES];
+
   int video_stream_index;
   int64_t current_video_dts;
+  // Configuration received mid-stream, sent with the next key frame
+  uint8_t *pending_video_config;
+  int pending_video_config_size;
 
   int audio_stream_index;
   int64_t current_audio_pts;
+  // Configuration received mid-stream, sent with the next frame
+  uint8_t *pending_audio_config;
+  int pending_audio_config_size;
 
   bool header_written;
+  // Muxed stream header, sent again to the reconnected destinations
+  AVBufferRef *header;
+  int header_size;
+
+  SinkStats stats;
 };
 
 #include "_generated/rtmp_sink.h"
\ No newline at end of file
@@ -3,25 +3,78 @@ module Membrane.RTMP.Sink.Native
 state_type "State"
 interface [NIF]
 
-spec create(rtmp_url :: string) :: {:ok :: label, state} | {:error :: label, reason :: string}
+spec create(
+       rtmp_urls :: [string],
+       async :: bool,
+       max_queued_bytes :: uint64,
+       max_queued_duration :: int64,
+       max_queued_latency :: int64,
+       write_timeout :: int64,
+       overflow_policy :: atom,
+       reconnect :: bool,
+       native_io :: bool,
+       chunk_size :: int,
+       connect_timeout :: int64,
+       trace_latency :: bool,
+       max_interleave_delta :: int64,
+       option_names :: [string],
+       option_values :: [string]
+     ) :: {:ok :: label, state} | {:error :: label, reason :: string}
+# Starts connecting to the servers in the background, try_connect waits for the result
+spec start_connecting(state) :: (:ok :: label) | {:error :: label, reason :: string}
+
 # WARN: connect will conflict with POSIX function name
 spec try_connect(state) ::
        (:ok :: label)
        | {:error :: label, :econnrefused :: label}
        | {:error :: label, reason :: string}
 
+# Starts connecting the failed destination with the URL again in the background, resuming
+# the stream from the last key frame. The result is sent as `reconnected` or
+# `reconnection_failed`.
+spec reconnect(state, url :: string) :: (:ok :: label) | {:error :: label, reason :: string}
+
 spec finalize_stream(state) :: :ok :: label
 
+# Once the stream is initialized, the new configuration is sent with the next
+# key frame or, for audio, with the next frame
 spec init_video_stream(state, width :: int, height :: int, avc_config :: payload) ::
-       {:ok :: label, ready :: bool, state} | {:error :: label, :caps_resent :: label}
-
-spec write_video_frame(state, frame :: payload, dts :: int64, is_key_frame :: bool) ::
-       {:ok :: label, state} | {:error :: label, reason :: string}
+       {:ok :: label, ready :: bool, state}
 
 spec init_audio_stream(state, channels :: int, sample_rate :: int, aac_config :: payload) ::
-       {:ok :: label, ready :: bool, state} | {:error :: label, :caps_resent :: label}
+       {:ok :: label, ready :: bool, state}
 
-spec write_audio_frame(state, frame :: payload, pts :: int64) ::
+# Writes video frames ordered by DTS and audio frames ordered by PTS, interleaving them by timestamps.
+# The video PTS may be out of order, the difference from DTS is written as the composition time.
+spec write_frames(
+       state,
+       video_frames :: [payload],
+       video_dts :: [int64],
+       video_pts :: [int64],
+       video_key_frames :: [bool],
+       audio_frames :: [payload],
+       audio_pts :: [int64]
+     ) ::
        {:ok :: label, state} | {:error :: label, reason :: string}
 
-dirty :io, write_video_frame: 4, write_audio_frame: 3
+# Per destination, in the order of URLs passed to `create`
+spec get_queue_stats(state) ::
+       {:ok :: label, queued_bytes :: [uint64], queued_durations :: [int64],
+        dropped_frames :: [uint64], congestion_drops :: [uint64]}
+
+# Histograms of the latency from passing the frames to the sink until handing them
+# to the socket, LATENCY_BUCKETS counts per destination, one after another
+spec get_latency_histograms(state) :: {:ok :: label, histograms :: [uint64]}
+
+# Times are in microseconds, timestamps in Membrane time units
+spec get_stats(state) ::
+       {:ok :: label, video_frames :: uint64, video_bytes :: uint64, audio_frames :: uint64,
+        audio_bytes :: uint64, muxed_bytes :: uint64, write_time :: int64,
+        allocations :: uint64, interleaver_depth :: int, last_video_dts :: int64,
+        last_audio_dts :: int64}
+
+sends {:destination_failed :: label, url :: string, reason :: string}
+sends {:reconnected :: label, url :: string}
+sends {:reconnection_failed :: label, url :: string, reason :: string}
+
+dirty :io, try_connect: 1, write_frames: 7, finalize_stream: 1
@@ -0,0 +1,160 @@
+#include "tls.h"
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include <pthread.h>
+#include <string.h>
+
+#define MAX_CACHED_SESSIONS 256
+
+typedef struct CachedSession {
+  char *key;
+  SSL_SESSION *session;
+} CachedSession;
+
+typedef struct TLSContext {
+  int references;
+  SSL_CTX *ctx;
+  CachedSession sessions[MAX_CACHED_SESSIONS];
+  int sessions_count;
+  // Entry replaced by the next session once the cache is full
+  int next_eviction;
+} TLSContext;
+
+// The sessions are stored by the threads completing the handshakes, so the
+// cache is guarded by the same mutex as the references
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static TLSContext context;
+
+static CachedSession *find_session(const char *key) {
+  for (int i = 0; i < context.sessions_count; i++) {
+    if (context.sessions[i].key && strcmp(context.sessions[i].key, key) == 0) {
+      return &context.sessions[i];
+    }
+  }
+  return NULL;
+}
+
+static void clear_session(CachedSession *entry) {
+  av_freep(&entry->key);
+  if (entry->session) {
+    SSL_SESSION_free(entry->session);
+    entry->session = NULL;
+  }
+}
+
+// Called with each session, or TLS 1.3 ticket, received from a server. The
+// cache takes over the reference to the session.
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+  const char *key = SSL_get_app_data(ssl);
+  if (!key) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&mutex);
+  CachedSession *entry = find_session(key);
+  if (entry) {
+    SSL_SESSION_free(entry->session);
+  } else {
+    if (context.sessions_count < MAX_CACHED_SESSIONS) {
+      entry = &context.sessions[context.sessions_count++];
+    } else {
+      entry = &context.sessions[context.next_eviction];
+      context.next_eviction =
+          (context.next_eviction + 1) % MAX_CACHED_SESSIONS;
+      clear_session(entry);
+    }
+    entry->key = av_strdup(key);
+  }
+  bool stored = entry->key != NULL;
+  entry->session = stored ? session : NULL;
+  pthread_mutex_unlock(&mutex);
+  return stored ? 1 : 0;
+}
+
+int tls_context_acquire(void) {
+  int ret = 0;
+  pthread_mutex_lock(&mutex);
+  if (context.references > 0) {
+    context.references++;
+    goto end;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_default_verify_paths(ctx);
+  // The sessions are kept only by the cache above, as OpenSSL's internal one
+  // is used only by servers
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+  context.ctx = ctx;
+  context.references = 1;
+
+end:
+  pthread_mutex_unlock(&mutex);
+  return ret;
+}
+
+void tls_context_release(void) {
+  pthread_mutex_lock(&mutex);
+  if (context.references > 0 && --context.references == 0) {
+    for (int i = 0; i < context.sessions_count; i++) {
+      clear_session(&context.sessions[i]);
+    }
+    SSL_CTX_free(context.ctx);
+    context = (TLSContext){0};
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+SSL *tls_connection_new(int socket, const char *hostname,
+                        const char *session_key, bool verify, bool ktls) {
+  SSL *ssl = SSL_new(context.ctx);
+  if (!ssl) {
+    return NULL;
+  }
+  if (!SSL_set_fd(ssl, socket) || !SSL_set_tlsext_host_name(ssl, hostname)) {
+    goto err;
+  }
+  if (verify) {
+    SSL_set_verify(ssl, SSL_VERIFY_PEER, NULL);
+    if (!SSL_set1_host(ssl, hostname)) {
+      goto err;
+    }
+  } else {
+    SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
+  }
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ktls) {
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+  }
+#else
+  (void)ktls;
+#endif
+  SSL_set_app_data(ssl, (void *)session_key);
+
+  pthread_mutex_lock(&mutex);
+  CachedSession *entry = find_session(session_key);
+  if (entry && entry->session) {
+    SSL_set_session(ssl, entry->session);
+  }
+  pthread_mutex_unlock(&mutex);
+  return ssl;
+
+err:
+  SSL_free(ssl);
+  return NULL;
+}
+
+bool tls_kernel_send(SSL *ssl) {
+#ifdef BIO_get_ktls_send
+  return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+  (void)ssl;
+  return false;
+#endif
+}
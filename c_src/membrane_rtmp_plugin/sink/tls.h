@@ -0,0 +1,22 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <stdbool.h>
+
+// Client TLS context shared by all the publishers of the node, created with
+// the first acquired reference and freed once the last one is released. The
+// last session of each server is kept, so that the following connections to
+// it resume the session instead of doing a full handshake.
+int tls_context_acquire(void);
+
+void tls_context_release(void);
+
+// Creates a connection over the connected socket, set up to resume the last
+// session with the server identified by `session_key`. The key has to stay
+// valid as long as the connection exists. With `ktls`, the connection asks
+// for the kernel to take over the encryption, where it's supported.
+SSL *tls_connection_new(int socket, const char *hostname,
+                        const char *session_key, bool verify, bool ktls);
+
+// Whether the kernel encrypts the data written directly to the socket
+bool tls_kernel_send(SSL *ssl);
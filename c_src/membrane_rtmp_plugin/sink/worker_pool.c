@@ -0,0 +1,238 @@
+#include "worker_pool.h"
+#include <libavutil/avutil.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define WORKERS_PER_CORE 2
+#define MAX_WORKERS 128
+
+typedef struct WorkerPool {
+  int references;
+  ErlNifTid threads[MAX_WORKERS + MAX_BLOCKED_TASKS];
+  int threads_count;
+  // Number of threads kept free for the tasks that aren't blocked
+  int workers_count;
+  int blocked_count;
+  ErlNifMutex *mutex;
+  // Signalled when a task is scheduled or the pool is stopped
+  ErlNifCond *cond;
+  // Tasks are run in the order they're scheduled
+  PoolTask *head;
+  PoolTask *tail;
+  // Blocking tasks waiting until there are fewer than MAX_BLOCKED_TASKS
+  // blocked
+  PoolTask *blocking_head;
+  PoolTask *blocking_tail;
+  bool stopping;
+} WorkerPool;
+
+// The pool is set up before any of its primitives exists, so the references
+// are counted under a statically initialized mutex
+static pthread_mutex_t references_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WorkerPool pool;
+
+static PoolTask *pop_task(PoolTask **head, PoolTask **tail) {
+  PoolTask *task = *head;
+  if (task) {
+    *head = task->next;
+    if (!*head) {
+      *tail = NULL;
+    }
+    task->next = NULL;
+  }
+  return task;
+}
+
+// Called with the mutex locked
+static PoolTask *next_task(void) {
+  if (pool.blocking_head && pool.blocked_count < MAX_BLOCKED_TASKS) {
+    return pop_task(&pool.blocking_head, &pool.blocking_tail);
+  }
+  return pop_task(&pool.head, &pool.tail);
+}
+
+static void *worker_thread(void *opaque);
+
+// Starts another thread if the blocked tasks leave fewer than workers_count
+// threads for the others. Called with the mutex locked.
+static void replace_blocked_thread(void) {
+  if (pool.stopping ||
+      pool.threads_count - pool.blocked_count >= pool.workers_count ||
+      pool.threads_count == MAX_WORKERS + MAX_BLOCKED_TASKS) {
+    return;
+  }
+  // Without the thread, the pool keeps working with fewer free threads
+  if (!enif_thread_create("rtmp_sink_worker",
+                          &pool.threads[pool.threads_count], worker_thread,
+                          NULL, NULL)) {
+    pool.threads_count++;
+  }
+}
+
+static void *worker_thread(void *opaque) {
+  UNIFEX_UNUSED(opaque);
+  enif_mutex_lock(pool.mutex);
+  while (true) {
+    PoolTask *task = NULL;
+    while (!pool.stopping && !(task = next_task())) {
+      enif_cond_wait(pool.cond, pool.mutex);
+    }
+    if (pool.stopping) {
+      break;
+    }
+    // The task might be scheduled again or freed once it's run
+    bool blocking = task->blocking;
+    if (blocking) {
+      pool.blocked_count++;
+      replace_blocked_thread();
+    }
+    enif_mutex_unlock(pool.mutex);
+
+    task->run(task);
+
+    enif_mutex_lock(pool.mutex);
+    if (blocking) {
+      pool.blocked_count--;
+    }
+  }
+  enif_mutex_unlock(pool.mutex);
+  return NULL;
+}
+
+static int workers_count(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+  return FFMIN(cores * WORKERS_PER_CORE, MAX_WORKERS);
+}
+
+static void stop_pool(void) {
+  enif_mutex_lock(pool.mutex);
+  pool.stopping = true;
+  enif_cond_broadcast(pool.cond);
+  enif_mutex_unlock(pool.mutex);
+
+  for (int i = 0; i < pool.threads_count; i++) {
+    enif_thread_join(pool.threads[i], NULL);
+  }
+  enif_cond_destroy(pool.cond);
+  enif_mutex_destroy(pool.mutex);
+  pool = (WorkerPool){0};
+}
+
+int worker_pool_acquire(void) {
+  int ret = 0;
+  pthread_mutex_lock(&references_mutex);
+  if (pool.references > 0) {
+    pool.references++;
+    goto end;
+  }
+
+  pool.mutex = enif_mutex_create("rtmp_sink_worker_pool_mutex");
+  pool.cond = enif_cond_create("rtmp_sink_worker_pool_cond");
+  if (!pool.mutex || !pool.cond) {
+    if (pool.mutex) {
+      enif_mutex_destroy(pool.mutex);
+    }
+    if (pool.cond) {
+      enif_cond_destroy(pool.cond);
+    }
+    pool = (WorkerPool){0};
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+
+  pool.workers_count = workers_count();
+  while (pool.threads_count < pool.workers_count) {
+    ErlNifTid *thread = &pool.threads[pool.threads_count];
+    if (enif_thread_create("rtmp_sink_worker", thread, worker_thread, NULL,
+                           NULL)) {
+      break;
+    }
+    pool.threads_count++;
+  }
+  // A pool with fewer threads is still usable
+  if (pool.threads_count == 0) {
+    stop_pool();
+    ret = AVERROR(EAGAIN);
+    goto end;
+  }
+  pool.references = 1;
+
+end:
+  pthread_mutex_unlock(&references_mutex);
+  return ret;
+}
+
+void worker_pool_release(void) {
+  pthread_mutex_lock(&references_mutex);
+  if (pool.references > 0 && --pool.references == 0) {
+    stop_pool();
+  }
+  pthread_mutex_unlock(&references_mutex);
+}
+
+void worker_pool_schedule(PoolTask *task) {
+  enif_mutex_lock(pool.mutex);
+  PoolTask **head = task->blocking ? &pool.blocking_head : &pool.head;
+  PoolTask **tail = task->blocking ? &pool.blocking_tail : &pool.tail;
+  task->next = NULL;
+  if (*tail) {
+    (*tail)->next = task;
+  } else {
+    *head = task;
+  }
+  *tail = task;
+  enif_cond_signal(pool.cond);
+  enif_mutex_unlock(pool.mutex);
+}
+
+bool worker_pool_unschedule(PoolTask *task) {
+  bool removed = false;
+  enif_mutex_lock(pool.mutex);
+  PoolTask **head = task->blocking ? &pool.blocking_head : &pool.head;
+  PoolTask **tail = task->blocking ? &pool.blocking_tail : &pool.tail;
+  PoolTask *previous = NULL;
+  for (PoolTask *queued = *head; queued; queued = queued->next) {
+    if (queued != task) {
+      previous = queued;
+      continue;
+    }
+    if (previous) {
+      previous->next = task->next;
+    } else {
+      *head = task->next;
+    }
+    if (*tail == task) {
+      *tail = previous;
+    }
+    task->next = NULL;
+    removed = true;
+    break;
+  }
+  enif_mutex_unlock(pool.mutex);
+  return removed;
+}
+
+bool worker_pool_block(void) {
+  enif_mutex_lock(pool.mutex);
+  bool blocked = pool.blocked_count < MAX_BLOCKED_TASKS;
+  if (blocked) {
+    pool.blocked_count++;
+    replace_blocked_thread();
+  }
+  enif_mutex_unlock(pool.mutex);
+  return blocked;
+}
+
+void worker_pool_unblock(void) {
+  enif_mutex_lock(pool.mutex);
+  pool.blocked_count--;
+  // A blocking task might be waiting for the count to drop
+  if (pool.blocking_head) {
+    enif_cond_signal(pool.cond);
+  }
+  enif_mutex_unlock(pool.mutex);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <unifex/unifex.h>
+
+// Tasks that can be blocked on IO at a time, each of them given an extra
+// thread
+#define MAX_BLOCKED_TASKS 128
+
+typedef struct PoolTask PoolTask;
+
+// Piece of work run by one of the pool's threads. A task is scheduled at most
+// once at a time, it's up to its owner to track whether it's been scheduled.
+struct PoolTask {
+  void (*run)(PoolTask *task);
+  void *opaque;
+  // Set for the tasks spending most of their run blocked on IO, like
+  // connecting. Each of them is run by an extra thread, so that they don't
+  // hold up the other tasks, and at most MAX_BLOCKED_TASKS of them at a time.
+  bool blocking;
+  PoolTask *next;
+};
+
+// Threads shared by all the sinks of the node, started with the first
+// acquired reference and stopped once the last one is released. There are
+// WORKERS_PER_CORE threads per online core running the tasks, as a thread is
+// held by a task for as long as its IO blocks, and an extra thread for each
+// blocked task. The extra threads are kept until the pool is stopped.
+int worker_pool_acquire(void);
+
+void worker_pool_release(void);
+
+void worker_pool_schedule(PoolTask *task);
+
+// Removes the task from the queue of the scheduled ones. Returns false if it
+// isn't queued, for instance because it's being run.
+bool worker_pool_unschedule(PoolTask *task);
+
+// Counts the task calling it as blocked on IO, like a blocking task, once its
+// IO turns out to block. Returns false without counting it if
+// MAX_BLOCKED_TASKS tasks are blocked already, in which case the task should
+// give up the IO instead of holding up the other tasks.
+bool worker_pool_block(void);
+
+// Counts the task calling it as running again once its IO is done
+void worker_pool_unblock(void);
@@ -0,0 +1,69 @@
+#include "avc.h"
+#include <string.h>
+
+static const uint8_t START_CODE[4] = {0, 0, 0, 1};
+
+int avc_nal_length_size(const uint8_t *config, int config_size) {
+  // configurationVersion must be 1, lengthSizeMinusOne is stored in the two
+  // least significant bits of the fifth byte
+  if (config_size < 7 || config[0] != 1) {
+    return 0;
+  }
+  return (config[4] & 0x03) + 1;
+}
+
+static uint32_t read_nal_length(const uint8_t *data, int nal_length_size) {
+  uint32_t length = 0;
+  for (int i = 0; i < nal_length_size; i++) {
+    length = (length << 8) | data[i];
+  }
+  return length;
+}
+
+int avc_annex_b_size(const uint8_t *frame, int frame_size,
+                     int nal_length_size) {
+  int pos = 0;
+  int out_size = 0;
+  while (pos + nal_length_size <= frame_size) {
+    uint32_t length = read_nal_length(frame + pos, nal_length_size);
+    pos += nal_length_size;
+    if (length > (uint32_t)(frame_size - pos)) {
+      break;
+    }
+    pos += length;
+    out_size += sizeof(START_CODE) + length;
+  }
+  return out_size;
+}
+
+int avc_to_annex_b(const uint8_t *frame, int frame_size, int nal_length_size,
+                   uint8_t *out) {
+  int pos = 0;
+  int out_pos = 0;
+  while (pos + nal_length_size <= frame_size) {
+    uint32_t length = read_nal_length(frame + pos, nal_length_size);
+    pos += nal_length_size;
+    if (length > (uint32_t)(frame_size - pos)) {
+      break;
+    }
+    memcpy(out + out_pos, START_CODE, sizeof(START_CODE));
+    out_pos += sizeof(START_CODE);
+    memcpy(out + out_pos, frame + pos, length);
+    out_pos += length;
+    pos += length;
+  }
+  return out_pos;
+}
+
+int avc_to_annex_b_in_place(uint8_t *frame, int frame_size) {
+  int pos = 0;
+  while (pos + 4 <= frame_size) {
+    uint32_t length = read_nal_length(frame + pos, 4);
+    if (length > (uint32_t)(frame_size - pos - 4)) {
+      break;
+    }
+    memcpy(frame + pos, START_CODE, sizeof(START_CODE));
+    pos += 4 + length;
+  }
+  return pos;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Returns the size of the NAL unit length prefix declared in the
+// AVCDecoderConfigurationRecord or 0 if the configuration is not a valid
+// record, which is the case for streams that are already in Annex-B format.
+int avc_nal_length_size(const uint8_t *config, int config_size);
+
+// Returns the size of the Annex-B representation of a frame consisting of
+// NAL units prefixed with their length.
+int avc_annex_b_size(const uint8_t *frame, int frame_size,
+                     int nal_length_size);
+
+// Converts a frame consisting of length-prefixed NAL units to Annex-B, with
+// 4-byte start codes. The output buffer has to be at least
+// `avc_annex_b_size` bytes long. Returns the number of bytes written.
+// A truncated NAL unit at the end of the frame is dropped.
+int avc_to_annex_b(const uint8_t *frame, int frame_size, int nal_length_size,
+                   uint8_t *out);
+
+// Converts a frame consisting of NAL units prefixed with 4-byte lengths to
+// Annex-B in place. Returns the size of the converted frame, which is smaller
+// than `frame_size` if the last NAL unit was truncated.
+int avc_to_annex_b_in_place(uint8_t *frame, int frame_size);
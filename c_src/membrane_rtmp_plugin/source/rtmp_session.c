@@ -0,0 +1,1029 @@
+#include "rtmp_session.h"
+#include "avc.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGE_SET_CHUNK_SIZE 1
+#define MESSAGE_ABORT 2
+#define MESSAGE_ACKNOWLEDGEMENT 3
+#define MESSAGE_USER_CONTROL 4
+#define MESSAGE_WINDOW_ACK_SIZE 5
+#define MESSAGE_SET_PEER_BANDWIDTH 6
+#define MESSAGE_AUDIO 8
+#define MESSAGE_VIDEO 9
+#define MESSAGE_AMF3_COMMAND 17
+#define MESSAGE_AMF0_COMMAND 20
+
+#define CONTROL_CHUNK_STREAM 2
+#define COMMAND_CHUNK_STREAM 3
+#define PUBLISH_STREAM_ID 1
+
+#define SERVER_CHUNK_SIZE 4096
+#define SERVER_WINDOW_ACK_SIZE 2500000
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+// basic header, type 0 message header and extended timestamp
+#define MAX_CHUNK_HEADER_SIZE (3 + 11 + 4)
+
+#define FLV_CODEC_AVC 7
+#define FLV_KEY_FRAME 1
+#define FLV_VIDEO_FRAME_COMMAND 5
+#define FLV_SOUND_FORMAT_AAC 10
+#define FLV_SEQUENCE_HEADER 0
+#define FLV_RAW_DATA 1
+
+// RTMP timestamps are in milliseconds, while the frames are returned with
+// timestamps in Membrane time units
+#define MEMBRANE_TIME_PER_MILLISECOND 1000000
+
+void handle_destroy_state(UnifexEnv *env, State *state);
+
+// Bytes held by all the sessions of the node
+static atomic_uint_fast64_t total_memory;
+
+static void init_state(State *state) {
+  state->status = SESSION_HANDSHAKE;
+  state->handshake_c1_received = false;
+
+  state->memory = 0;
+  state->max_memory = 0;
+  state->memory_budget = 0;
+
+  state->input = NULL;
+  state->input_size = 0;
+  state->input_capacity = 0;
+
+  state->in_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+  state->out_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+  state->chunk_streams = NULL;
+  state->chunk_streams_count = 0;
+
+  state->bytes_received = 0;
+  state->bytes_acknowledged = 0;
+  state->window_ack_size = SERVER_WINDOW_ACK_SIZE;
+
+  state->app[0] = '\0';
+  state->stream_key[0] = '\0';
+
+  state->video_config = NULL;
+  state->video_config_size = 0;
+  state->audio_config = NULL;
+  state->audio_config_size = 0;
+
+  state->annex_b = true;
+  state->nal_length_size = 0;
+
+  amf0_buffer_init(&state->response);
+  memset(&state->video, 0, sizeof(state->video));
+  memset(&state->audio, 0, sizeof(state->audio));
+  state->keyframe_index = -1;
+}
+
+UNIFEX_TERM create(UnifexEnv *env, uint64_t max_memory,
+                   uint64_t memory_budget) {
+  State *state = unifex_alloc_state(env);
+  init_state(state);
+  state->max_memory = max_memory;
+  state->memory_budget = memory_budget;
+  UNIFEX_TERM result = create_result_ok(env, state);
+  unifex_release_state(env, state);
+  return result;
+}
+
+UNIFEX_TERM set_annex_b(UnifexEnv *env, State *state, int annex_b) {
+  state->annex_b = annex_b;
+  return set_annex_b_result_ok(env);
+}
+
+// Accounts the bytes about to be held by the session, unless they don't fit
+// within its limits
+static int charge(State *state, uint64_t size, const char **error) {
+  if (state->max_memory > 0 && state->memory + size > state->max_memory) {
+    *error = "Session memory limit exceeded";
+    return -1;
+  }
+  // The bytes are reserved before checking the budget, so that sessions
+  // growing concurrently can't exceed it together
+  uint64_t total = atomic_fetch_add(&total_memory, size) + size;
+  if (state->memory_budget > 0 && total > state->memory_budget) {
+    atomic_fetch_sub(&total_memory, size);
+    *error = "Memory budget exceeded";
+    return -1;
+  }
+  state->memory += size;
+  return 0;
+}
+
+static void discharge(State *state, uint64_t size) {
+  state->memory -= size;
+  atomic_fetch_sub(&total_memory, size);
+}
+
+// Grows a buffer of the session from `size` to `new_size` bytes, charging
+// the growth to the session and to the node. If a limit would be exceeded,
+// returns NULL with the reason in `error` and leaves the buffer untouched.
+static void *grow_buffer(State *state, void *buffer, size_t size,
+                         size_t new_size, const char **error) {
+  uint64_t growth = new_size - size;
+  if (charge(state, growth, error) < 0) {
+    return NULL;
+  }
+  void *grown = realloc(buffer, new_size);
+  if (!grown) {
+    discharge(state, growth);
+    *error = "Out of memory";
+    return NULL;
+  }
+  return grown;
+}
+
+static void free_buffer(State *state, void *buffer, size_t size) {
+  free(buffer);
+  discharge(state, size);
+}
+
+static uint32_t read_uint(const uint8_t *data, int size) {
+  uint32_t value = 0;
+  for (int i = 0; i < size; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static void write_uint(uint8_t *data, uint32_t value, int size) {
+  for (int i = size - 1; i >= 0; i--) {
+    data[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+static const char *status_name(SessionStatus status) {
+  switch (status) {
+  case SESSION_HANDSHAKE:
+    return "handshake";
+  case SESSION_CONNECTED:
+    return "connected";
+  case SESSION_PUBLISHING:
+    return "publishing";
+  default:
+    return "unpublished";
+  }
+}
+
+// The list's arrays are kept between the `feed` calls, so that no
+// allocations are needed once they have grown to the usual number of frames.
+// Returns NULL if the frame can't be allocated.
+static UnifexPayload *frame_list_append(UnifexEnv *env, FrameList *list,
+                                        int64_t pts, int64_t dts,
+                                        unsigned int size,
+                                        const char **error) {
+  if (list->length == list->capacity) {
+    // Each array is replaced as soon as it's grown, so that none is lost if
+    // growing the next one fails, and the capacity is updated once they all
+    // have grown
+    unsigned int capacity = list->capacity ? 2 * list->capacity : 16;
+    int64_t *pts_list = realloc(list->pts, capacity * sizeof(*list->pts));
+    if (pts_list) {
+      list->pts = pts_list;
+    }
+    int64_t *dts_list =
+        pts_list ? realloc(list->dts, capacity * sizeof(*list->dts)) : NULL;
+    if (dts_list) {
+      list->dts = dts_list;
+    }
+    UnifexPayload *payloads =
+        dts_list ? realloc(list->payloads, capacity * sizeof(*list->payloads))
+                 : NULL;
+    if (payloads) {
+      list->payloads = payloads;
+    }
+    UnifexPayload **frames =
+        payloads ? realloc(list->frames, capacity * sizeof(*list->frames))
+                 : NULL;
+    if (!frames) {
+      *error = "Out of memory";
+      return NULL;
+    }
+    list->frames = frames;
+    list->capacity = capacity;
+  }
+
+  unsigned int i = list->length;
+  if (!unifex_payload_alloc(env, UNIFEX_PAYLOAD_BINARY, size,
+                            &list->payloads[i])) {
+    *error = "Out of memory";
+    return NULL;
+  }
+  list->length++;
+  list->pts[i] = pts * MEMBRANE_TIME_PER_MILLISECOND;
+  list->dts[i] = dts * MEMBRANE_TIME_PER_MILLISECOND;
+  return &list->payloads[i];
+}
+
+// Points the frames at the payloads, which might have been moved when the
+// list was growing
+static UnifexPayload **frame_list_frames(FrameList *list) {
+  for (unsigned int i = 0; i < list->length; i++) {
+    list->frames[i] = &list->payloads[i];
+  }
+  return list->frames;
+}
+
+static void frame_list_clear(FrameList *list) {
+  for (unsigned int i = 0; i < list->length; i++) {
+    unifex_payload_release(&list->payloads[i]);
+  }
+  list->length = 0;
+}
+
+static void frame_list_free(FrameList *list) {
+  frame_list_clear(list);
+  free(list->pts);
+  free(list->dts);
+  free(list->payloads);
+  free(list->frames);
+  memset(list, 0, sizeof(*list));
+}
+
+// Serializes a message to the response. All the messages sent by the server
+// are small, so there's no need to compress the chunk headers.
+static void send_message(State *state, uint8_t chunk_stream_id,
+                         uint8_t message_type, uint32_t message_stream_id,
+                         const uint8_t *payload, uint32_t size) {
+  uint8_t header[12];
+  header[0] = chunk_stream_id;
+  // timestamp
+  write_uint(header + 1, 0, 3);
+  write_uint(header + 4, size, 3);
+  header[7] = message_type;
+  // message stream id is the only little endian field
+  for (int i = 0; i < 4; i++) {
+    header[8 + i] = (message_stream_id >> (8 * i)) & 0xFF;
+  }
+  amf0_buffer_append(&state->response, header, sizeof(header));
+
+  for (uint32_t offset = 0; offset < size; offset += state->out_chunk_size) {
+    if (offset > 0) {
+      uint8_t continuation = 0xC0 | chunk_stream_id;
+      amf0_buffer_append(&state->response, &continuation, 1);
+    }
+    uint32_t chunk_size = size - offset < state->out_chunk_size
+                              ? size - offset
+                              : state->out_chunk_size;
+    amf0_buffer_append(&state->response, payload + offset, chunk_size);
+  }
+}
+
+static void send_control_message(State *state, uint8_t message_type,
+                                 uint32_t value) {
+  uint8_t payload[4];
+  write_uint(payload, value, 4);
+  send_message(state, CONTROL_CHUNK_STREAM, message_type, 0, payload,
+               sizeof(payload));
+}
+
+static void send_command(State *state, uint32_t message_stream_id,
+                         AMF0Buffer *command) {
+  // A failed command fails the response, which is checked once by `feed`
+  if (command->failed) {
+    state->response.failed = true;
+  } else {
+    send_message(state, COMMAND_CHUNK_STREAM, MESSAGE_AMF0_COMMAND,
+                 message_stream_id, command->data, command->size);
+  }
+  amf0_buffer_free(command);
+}
+
+static void send_connect_result(State *state, double transaction_id) {
+  send_control_message(state, MESSAGE_WINDOW_ACK_SIZE, SERVER_WINDOW_ACK_SIZE);
+
+  uint8_t bandwidth[5];
+  write_uint(bandwidth, SERVER_WINDOW_ACK_SIZE, 4);
+  // dynamic limit type
+  bandwidth[4] = 2;
+  send_message(state, CONTROL_CHUNK_STREAM, MESSAGE_SET_PEER_BANDWIDTH, 0,
+               bandwidth, sizeof(bandwidth));
+
+  send_control_message(state, MESSAGE_SET_CHUNK_SIZE, SERVER_CHUNK_SIZE);
+  state->out_chunk_size = SERVER_CHUNK_SIZE;
+
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, "_result");
+  amf0_write_number(&command, transaction_id);
+  amf0_write_object_start(&command);
+  amf0_write_property(&command, "fmsVer");
+  amf0_write_string(&command, "FMS/3,0,1,123");
+  amf0_write_property(&command, "capabilities");
+  amf0_write_number(&command, 31);
+  amf0_write_object_end(&command);
+  amf0_write_object_start(&command);
+  amf0_write_property(&command, "level");
+  amf0_write_string(&command, "status");
+  amf0_write_property(&command, "code");
+  amf0_write_string(&command, "NetConnection.Connect.Success");
+  amf0_write_property(&command, "description");
+  amf0_write_string(&command, "Connection succeeded.");
+  amf0_write_property(&command, "objectEncoding");
+  amf0_write_number(&command, 0);
+  amf0_write_object_end(&command);
+  send_command(state, 0, &command);
+}
+
+static void send_result(State *state, double transaction_id,
+                        bool with_stream_id) {
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, "_result");
+  amf0_write_number(&command, transaction_id);
+  amf0_write_null(&command);
+  if (with_stream_id) {
+    amf0_write_number(&command, PUBLISH_STREAM_ID);
+  }
+  send_command(state, 0, &command);
+}
+
+static void send_publish_status(State *state) {
+  AMF0Buffer command;
+  amf0_buffer_init(&command);
+  amf0_write_string(&command, "onStatus");
+  amf0_write_number(&command, 0);
+  amf0_write_null(&command);
+  amf0_write_object_start(&command);
+  amf0_write_property(&command, "level");
+  amf0_write_string(&command, "status");
+  amf0_write_property(&command, "code");
+  amf0_write_string(&command, "NetStream.Publish.Start");
+  amf0_write_property(&command, "description");
+  amf0_write_string(&command, "Stream is now published.");
+  amf0_write_property(&command, "details");
+  amf0_write_string(&command, state->stream_key);
+  amf0_write_object_end(&command);
+  send_command(state, PUBLISH_STREAM_ID, &command);
+}
+
+static bool command_is(const char *name, size_t name_length,
+                       const char *expected) {
+  return strlen(expected) == name_length &&
+         memcmp(name, expected, name_length) == 0;
+}
+
+static int handle_command(State *state, const uint8_t *data, uint32_t size,
+                          const char **error) {
+  AMF0Reader reader;
+  const char *name;
+  size_t name_length;
+  double transaction_id;
+
+  amf0_reader_init(&reader, data, size);
+  if (amf0_read_string(&reader, &name, &name_length) < 0 ||
+      amf0_read_number(&reader, &transaction_id) < 0) {
+    *error = "Malformed command";
+    return -1;
+  }
+
+  if (command_is(name, name_length, "connect")) {
+    if (amf0_read_object_string(&reader, "app", state->app,
+                                sizeof(state->app)) < 0) {
+      *error = "Malformed connect command";
+      return -1;
+    }
+    send_connect_result(state, transaction_id);
+  } else if (command_is(name, name_length, "releaseStream") ||
+             command_is(name, name_length, "FCPublish")) {
+    send_result(state, transaction_id, false);
+  } else if (command_is(name, name_length, "createStream")) {
+    send_result(state, transaction_id, true);
+  } else if (command_is(name, name_length, "publish")) {
+    const char *stream_key;
+    size_t stream_key_length;
+    // command object is null
+    if (amf0_skip_value(&reader) < 0 ||
+        amf0_read_string(&reader, &stream_key, &stream_key_length) < 0) {
+      *error = "Malformed publish command";
+      return -1;
+    }
+    if (stream_key_length >= sizeof(state->stream_key)) {
+      stream_key_length = sizeof(state->stream_key) - 1;
+    }
+    memcpy(state->stream_key, stream_key, stream_key_length);
+    state->stream_key[stream_key_length] = '\0';
+
+    send_publish_status(state);
+    state->status = SESSION_PUBLISHING;
+  } else if (command_is(name, name_length, "FCUnpublish") ||
+             command_is(name, name_length, "deleteStream") ||
+             command_is(name, name_length, "closeStream")) {
+    if (state->status == SESSION_PUBLISHING) {
+      state->status = SESSION_UNPUBLISHED;
+    }
+  } else if (command_is(name, name_length, "play")) {
+    *error = "Playing streams is not supported";
+    return -1;
+  }
+  // other commands don't require any action
+  return 0;
+}
+
+// An empty sequence header leaves no config, as if it wasn't received
+static int store_config(State *state, uint8_t **config, int *config_size,
+                        const uint8_t *data, uint32_t size,
+                        const char **error) {
+  free_buffer(state, *config, *config_size);
+  *config = NULL;
+  *config_size = 0;
+  if (size == 0) {
+    return 0;
+  }
+  *config = grow_buffer(state, NULL, 0, size, error);
+  if (!*config) {
+    return -1;
+  }
+  memcpy(*config, data, size);
+  *config_size = size;
+  return 0;
+}
+
+static int handle_video(UnifexEnv *env, State *state, uint32_t timestamp,
+                        const uint8_t *data, uint32_t size,
+                        const char **error) {
+  if (size < 5 || (data[0] >> 4) == FLV_VIDEO_FRAME_COMMAND) {
+    return 0;
+  }
+  if ((data[0] & 0x0F) != FLV_CODEC_AVC) {
+    *error = "Unsupported video codec. Only H264 is supported";
+    return -1;
+  }
+
+  uint8_t packet_type = data[1];
+  // composition time is a signed 24-bit integer
+  int32_t composition_time = (int32_t)(read_uint(data + 2, 3) << 8) >> 8;
+  const uint8_t *payload = data + 5;
+  uint32_t payload_size = size - 5;
+
+  if (packet_type == FLV_SEQUENCE_HEADER) {
+    if (store_config(state, &state->video_config, &state->video_config_size,
+                     payload, payload_size, error) < 0) {
+      return -1;
+    }
+    state->nal_length_size = avc_nal_length_size(payload, payload_size);
+  } else if (packet_type == FLV_RAW_DATA) {
+    int64_t dts = timestamp;
+    int64_t pts = dts + composition_time;
+
+    if ((data[0] >> 4) == FLV_KEY_FRAME) {
+      state->keyframe_index = state->video.length;
+    }
+
+    if (state->annex_b && state->nal_length_size > 0) {
+      int frame_size =
+          avc_annex_b_size(payload, payload_size, state->nal_length_size);
+      UnifexPayload *frame =
+          frame_list_append(env, &state->video, pts, dts, frame_size, error);
+      if (!frame) {
+        return -1;
+      }
+      avc_to_annex_b(payload, payload_size, state->nal_length_size,
+                     frame->data);
+    } else {
+      UnifexPayload *frame = frame_list_append(env, &state->video, pts, dts,
+                                               payload_size, error);
+      if (!frame) {
+        return -1;
+      }
+      memcpy(frame->data, payload, payload_size);
+    }
+  }
+  return 0;
+}
+
+static int handle_audio(UnifexEnv *env, State *state, uint32_t timestamp,
+                        const uint8_t *data, uint32_t size,
+                        const char **error) {
+  if (size < 2) {
+    return 0;
+  }
+  if ((data[0] >> 4) != FLV_SOUND_FORMAT_AAC) {
+    *error = "Unsupported audio codec. Only AAC is supported";
+    return -1;
+  }
+
+  const uint8_t *payload = data + 2;
+  uint32_t payload_size = size - 2;
+
+  if (data[1] == FLV_SEQUENCE_HEADER) {
+    if (store_config(state, &state->audio_config, &state->audio_config_size,
+                     payload, payload_size, error) < 0) {
+      return -1;
+    }
+  } else if (data[1] == FLV_RAW_DATA) {
+    UnifexPayload *frame = frame_list_append(env, &state->audio, timestamp,
+                                             timestamp, payload_size, error);
+    if (!frame) {
+      return -1;
+    }
+    memcpy(frame->data, payload, payload_size);
+  }
+  return 0;
+}
+
+static ChunkStream *get_chunk_stream(State *state, uint32_t id,
+                                     const char **error) {
+  for (int i = 0; i < state->chunk_streams_count; i++) {
+    if (state->chunk_streams[i].id == id) {
+      return &state->chunk_streams[i];
+    }
+  }
+
+  ChunkStream *chunk_streams =
+      grow_buffer(state, state->chunk_streams,
+                  state->chunk_streams_count * sizeof(ChunkStream),
+                  (state->chunk_streams_count + 1) * sizeof(ChunkStream),
+                  error);
+  if (!chunk_streams) {
+    return NULL;
+  }
+  state->chunk_streams = chunk_streams;
+  ChunkStream *chunk_stream =
+      &state->chunk_streams[state->chunk_streams_count++];
+  memset(chunk_stream, 0, sizeof(*chunk_stream));
+  chunk_stream->id = id;
+  return chunk_stream;
+}
+
+static int handle_message(UnifexEnv *env, State *state,
+                          ChunkStream *chunk_stream, const uint8_t *data,
+                          const char **error) {
+  uint32_t size = chunk_stream->message_length;
+
+  switch (chunk_stream->message_type) {
+  case MESSAGE_SET_CHUNK_SIZE:
+    if (size < 4 || (read_uint(data, 4) & 0x7FFFFFFF) == 0) {
+      *error = "Invalid chunk size";
+      return -1;
+    }
+    state->in_chunk_size = read_uint(data, 4) & 0x7FFFFFFF;
+    return 0;
+
+  case MESSAGE_ABORT:
+    if (size >= 4) {
+      ChunkStream *aborted =
+          get_chunk_stream(state, read_uint(data, 4), error);
+      if (!aborted) {
+        return -1;
+      }
+      aborted->received = 0;
+    }
+    return 0;
+
+  case MESSAGE_WINDOW_ACK_SIZE:
+    if (size >= 4) {
+      state->window_ack_size = read_uint(data, 4);
+    }
+    return 0;
+
+  case MESSAGE_AMF0_COMMAND:
+    return handle_command(state, data, size, error);
+
+  case MESSAGE_AMF3_COMMAND:
+    // AMF3 commands are AMF0 encoded, preceded by a single format byte
+    return size > 0 ? handle_command(state, data + 1, size - 1, error) : 0;
+
+  case MESSAGE_VIDEO:
+    return state->status == SESSION_PUBLISHING
+               ? handle_video(env, state, chunk_stream->timestamp, data, size,
+                              error)
+               : 0;
+
+  case MESSAGE_AUDIO:
+    return state->status == SESSION_PUBLISHING
+               ? handle_audio(env, state, chunk_stream->timestamp, data, size,
+                              error)
+               : 0;
+
+  default:
+    // Metadata, acknowledgements and user control messages are not needed
+    return 0;
+  }
+}
+
+// Each of the parsing functions returns 1 if it has consumed some input,
+// 0 if more data is needed and -1 on error.
+
+static int parse_handshake(State *state, const uint8_t *input, size_t size,
+                           size_t *pos, const char **error) {
+  size_t available = size - *pos;
+  const uint8_t *data = input + *pos;
+
+  if (!state->handshake_c1_received) {
+    if (available < 1 + RTMP_HANDSHAKE_SIZE) {
+      return 0;
+    }
+    if (data[0] != 3) {
+      *error = "Unsupported RTMP version";
+      return -1;
+    }
+
+    // S0: version, S1: time, zeros and random bytes, S2: echo of C1
+    uint8_t s0s1[1 + RTMP_HANDSHAKE_SIZE];
+    memset(s0s1, 0, sizeof(s0s1));
+    s0s1[0] = 3;
+    for (int i = 9; i < 1 + RTMP_HANDSHAKE_SIZE; i++) {
+      s0s1[i] = rand() & 0xFF;
+    }
+    amf0_buffer_append(&state->response, s0s1, sizeof(s0s1));
+    amf0_buffer_append(&state->response, data + 1, RTMP_HANDSHAKE_SIZE);
+
+    *pos += 1 + RTMP_HANDSHAKE_SIZE;
+    state->handshake_c1_received = true;
+    return 1;
+  }
+
+  if (available < RTMP_HANDSHAKE_SIZE) {
+    return 0;
+  }
+  *pos += RTMP_HANDSHAKE_SIZE;
+  state->status = SESSION_CONNECTED;
+  return 1;
+}
+
+static int parse_chunk(UnifexEnv *env, State *state, const uint8_t *input,
+                       size_t size, size_t *pos, const char **error) {
+  static const size_t message_header_sizes[] = {11, 7, 3, 0};
+
+  size_t available = size - *pos;
+  const uint8_t *data = input + *pos;
+
+  if (available < 1) {
+    return 0;
+  }
+
+  uint8_t fmt = data[0] >> 6;
+  uint32_t id = data[0] & 0x3F;
+  size_t header_size = 1;
+  if (id == 0) {
+    if (available < 2) {
+      return 0;
+    }
+    id = 64 + data[1];
+    header_size = 2;
+  } else if (id == 1) {
+    if (available < 3) {
+      return 0;
+    }
+    id = 64 + data[1] + 256 * data[2];
+    header_size = 3;
+  }
+
+  const uint8_t *message_header = data + header_size;
+  header_size += message_header_sizes[fmt];
+  if (available < header_size) {
+    return 0;
+  }
+
+  ChunkStream *chunk_stream = get_chunk_stream(state, id, error);
+  if (!chunk_stream) {
+    return -1;
+  }
+  bool extended_timestamp = chunk_stream->extended_timestamp;
+  uint32_t timestamp = chunk_stream->timestamp_delta;
+  uint32_t message_length = chunk_stream->message_length;
+  uint8_t message_type = chunk_stream->message_type;
+  uint32_t message_stream_id = chunk_stream->message_stream_id;
+
+  if (fmt <= 2) {
+    timestamp = read_uint(message_header, 3);
+    extended_timestamp = timestamp == 0xFFFFFF;
+  }
+  if (fmt <= 1) {
+    message_length = read_uint(message_header + 3, 3);
+    message_type = message_header[6];
+  }
+  if (fmt == 0) {
+    message_stream_id = 0;
+    for (int i = 3; i >= 0; i--) {
+      message_stream_id = (message_stream_id << 8) | message_header[7 + i];
+    }
+  }
+  if (extended_timestamp) {
+    if (available < header_size + 4) {
+      return 0;
+    }
+    if (fmt <= 2) {
+      timestamp = read_uint(data + header_size, 4);
+    }
+    header_size += 4;
+  }
+
+  // Any header other than type 3 starts a new message, so does a type 3
+  // header if the previous message has been completed
+  bool new_message = fmt != 3 || chunk_stream->received == 0;
+  uint32_t received = new_message ? 0 : chunk_stream->received;
+  if (message_length > MAX_MESSAGE_SIZE) {
+    *error = "Message too long";
+    return -1;
+  }
+  uint32_t chunk_size = message_length - received < state->in_chunk_size
+                            ? message_length - received
+                            : state->in_chunk_size;
+  if (available < header_size + chunk_size) {
+    return 0;
+  }
+
+  if (new_message) {
+    // timestamp of a type 0 header is absolute, all the others are deltas
+    chunk_stream->timestamp =
+        fmt == 0 ? timestamp : chunk_stream->timestamp + timestamp;
+    chunk_stream->timestamp_delta = timestamp;
+    chunk_stream->extended_timestamp = extended_timestamp;
+    chunk_stream->message_length = message_length;
+    chunk_stream->message_type = message_type;
+    chunk_stream->message_stream_id = message_stream_id;
+    chunk_stream->received = 0;
+
+    // A message that fits in a single chunk is handled straight from the
+    // input, without reassembling it
+    if (chunk_size == message_length) {
+      *pos += header_size + chunk_size;
+      return handle_message(env, state, chunk_stream, data + header_size,
+                            error) < 0
+                 ? -1
+                 : 1;
+    }
+
+    // The buffer is kept for the following messages of the chunk stream, so
+    // it's grown geometrically to settle at the usual message size quickly.
+    // Close to the memory limits, it's grown just to the message size.
+    if (chunk_stream->message_capacity < message_length) {
+      uint32_t capacity = 2 * chunk_stream->message_capacity;
+      capacity = capacity < message_length ? message_length : capacity;
+      uint8_t *message =
+          grow_buffer(state, chunk_stream->message,
+                      chunk_stream->message_capacity, capacity, error);
+      if (!message && capacity > message_length) {
+        capacity = message_length;
+        message = grow_buffer(state, chunk_stream->message,
+                              chunk_stream->message_capacity, capacity, error);
+      }
+      if (!message) {
+        return -1;
+      }
+      chunk_stream->message = message;
+      chunk_stream->message_capacity = capacity;
+    }
+  }
+
+  if (chunk_size > 0) {
+    memcpy(chunk_stream->message + chunk_stream->received, data + header_size,
+           chunk_size);
+  }
+  chunk_stream->received += chunk_size;
+  *pos += header_size + chunk_size;
+
+  if (chunk_stream->received == chunk_stream->message_length) {
+    chunk_stream->received = 0;
+    if (handle_message(env, state, chunk_stream, chunk_stream->message,
+                       error) < 0) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+static void maybe_acknowledge(State *state) {
+  if (state->status == SESSION_HANDSHAKE || state->window_ack_size == 0 ||
+      state->bytes_received - state->bytes_acknowledged <
+          state->window_ack_size) {
+    return;
+  }
+  send_control_message(state, MESSAGE_ACKNOWLEDGEMENT,
+                       state->bytes_received & 0xFFFFFFFF);
+  state->bytes_acknowledged = state->bytes_received;
+}
+
+static int append_input(State *state, const uint8_t *data, size_t size,
+                        const char **error) {
+  if (size == 0) {
+    return 0;
+  }
+  if (state->input_size + size > state->input_capacity) {
+    size_t capacity = state->input_size + size;
+    uint8_t *input = grow_buffer(state, state->input, state->input_capacity,
+                                 capacity, error);
+    if (!input) {
+      return -1;
+    }
+    state->input = input;
+    state->input_capacity = capacity;
+  }
+  memcpy(state->input + state->input_size, data, size);
+  state->input_size += size;
+  return 0;
+}
+
+// Upper bound of the input needed to parse the next handshake part or chunk
+static size_t max_item_size(State *state) {
+  if (state->status == SESSION_HANDSHAKE) {
+    return 1 + RTMP_HANDSHAKE_SIZE;
+  }
+  return MAX_CHUNK_HEADER_SIZE + (state->in_chunk_size < MAX_MESSAGE_SIZE
+                                      ? state->in_chunk_size
+                                      : MAX_MESSAGE_SIZE);
+}
+
+#define PARSE_ERROR -1
+#define PARSE_NEED_DATA 0
+#define PARSE_STOPPED 1
+#define PARSE_LIMIT_REACHED 2
+
+// Parses the input from `pos` until `limit` is reached or more data is
+// needed. Parsing stops right after the stream is published, so that the
+// owner can configure the session before any frames are parsed. The rest of
+// the input is parsed with the next call.
+static int parse_input(UnifexEnv *env, State *state, const uint8_t *input,
+                       size_t size, size_t *pos, size_t limit,
+                       const char **error) {
+  while (*pos < limit) {
+    if (state->status == SESSION_UNPUBLISHED) {
+      return PARSE_STOPPED;
+    }
+    SessionStatus previous_status = state->status;
+    int ret = state->status == SESSION_HANDSHAKE
+                  ? parse_handshake(state, input, size, pos, error)
+                  : parse_chunk(env, state, input, size, pos, error);
+    if (ret <= 0) {
+      return ret < 0 ? PARSE_ERROR : PARSE_NEED_DATA;
+    }
+    if (previous_status != SESSION_PUBLISHING &&
+        state->status == SESSION_PUBLISHING) {
+      return PARSE_STOPPED;
+    }
+  }
+  return PARSE_LIMIT_REACHED;
+}
+
+UNIFEX_TERM feed(UnifexEnv *env, State *state, UnifexPayload *data) {
+  const char *error = NULL;
+  const uint8_t *input = data->data;
+  size_t size = data->size;
+  size_t pos = 0;
+  int ret = PARSE_LIMIT_REACHED;
+
+  state->bytes_received += data->size;
+
+  // The input is parsed straight from the received data. Only the chunk
+  // split between the previous call and this one is completed in the
+  // internal buffer, with just the part of the data it can span.
+  if (state->input_size > 0) {
+    size_t leftover = state->input_size;
+    size_t prefix = size < max_item_size(state) ? size : max_item_size(state);
+    ret = append_input(state, data->data, prefix, &error) < 0
+              ? PARSE_ERROR
+              : parse_input(env, state, state->input, state->input_size, &pos,
+                            leftover, &error);
+
+    if (ret == PARSE_LIMIT_REACHED) {
+      state->input_size = 0;
+      pos -= leftover;
+    } else if (ret != PARSE_ERROR) {
+      if (append_input(state, data->data + prefix, size - prefix, &error) <
+          0) {
+        ret = PARSE_ERROR;
+      } else {
+        input = state->input;
+        size = state->input_size;
+        if (ret == PARSE_NEED_DATA && prefix < data->size) {
+          ret = PARSE_LIMIT_REACHED;
+        }
+      }
+    }
+  }
+  if (ret == PARSE_LIMIT_REACHED) {
+    ret = parse_input(env, state, input, size, &pos, size, &error);
+  }
+
+  UNIFEX_TERM result;
+  if (ret == PARSE_ERROR) {
+    result = feed_result_error(env, error);
+    goto end;
+  }
+  if (state->response.failed) {
+    result = feed_result_error(env, "Out of memory");
+    goto end;
+  }
+
+  // Keep the input that hasn't been parsed for the next call
+  if (input == state->input) {
+    state->input_size -= pos;
+    if (state->input_size > 0) {
+      memmove(state->input, state->input + pos, state->input_size);
+    }
+  } else if (append_input(state, input + pos, size - pos, &error) < 0) {
+    result = feed_result_error(env, error);
+    goto end;
+  }
+  maybe_acknowledge(state);
+
+  UnifexPayload response;
+  if (!unifex_payload_alloc(env, UNIFEX_PAYLOAD_BINARY, state->response.size,
+                            &response)) {
+    result = feed_result_error(env, "Out of memory");
+    goto end;
+  }
+  if (state->response.size > 0) {
+    memcpy(response.data, state->response.data, state->response.size);
+  }
+
+  result = feed_result_ok(
+      env, status_name(state->status), &response, state->video.pts,
+      state->video.length, state->video.dts, state->video.length,
+      frame_list_frames(&state->video), state->video.length, state->audio.pts,
+      state->audio.length, state->audio.dts, state->audio.length,
+      frame_list_frames(&state->audio), state->audio.length,
+      state->keyframe_index);
+  unifex_payload_release(&response);
+
+end:
+  state->response.size = 0;
+  state->response.failed = false;
+  frame_list_clear(&state->video);
+  frame_list_clear(&state->audio);
+  state->keyframe_index = -1;
+  return result;
+}
+
+UNIFEX_TERM get_publish_info(UnifexEnv *env, State *state) {
+  if (state->status != SESSION_PUBLISHING &&
+      state->status != SESSION_UNPUBLISHED) {
+    return get_publish_info_result_error(env);
+  }
+  return get_publish_info_result_ok(env, state->app, state->stream_key);
+}
+
+UNIFEX_TERM get_memory(UnifexEnv *env, State *state) {
+  return get_memory_result_ok(env, state->memory);
+}
+
+UNIFEX_TERM charge_memory(UnifexEnv *env, State *state, uint64_t bytes) {
+  const char *error;
+  if (charge(state, bytes, &error) < 0) {
+    return charge_memory_result_error(env, error);
+  }
+  return charge_memory_result_ok(env);
+}
+
+UNIFEX_TERM discharge_memory(UnifexEnv *env, State *state, uint64_t bytes) {
+  discharge(state, bytes < state->memory ? bytes : state->memory);
+  return discharge_memory_result_ok(env);
+}
+
+UNIFEX_TERM get_total_memory(UnifexEnv *env) {
+  return get_total_memory_result_ok(env, atomic_load(&total_memory));
+}
+
+static UNIFEX_TERM make_params(UnifexEnv *env, const uint8_t *config,
+                               int config_size,
+                               UNIFEX_TERM (*result_ok)(UnifexEnv *,
+                                                        UnifexPayload *)) {
+  UnifexPayload payload;
+  unifex_payload_alloc(env, UNIFEX_PAYLOAD_BINARY, config_size, &payload);
+  memcpy(payload.data, config, config_size);
+  UNIFEX_TERM result = result_ok(env, &payload);
+  unifex_payload_release(&payload);
+  return result;
+}
+
+UNIFEX_TERM get_video_params(UnifexEnv *env, State *state) {
+  if (!state->video_config) {
+    return get_video_params_result_error(env);
+  }
+  return make_params(env, state->video_config, state->video_config_size,
+                     &get_video_params_result_ok);
+}
+
+UNIFEX_TERM get_audio_params(UnifexEnv *env, State *state) {
+  if (!state->audio_config) {
+    return get_audio_params_result_error(env);
+  }
+  return make_params(env, state->audio_config, state->audio_config_size,
+                     &get_audio_params_result_ok);
+}
+
+void handle_destroy_state(UnifexEnv *env, State *state) {
+  UNIFEX_UNUSED(env);
+
+  free_buffer(state, state->input, state->input_capacity);
+  for (int i = 0; i < state->chunk_streams_count; i++) {
+    free_buffer(state, state->chunk_streams[i].message,
+                state->chunk_streams[i].message_capacity);
+  }
+  free_buffer(state, state->chunk_streams,
+              state->chunk_streams_count * sizeof(ChunkStream));
+  free_buffer(state, state->video_config, state->video_config_size);
+  free_buffer(state, state->audio_config, state->audio_config_size);
+  // The rest is charged for the frames kept by the session's process
+  discharge(state, state->memory);
+  amf0_buffer_free(&state->response);
+  frame_list_free(&state->video);
+  frame_list_free(&state->audio);
+}
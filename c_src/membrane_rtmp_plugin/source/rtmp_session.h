@@ -0,0 +1,93 @@
+#pragma once
+
+#include "../common/amf0.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <unifex/unifex.h>
+
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+#define RTMP_MAX_NAME_SIZE 256
+
+typedef enum SessionStatus {
+  SESSION_HANDSHAKE,
+  SESSION_CONNECTED,
+  SESSION_PUBLISHING,
+  SESSION_UNPUBLISHED
+} SessionStatus;
+
+// State of a single chunk stream, in which the message currently being
+// received is reassembled
+typedef struct ChunkStream {
+  uint32_t id;
+  uint32_t timestamp;
+  uint32_t timestamp_delta;
+  bool extended_timestamp;
+  uint32_t message_length;
+  uint8_t message_type;
+  uint32_t message_stream_id;
+
+  uint8_t *message;
+  uint32_t message_capacity;
+  uint32_t received;
+} ChunkStream;
+
+typedef struct FrameList {
+  int64_t *pts;
+  int64_t *dts;
+  UnifexPayload *payloads;
+  // Pointers to the payloads, as expected by the generated result function
+  UnifexPayload **frames;
+  unsigned int length;
+  unsigned int capacity;
+} FrameList;
+
+typedef struct State State;
+
+struct State {
+  SessionStatus status;
+  bool handshake_c1_received;
+
+  // Bytes of the buffers held by the session: the input, the reassembled
+  // messages and the sequence headers, as well as the frames the session's
+  // process keeps, charged with `charge_memory`. They're limited to
+  // `max_memory` and, summed over all the sessions of the node, to
+  // `memory_budget`. Limits of 0 leave the memory unbounded.
+  uint64_t memory;
+  uint64_t max_memory;
+  uint64_t memory_budget;
+
+  // Bytes received from the client that haven't been parsed yet
+  uint8_t *input;
+  size_t input_size;
+  size_t input_capacity;
+
+  uint32_t in_chunk_size;
+  uint32_t out_chunk_size;
+  ChunkStream *chunk_streams;
+  int chunk_streams_count;
+
+  uint64_t bytes_received;
+  uint64_t bytes_acknowledged;
+  uint32_t window_ack_size;
+
+  char app[RTMP_MAX_NAME_SIZE];
+  char stream_key[RTMP_MAX_NAME_SIZE];
+
+  uint8_t *video_config;
+  int video_config_size;
+  uint8_t *audio_config;
+  int audio_config_size;
+
+  bool annex_b;
+  int nal_length_size;
+
+  // Results of the current `feed` call
+  AMF0Buffer response;
+  FrameList video;
+  FrameList audio;
+  // Index of the last keyframe among the video frames, -1 if there's none
+  int keyframe_index;
+};
+
+#include "_generated/rtmp_session.h"
@@ -0,0 +1,31 @@
+module Membrane.RTMP.Listener.Native
+
+state_type "State"
+interface [NIF]
+
+spec create(max_memory :: uint64, memory_budget :: uint64) :: {:ok :: label, state}
+
+spec set_annex_b(state, annex_b :: bool) :: :ok :: label
+
+# Timestamps are in Membrane time units. The keyframe index is the index of the last
+# keyframe among the video frames, -1 if there's none
+spec feed(state, data :: payload) ::
+       {:ok :: label, status :: atom, response :: payload, video_pts :: [int64],
+        video_dts :: [int64], video_frames :: [payload], audio_pts :: [int64],
+        audio_dts :: [int64], audio_frames :: [payload], keyframe_index :: int}
+       | {:error :: label, reason :: string}
+
+spec get_publish_info(state) ::
+       {:ok :: label, app :: string, stream_key :: string} | {:error :: label, :not_published}
+
+# Bytes of the buffers held by the session and by all the sessions of the node
+spec get_memory(state) :: {:ok :: label, memory :: uint64}
+spec get_total_memory() :: {:ok :: label, memory :: uint64}
+
+# Accounts the bytes of the frames kept by the session's process, such as the GOP cache,
+# within the same limits as the buffers
+spec charge_memory(state, bytes :: uint64) :: (:ok :: label) | {:error :: label, reason :: string}
+spec discharge_memory(state, bytes :: uint64) :: :ok :: label
+
+spec get_video_params(state) :: {:ok :: label, params :: payload} | {:error :: label, :no_stream}
+spec get_audio_params(state) :: {:ok :: label, params :: payload} | {:error :: label, :no_stream}
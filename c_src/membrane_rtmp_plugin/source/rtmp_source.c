@@ -1,6 +1,10 @@
 #include "rtmp_source.h"
+#include "avc.h"
+#include <libavutil/time.h>
 #include <stdbool.h>
 
+const AVRational MEMBRANE_TIME_BASE = (AVRational){1, 1000000000};
+
 void handle_init_state(State *);
 
 // A callback invoked periodically by 'avformat_open_input' to check
@@ -11,13 +15,23 @@ static int interrupt_callback(void *ctx) {
   return is_terminating;
 }
 
-UNIFEX_TERM create(UnifexEnv *env) {
+UNIFEX_TERM create(UnifexEnv *env, int annex_b, int fast_start,
+                   int64_t probe_size, int64_t analyze_duration,
+                   int fps_probe_size) {
   State *s = unifex_alloc_state(env);
   handle_init_state(s);
+  s->annex_b = annex_b;
+  s->fast_start = fast_start;
 
-  if (s->h264_bsf_ctx == NULL) {
-    unifex_release_state(env, s);
-    return unifex_raise(env, "Could not find filter h264_mp4toannexb");
+  // Negative values leave the FFmpeg defaults
+  if (probe_size >= 0) {
+    s->input_ctx->probesize = probe_size;
+  }
+  if (analyze_duration >= 0) {
+    s->input_ctx->max_analyze_duration = analyze_duration;
+  }
+  if (fps_probe_size >= 0) {
+    s->input_ctx->fps_probe_size = fps_probe_size;
   }
 
   s->input_ctx->interrupt_callback.callback = interrupt_callback;
@@ -25,14 +39,88 @@ UNIFEX_TERM create(UnifexEnv *env) {
   return create_result_ok(env, s);
 }
 
-UNIFEX_TERM await_open(UnifexEnv *env, State *s, char *url, int timeout) {
+static bool has_sequence_headers(State *s) {
+  bool has_audio = false, has_video = false;
+  for (unsigned int i = 0; i < s->input_ctx->nb_streams; i++) {
+    AVCodecParameters *codecpar = s->input_ctx->streams[i]->codecpar;
+    if (codecpar->extradata_size == 0) {
+      continue;
+    }
+    has_audio |= codecpar->codec_type == AVMEDIA_TYPE_AUDIO;
+    has_video |= codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+  }
+  return has_audio && has_video;
+}
+
+// Reads packets until both the AVC and AAC sequence headers are received,
+// which is when the FLV demuxer has set up both streams with their extradata.
+// If one of the streams doesn't show up within max_analyze_duration (or
+// 5 seconds, like in avformat_find_stream_info), only the streams received
+// so far are used. The packets read on the way are kept to be returned first.
+static int read_sequence_headers(State *s) {
+  int64_t max_duration = s->input_ctx->max_analyze_duration > 0
+                             ? s->input_ctx->max_analyze_duration
+                             : 5 * AV_TIME_BASE;
+  int64_t first_dts = AV_NOPTS_VALUE;
+  int capacity = 0;
+
+  while (!has_sequence_headers(s)) {
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+      return AVERROR(ENOMEM);
+    }
+    int av_err = av_read_frame(s->input_ctx, packet);
+    if (av_err < 0) {
+      av_packet_free(&packet);
+      // The stream might have ended before both the streams were received
+      return av_err == AVERROR_EOF && s->input_ctx->nb_streams > 0 ? 0 : av_err;
+    }
+
+    if (s->probed_packets_count == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      AVPacket **packets =
+          av_realloc_array(s->probed_packets, capacity, sizeof(AVPacket *));
+      if (!packets) {
+        av_packet_free(&packet);
+        return AVERROR(ENOMEM);
+      }
+      s->probed_packets = packets;
+    }
+    s->probed_packets[s->probed_packets_count++] = packet;
+
+    if (packet->dts == AV_NOPTS_VALUE) {
+      continue;
+    }
+    AVStream *stream = s->input_ctx->streams[packet->stream_index];
+    int64_t dts = av_rescale_q(packet->dts, stream->time_base, AV_TIME_BASE_Q);
+    if (first_dts == AV_NOPTS_VALUE) {
+      first_dts = dts;
+    } else if (dts - first_dts > max_duration) {
+      break;
+    }
+  }
+  return 0;
+}
+
+UNIFEX_TERM await_open(UnifexEnv *env, State *s, char *url, int timeout,
+                       char **option_names, unsigned int option_names_length,
+                       char **option_values,
+                       unsigned int option_values_length) {
+  UNIFEX_TERM ret;
+  if (option_names_length != option_values_length) {
+    ret = await_open_result_error(env, "Option lists lengths differ");
+    goto err;
+  }
+
   AVDictionary *d = NULL;
+  for (unsigned int i = 0; i < option_names_length; i++) {
+    av_dict_set(&d, option_names[i], option_values[i], 0);
+  }
   av_dict_set(&d, "listen", "1", 0);
   av_dict_set_int(&d, "timeout", timeout, 0);
 
-  UNIFEX_TERM ret;
-
   int av_err = avformat_open_input(&s->input_ctx, url, NULL, &d);
+  av_dict_free(&d);
   if (av_err == AVERROR(ETIMEDOUT)) {
     ret = await_open_result_error_timeout(env);
     goto err;
@@ -45,7 +133,16 @@ UNIFEX_TERM await_open(UnifexEnv *env, State *s, char *url, int timeout) {
     goto err;
   }
 
-  if (avformat_find_stream_info(s->input_ctx, NULL) < 0) {
+  if (s->fast_start) {
+    av_err = read_sequence_headers(s);
+    if (av_err == AVERROR_EXIT) {
+      ret = await_open_result_error_interrupted(env);
+      goto err;
+    } else if (av_err < 0) {
+      ret = await_open_result_error(env, "Couldn't get sequence headers");
+      goto err;
+    }
+  } else if (avformat_find_stream_info(s->input_ctx, NULL) < 0) {
     ret = await_open_result_error(env, "Couldn't get stream info");
     goto err;
   }
@@ -73,12 +170,11 @@ UNIFEX_TERM await_open(UnifexEnv *env, State *s, char *url, int timeout) {
       goto err;
     }
     if (in_codecpar->codec_id == AV_CODEC_ID_H264) {
-      s->h264_bsf_ctx->time_base_in = in_stream->time_base;
-      s->h264_bsf_ctx->par_in->codec_id = in_codecpar->codec_id;
+      s->nal_length_size = avc_nal_length_size(in_codecpar->extradata,
+                                               in_codecpar->extradata_size);
     }
   }
 
-  av_bsf_init(s->h264_bsf_ctx);
   ret = await_open_result_ok(env, s);
 err:
   unifex_release_state(env, s);
@@ -126,80 +222,322 @@ UNIFEX_TERM get_video_params(UnifexEnv *env, State *s) {
   return get_video_params_result_error(env);
 }
 
-int64_t get_pts(AVPacket *pkt, AVStream *stream) {
-  const AVRational target_time_base = {1, 1000};
-  return av_rescale_q_rnd(pkt->pts, stream->time_base, target_time_base,
+UNIFEX_TERM get_stats(UnifexEnv *env, State *s) {
+  SourceStats *stats = &s->stats;
+  return get_stats_result_ok(
+      env, stats->video_frames, stats->video_bytes, stats->audio_frames,
+      stats->audio_bytes, stats->read_time, stats->conversion_time,
+      stats->allocations, stats->last_video_dts, stats->last_audio_dts);
+}
+
+// Timestamps are returned in Membrane time units, so that they're exact
+// integers the element doesn't have to convert
+static int64_t get_pts(AVPacket *pkt, AVStream *stream) {
+  return av_rescale_q_rnd(pkt->pts, stream->time_base, MEMBRANE_TIME_BASE,
                           AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
 }
 
-int64_t get_dts(AVPacket *pkt, AVStream *stream) {
-  const AVRational target_time_base = {1, 1000};
-  return av_rescale_q_rnd(pkt->dts, stream->time_base, target_time_base,
+static int64_t get_dts(AVPacket *pkt, AVStream *stream) {
+  return av_rescale_q_rnd(pkt->dts, stream->time_base, MEMBRANE_TIME_BASE,
                           AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
 }
 
-UNIFEX_TERM read_frame(UnifexEnv *env, State *s) {
-  AVPacket packet;
-  AVStream *in_stream;
+// Converts length-prefixed NAL units of a video packet to Annex-B. With
+// 4-byte length prefixes, which is what encoders use in practice, the
+// conversion is done in place.
+static int convert_to_annex_b(State *s, AVPacket *packet) {
+  if (s->nal_length_size == 4) {
+    int av_err = av_packet_make_writable(packet);
+    if (av_err < 0) {
+      return av_err;
+    }
+    packet->size = avc_to_annex_b_in_place(packet->data, packet->size);
+    return 0;
+  }
+
+  s->stats.allocations++;
+  AVPacket *converted = av_packet_alloc();
+  int av_err = av_new_packet(converted, avc_annex_b_size(packet->data,
+                                                         packet->size,
+                                                         s->nal_length_size));
+  if (av_err < 0) {
+    av_packet_free(&converted);
+    return av_err;
+  }
+  av_packet_copy_props(converted, packet);
+  avc_to_annex_b(packet->data, packet->size, s->nal_length_size,
+                 converted->data);
+
+  av_packet_unref(packet);
+  av_packet_move_ref(packet, converted);
+  av_packet_free(&converted);
+  return 0;
+}
+
+// Reads the next audio or video packet, skipping packets of other media
+// types. Video packets are converted to Annex-B if requested.
+// Returns 0 on success, AVERROR_EOF when the stream has ended,
+// AVERROR_INVALIDDATA when the stream index is invalid and another negative
+// value when the conversion failed.
+static int read_packet(State *s, AVPacket *packet, AVStream **in_stream) {
   enum AVMediaType codec_type;
-  UNIFEX_TERM result;
 
   while (true) {
-    if (av_read_frame(s->input_ctx, &packet) < 0) {
-      result = read_frame_result_end_of_stream(env);
-      goto end;
+    if (s->next_probed_packet < s->probed_packets_count) {
+      av_packet_move_ref(packet, s->probed_packets[s->next_probed_packet]);
+      av_packet_free(&s->probed_packets[s->next_probed_packet++]);
+    } else {
+      int64_t read_start = av_gettime_relative();
+      int av_err = av_read_frame(s->input_ctx, packet);
+      s->stats.read_time += av_gettime_relative() - read_start;
+      if (av_err < 0) {
+        return AVERROR_EOF;
+      }
     }
 
-    if (packet.stream_index >= s->number_of_streams) {
-      result = read_frame_result_error(env, "Invalid stream index");
-      goto end;
+    if (packet->stream_index >= s->number_of_streams) {
+      av_packet_unref(packet);
+      // With fast start, a stream that showed up after the streams were set
+      // up has no caps to be sent with, so it's ignored
+      if (s->fast_start) {
+        continue;
+      }
+      return AVERROR_INVALIDDATA;
     }
 
-    in_stream = s->input_ctx->streams[packet.stream_index];
-    codec_type = in_stream->codecpar->codec_type;
+    *in_stream = s->input_ctx->streams[packet->stream_index];
+    codec_type = (*in_stream)->codecpar->codec_type;
 
-    if (codec_type != AVMEDIA_TYPE_AUDIO && codec_type != AVMEDIA_TYPE_VIDEO) {
-      av_packet_unref(&packet);
-    } else {
+    if (codec_type == AVMEDIA_TYPE_AUDIO || codec_type == AVMEDIA_TYPE_VIDEO) {
       break;
     }
+    av_packet_unref(packet);
   }
 
-  UNIFEX_TERM(*result_func)
-  (UnifexEnv *, int64_t, int64_t, UnifexPayload *) = NULL;
+  if (codec_type == AVMEDIA_TYPE_VIDEO && s->annex_b &&
+      s->nal_length_size > 0) {
+    int64_t conversion_start = av_gettime_relative();
+    int av_err = convert_to_annex_b(s, packet);
+    s->stats.conversion_time += av_gettime_relative() - conversion_start;
+    if (av_err < 0) {
+      av_packet_unref(packet);
+      return av_err;
+    }
+  }
+  return 0;
+}
+
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_PREVIOUS_TAG_SIZE_SIZE 4
+
+// Checks whether the next packet can be demuxed from the data that has
+// already been received, so that reading it won't block waiting for the
+// client. The FLV demuxer consumes whole tags, including the following
+// previous tag size, so after a packet the buffer starts at a tag header and
+// the tag is complete once its header, data and previous tag size are all
+// buffered.
+static bool has_buffered_data(State *s) {
+  if (s->next_probed_packet < s->probed_packets_count) {
+    return true;
+  }
+  AVIOContext *pb = s->input_ctx->pb;
+  if (!pb || pb->buf_end - pb->buf_ptr < FLV_TAG_HEADER_SIZE) {
+    return false;
+  }
+  const uint8_t *header = pb->buf_ptr;
+  int64_t data_size = (header[1] << 16) | (header[2] << 8) | header[3];
+  return pb->buf_end - pb->buf_ptr >=
+         FLV_TAG_HEADER_SIZE + data_size + FLV_PREVIOUS_TAG_SIZE_SIZE;
+}
+
+// Frames are handed to Erlang as resource binaries pointing directly at the
+// packet data, so that no copy is made. The packet reference is dropped when
+// the binary is garbage collected.
+typedef struct PacketResource {
+  AVPacket *packet;
+} PacketResource;
+
+static ErlNifResourceType *packet_resource_type;
+
+static void destroy_packet_resource(ErlNifEnv *env, void *obj) {
+  UNIFEX_UNUSED(env);
+  PacketResource *resource = (PacketResource *)obj;
+  av_packet_free(&resource->packet);
+}
+
+int handle_load(UnifexEnv *env, void **priv_data) {
+  UNIFEX_UNUSED(priv_data);
+  packet_resource_type =
+      enif_open_resource_type(env, NULL, "RTMPSourcePacket",
+                              destroy_packet_resource, ERL_NIF_RT_CREATE, NULL);
+  return packet_resource_type == NULL;
+}
+
+// Takes over the reference to the packet data and returns a binary term
+// backed by it. The packet is left blank.
+static UNIFEX_TERM make_packet_binary(UnifexEnv *env, AVPacket *packet) {
+  PacketResource *resource =
+      enif_alloc_resource(packet_resource_type, sizeof(PacketResource));
+  resource->packet = av_packet_alloc();
+  av_packet_move_ref(resource->packet, packet);
+
+  UNIFEX_TERM binary = enif_make_resource_binary(
+      env, resource, resource->packet->data, resource->packet->size);
+  enif_release_resource(resource);
+  return binary;
+}
+
+typedef struct FrameList {
+  UNIFEX_TERM *pts;
+  UNIFEX_TERM *dts;
+  UNIFEX_TERM *frames;
+  UNIFEX_TERM *receive_times;
+  unsigned int length;
+} FrameList;
+
+static void frame_list_free(FrameList *list) {
+  UNIFEX_TERM **arrays[] = {&list->pts, &list->dts, &list->frames,
+                            &list->receive_times};
+  for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++) {
+    if (*arrays[i]) {
+      unifex_free(*arrays[i]);
+      *arrays[i] = NULL;
+    }
+  }
+}
+
+// Returns -1 if the list couldn't be allocated, leaving it empty
+static int frame_list_init(FrameList *list, int capacity) {
+  list->pts = unifex_alloc(capacity * sizeof(*list->pts));
+  list->dts = unifex_alloc(capacity * sizeof(*list->dts));
+  list->frames = unifex_alloc(capacity * sizeof(*list->frames));
+  list->receive_times = unifex_alloc(capacity * sizeof(*list->receive_times));
+  list->length = 0;
+  if (!list->pts || !list->dts || !list->frames || !list->receive_times) {
+    frame_list_free(list);
+    return -1;
+  }
+  return 0;
+}
 
-  switch (codec_type) {
-  case AVMEDIA_TYPE_VIDEO:
-    av_bsf_send_packet(s->h264_bsf_ctx, &packet);
-    av_bsf_receive_packet(s->h264_bsf_ctx, &packet);
-    result_func = &read_frame_result_video;
-    break;
+static int frame_list_append(UnifexEnv *env, FrameList *list,
+                             AVPacket *packet, AVStream *stream,
+                             int64_t receive_time) {
+  int av_err = av_packet_make_refcounted(packet);
+  if (av_err < 0) {
+    return av_err;
+  }
+
+  unsigned int i = list->length++;
+  list->pts[i] = enif_make_int64(env, get_pts(packet, stream));
+  list->dts[i] = enif_make_int64(env, get_dts(packet, stream));
+  list->frames[i] = make_packet_binary(env, packet);
+  list->receive_times[i] = enif_make_int64(env, receive_time);
+  return 0;
+}
+
+// Builds the `{:ok, video_pts, video_dts, video_frames, video_receive_times,
+// audio_pts, audio_dts, audio_frames, audio_receive_times}` result by hand, as
+// unifex payloads can't wrap resource binaries.
+static UNIFEX_TERM make_read_frames_result_ok(UnifexEnv *env, FrameList *video,
+                                             FrameList *audio) {
+  return enif_make_tuple(
+      env, 9, enif_make_atom(env, "ok"),
+      enif_make_list_from_array(env, video->pts, video->length),
+      enif_make_list_from_array(env, video->dts, video->length),
+      enif_make_list_from_array(env, video->frames, video->length),
+      enif_make_list_from_array(env, video->receive_times, video->length),
+      enif_make_list_from_array(env, audio->pts, audio->length),
+      enif_make_list_from_array(env, audio->dts, audio->length),
+      enif_make_list_from_array(env, audio->frames, audio->length),
+      enif_make_list_from_array(env, audio->receive_times, audio->length));
+}
+
+UNIFEX_TERM read_frames(UnifexEnv *env, State *s, int max_frames,
+                        int max_bytes) {
+  if (max_frames < 1) {
+    return unifex_raise(env, "max_frames must be a positive integer");
+  }
+
+  AVPacket packet;
+  AVStream *in_stream;
+  FrameList video, audio;
+  UNIFEX_TERM result;
+  int frames_read = 0;
+  int bytes_read = 0;
 
-  case AVMEDIA_TYPE_AUDIO:
-    result_func = &read_frame_result_audio;
-    break;
+  if (frame_list_init(&video, max_frames) < 0) {
+    return read_frames_result_error(env, "Out of memory");
+  }
+  if (frame_list_init(&audio, max_frames) < 0) {
+    frame_list_free(&video);
+    return read_frames_result_error(env, "Out of memory");
+  }
+
+  // The first read blocks until a frame arrives. The following ones only
+  // drain what has already been received, so that a batch never waits for
+  // the client.
+  do {
+    int av_err = read_packet(s, &packet, &in_stream);
+    if (av_err == AVERROR_EOF) {
+      break;
+    } else if (av_err == AVERROR_INVALIDDATA) {
+      result = read_frames_result_error(env, "Invalid stream index");
+      goto end;
+    } else if (av_err < 0) {
+      result = read_frames_result_error(env, av_err2str(av_err));
+      goto end;
+    }
+    // Comparable with `System.monotonic_time(:microsecond)`, so that the
+    // latency of the frame can be traced in the pipeline
+    int64_t receive_time = enif_monotonic_time(ERL_NIF_USEC);
+
+    bool is_video = in_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    FrameList *list = is_video ? &video : &audio;
+    frames_read++;
+    bytes_read += packet.size;
+    // the packet and the resource wrapping it
+    s->stats.allocations += 2;
+    if (is_video) {
+      s->stats.video_frames++;
+      s->stats.video_bytes += packet.size;
+      s->stats.last_video_dts = get_dts(&packet, in_stream);
+    } else {
+      s->stats.audio_frames++;
+      s->stats.audio_bytes += packet.size;
+      s->stats.last_audio_dts = get_dts(&packet, in_stream);
+    }
+    if (frame_list_append(env, list, &packet, in_stream, receive_time) < 0) {
+      av_packet_unref(&packet);
+      result = unifex_raise(env, "Failed to reference packet data");
+      goto end;
+    }
+  } while (frames_read < max_frames && bytes_read < max_bytes &&
+           has_buffered_data(s));
 
-  default:
-    return unifex_raise(env, "Unsupported frame type");
+  if (frames_read == 0) {
+    result = read_frames_result_end_of_stream(env);
+    goto end;
   }
 
-  UnifexPayload payload;
-  unifex_payload_alloc(env, UNIFEX_PAYLOAD_BINARY, packet.size, &payload);
-  memcpy(payload.data, packet.data, packet.size);
-  result = result_func(env, get_pts(&packet, in_stream),
-                       get_dts(&packet, in_stream), &payload);
-  unifex_payload_release(&payload);
+  result = make_read_frames_result_ok(env, &video, &audio);
 
 end:
-  av_packet_unref(&packet);
+  frame_list_free(&video);
+  frame_list_free(&audio);
   return result;
 }
 
 void handle_init_state(State *s) {
   s->input_ctx = avformat_alloc_context();
   s->terminating = false;
-  const AVBitStreamFilter *h264_filter = av_bsf_get_by_name("h264_mp4toannexb");
-  av_bsf_alloc(h264_filter, &s->h264_bsf_ctx);
+  s->annex_b = true;
+  s->nal_length_size = 0;
+  s->fast_start = false;
+  s->probed_packets = NULL;
+  s->probed_packets_count = 0;
+  s->next_probed_packet = 0;
+  memset(&s->stats, 0, sizeof(s->stats));
 }
 
 void handle_destroy_state(UnifexEnv *env, State *s) {
@@ -207,9 +545,10 @@ void handle_destroy_state(UnifexEnv *env, State *s) {
 
   s->terminating = true;
 
-  if (s->h264_bsf_ctx) {
-    av_bsf_free(&s->h264_bsf_ctx);
+  for (int i = s->next_probed_packet; i < s->probed_packets_count; i++) {
+    av_packet_free(&s->probed_packets[i]);
   }
+  av_freep(&s->probed_packets);
 
   if (s->input_ctx) {
     avformat_close_input(&s->input_ctx);
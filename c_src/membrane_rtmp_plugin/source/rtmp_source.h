@@ -1,24 +1,52 @@
 #pragma once
 
-#include <libavcodec/version.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 #include <stdbool.h>
 #include <unifex/unifex.h>
 
-#if LIBAVCODEC_VERSION_MAJOR >= 59
-// In FFmpeg 5.0 (libavcodec 59) AVBSFContext was moved to a separate header
-#include <libavcodec/bsf.h>
-#endif
-
 typedef struct State State;
 
+// Counters reported by get_stats. They are read without synchronization
+// while the frames are being read, so they may be slightly out of date.
+typedef struct SourceStats {
+  uint64_t video_frames;
+  uint64_t video_bytes;
+  uint64_t audio_frames;
+  uint64_t audio_bytes;
+  // Time spent in av_read_frame, including waiting for the client, in
+  // microseconds
+  int64_t read_time;
+  // Time spent converting the video frames to Annex-B, in microseconds
+  int64_t conversion_time;
+  // Frame buffers and packets allocated
+  uint64_t allocations;
+  // In Membrane time units
+  int64_t last_video_dts;
+  int64_t last_audio_dts;
+} SourceStats;
+
 struct State {
   AVFormatContext *input_ctx;
   int number_of_streams;
   bool terminating;
 
-  AVBSFContext *h264_bsf_ctx;
+  // Whether the video frames should be converted to Annex-B
+  bool annex_b;
+  // Length of the NAL unit size prefix in the video frames received from the
+  // client, 0 if they are already in Annex-B format
+  int nal_length_size;
+
+  // Whether the streams should be set up straight from the sequence headers,
+  // instead of probing them with avformat_find_stream_info
+  bool fast_start;
+  // Packets read while waiting for the sequence headers, that are returned
+  // before reading further
+  AVPacket **probed_packets;
+  int probed_packets_count;
+  int next_probed_packet;
+
+  SourceStats stats;
 };
 
 #include "_generated/rtmp_source.h"
@@ -3,9 +3,24 @@ module Membrane.RTMP.Source.Native
 state_type "State"
 interface [NIF]
 
-spec create() :: {:ok :: label, state}
+callback :load
 
-spec await_open(state, url :: string, timeout :: int) ::
+spec create(
+       annex_b :: bool,
+       fast_start :: bool,
+       probe_size :: int64,
+       analyze_duration :: int64,
+       fps_probe_size :: int
+     ) :: {:ok :: label, state}
+
+# The options are passed to FFmpeg along with the ones making it listen on the URL
+spec await_open(
+       state,
+       url :: string,
+       timeout :: int,
+       option_names :: [string],
+       option_values :: [string]
+     ) ::
        {:ok :: label, state}
        | {:error :: label, :timeout :: label}
        | {:error :: label, :interrupted :: label}
@@ -16,10 +31,18 @@ spec get_audio_params(state) :: {:ok :: label, params :: payload} | {:error :: l
 
 spec set_terminate(state) :: :ok :: label
 
-spec read_frame(state) ::
-       {:ok, :audio :: label, pts :: int64, dts :: int64, frame :: payload}
-       | {:ok, :video :: label, pts :: int64, dts :: int64, frame :: payload}
+# Timestamps are in Membrane time units, receive times are monotonic times in microseconds
+spec read_frames(state, max_frames :: int, max_bytes :: int) ::
+       {:ok :: label, video_pts :: [int64], video_dts :: [int64], video_frames :: [payload],
+        video_receive_times :: [int64], audio_pts :: [int64], audio_dts :: [int64],
+        audio_frames :: [payload], audio_receive_times :: [int64]}
        | {:error :: label, reason :: string}
        | (:end_of_stream :: label)
 
-dirty :io, await_open: 3, read_frame: 1
+# Times are in microseconds, timestamps in Membrane time units
+spec get_stats(state) ::
+       {:ok :: label, video_frames :: uint64, video_bytes :: uint64, audio_frames :: uint64,
+        audio_bytes :: uint64, read_time :: int64, conversion_time :: int64,
+        allocations :: uint64, last_video_dts :: int64, last_audio_dts :: int64}
+
+dirty :io, await_open: 5, read_frames: 3
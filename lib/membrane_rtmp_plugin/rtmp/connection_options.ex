@@ -0,0 +1,81 @@
+defmodule Membrane.RTMP.ConnectionOptions do
+  @moduledoc false
+  # Options of the RTMP connections, shared by the source and the sink. They're passed
+  # to FFmpeg as protocol options, to the native publisher and to the listener's sockets.
+
+  alias Membrane.Time
+
+  @type t :: [
+          send_buffer_size: pos_integer(),
+          recv_buffer_size: pos_integer(),
+          tcp_nodelay: boolean(),
+          rtmp_buffer: Time.t(),
+          rtmp_live: :any | :live | :recorded,
+          tls_verify: boolean(),
+          kernel_tls: boolean()
+        ]
+
+  # Description of the options for the elements' `def_options`
+  @spec description() :: String.t()
+  def description() do
+    """
+    Options of the connections:
+      - `send_buffer_size` - size of the socket send buffer in bytes
+      - `recv_buffer_size` - size of the socket receive buffer in bytes
+      - `tcp_nodelay` - whether Nagle's algorithm is disabled
+      - `rtmp_buffer` - client buffer time announced to the server (FFmpeg's `rtmp_buffer`)
+      - `rtmp_live` - type of the stream: `:any`, `:live` or `:recorded` (FFmpeg's `rtmp_live`)
+      - `tls_verify` - whether the certificate of an rtmps:// server is verified against
+        the system's trusted certificates (FFmpeg's `tls_verify`)
+      - `kernel_tls` - whether the encryption of rtmps:// streams is offloaded to the kernel
+        (kTLS), where the kernel and OpenSSL support it for the negotiated cipher
+
+    The buffer sizes default to the system ones, which may limit the throughput on links with
+    a high round-trip time. The `rtmp_` options apply only to the connections made by FFmpeg,
+    `kernel_tls` only to the native client. `tls_verify` defaults to true with the native
+    client and to false with FFmpeg.
+    """
+  end
+
+  @spec validate!(Keyword.t()) :: t()
+  def validate!(options) do
+    case Enum.reject(options, &valid?/1) do
+      [] -> options
+      [option | _rest] -> raise ArgumentError, "Invalid connection option: #{inspect(option)}"
+    end
+  end
+
+  defp valid?({key, size}) when key in [:send_buffer_size, :recv_buffer_size],
+    do: is_integer(size) and size > 0
+
+  defp valid?({key, enabled?}) when key in [:tcp_nodelay, :tls_verify, :kernel_tls],
+    do: is_boolean(enabled?)
+
+  defp valid?({:rtmp_buffer, duration}), do: is_integer(duration) and duration >= 0
+  defp valid?({:rtmp_live, type}), do: type in [:any, :live, :recorded]
+  defp valid?(_option), do: false
+
+  # Names and values of FFmpeg's protocol options
+  @spec to_ffmpeg(t()) :: {[String.t()], [String.t()]}
+  def to_ffmpeg(options) do
+    options
+    |> Enum.map(fn
+      {key, enabled?} when is_boolean(enabled?) ->
+        {Atom.to_string(key), if(enabled?, do: "1", else: "0")}
+
+      {:rtmp_buffer, duration} -> {"rtmp_buffer", to_string(div(duration, Time.millisecond()))}
+      {key, value} -> {Atom.to_string(key), to_string(value)}
+    end)
+    |> Enum.unzip()
+  end
+
+  @spec to_gen_tcp(t()) :: [:gen_tcp.option()]
+  def to_gen_tcp(options) do
+    Enum.flat_map(options, fn
+      {:send_buffer_size, size} -> [sndbuf: size]
+      {:recv_buffer_size, size} -> [recbuf: size]
+      {:tcp_nodelay, enabled?} -> [nodelay: enabled?]
+      _other_option -> []
+    end)
+  end
+end
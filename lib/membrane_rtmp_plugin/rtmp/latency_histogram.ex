@@ -0,0 +1,47 @@
+defmodule Membrane.RTMP.LatencyHistogram do
+  @moduledoc false
+  # Histogram of frame latencies. The buckets are consecutive powers of two milliseconds:
+  # the first one counts the latencies below 1 ms and the last one those of 2^14 ms or more.
+  # The sink keeps the same buckets natively (`LATENCY_BUCKETS` in `sink/destination.h`).
+
+  alias Membrane.Time
+
+  @buckets 16
+
+  @opaque t :: tuple()
+
+  @spec new() :: t()
+  def new(), do: Tuple.duplicate(0, @buckets)
+
+  @spec buckets() :: pos_integer()
+  def buckets(), do: @buckets
+
+  @spec record(t(), Time.t()) :: t()
+  def record(histogram, latency) do
+    bucket = bucket(div(latency, Time.millisecond()))
+    put_elem(histogram, bucket, elem(histogram, bucket) + 1)
+  end
+
+  # Measurements of the latency telemetry events, with the histogram given as a list
+  # of `{upper_bound, count}` tuples
+  @spec to_measurements(t() | [non_neg_integer()]) :: %{
+          count: non_neg_integer(),
+          histogram: [{Time.t() | :infinity, non_neg_integer()}]
+        }
+  def to_measurements(histogram) when is_tuple(histogram) do
+    histogram |> Tuple.to_list() |> to_measurements()
+  end
+
+  def to_measurements(counts) when length(counts) == @buckets do
+    bounds = Enum.map(0..(@buckets - 2), &Time.milliseconds(Integer.pow(2, &1))) ++ [:infinity]
+    %{count: Enum.sum(counts), histogram: Enum.zip(bounds, counts)}
+  end
+
+  defp bucket(milliseconds) when milliseconds < 1, do: 0
+
+  # 2^(n - 1) <= milliseconds < 2^n falls into the n-th bucket
+  defp bucket(milliseconds) do
+    bits = milliseconds |> Integer.digits(2) |> length()
+    min(bits, @buckets - 1)
+  end
+end
@@ -0,0 +1,160 @@
+defmodule Membrane.RTMP.Listener do
+  @moduledoc """
+  RTMP server accepting many concurrent publishers on a single port.
+
+  Every published stream is announced to the handler process with a message
+  `{Membrane.RTMP.Listener, :publish, %{app: app, stream_key: stream_key, session: session}}`.
+  The `session` can then be passed to `Membrane.RTMP.Source` or `Membrane.RTMP.SourceBin`,
+  which will receive the stream. Until that happens, the stream is not read from the socket.
+
+  Each session is served by its own process, reading from the socket only when there is
+  demand for frames, so that idle or slow publishers don't block any schedulers.
+
+  Many sources can receive the stream from a single session, at the pace of the slowest
+  of them. With `gop_cache: true`, the session keeps the frames since the last keyframe,
+  so that the sources attached to a running stream receive them first and their decoders
+  don't have to wait for the next keyframe. The cache is dropped until the next keyframe once
+  the kept frames would exceed its limits, or those of the session's memory.
+
+  With the `tls` option, the listener accepts RTMPS connections. The TLS handshake is done by
+  each session's process, so that slow clients don't hold back accepting the others. Unless
+  configured otherwise, the listener issues stateless session tickets, with which the clients
+  resume their sessions on reconnection without the listener having to keep them.
+
+  The buffers in which a session reassembles the messages of its client, together with its
+  GOP cache, are limited to `max_session_memory` bytes. Those of all the sessions of the node
+  are limited to `memory_budget` bytes, so that a spike of publishers can't exhaust the node's memory.
+  A session that would exceed either of the limits fails. The memory is reported by
+  `total_memory/0` and `Membrane.RTMP.Listener.Session.memory/1`.
+  """
+  use GenServer
+
+  require Logger
+
+  alias __MODULE__.{Native, Session}
+
+  @type option_t ::
+          {:port, :inet.port_number()}
+          | {:local_ip, String.t()}
+          | {:handler, pid()}
+          | {:gop_cache, boolean() | Keyword.t()}
+          | {:socket_options, [:gen_tcp.option()]}
+          | {:tls, [:ssl.tls_server_option()] | nil}
+          | {:max_session_memory, pos_integer() | nil}
+          | {:memory_budget, pos_integer() | nil}
+
+  @doc """
+  Starts the listener linked to the calling process.
+
+  Options:
+    - `port` - port on which the server will listen, a random one is chosen by default
+    - `local_ip` - IP address or host name on which the server will listen, `"127.0.0.1"` by default
+    - `handler` - process notified about published streams, the calling process by default
+    - `gop_cache` - whether the sessions keep the frames since the last keyframe for the sources
+      attached later, `false` by default. Given a keyword list, the cache is enabled with
+      the following limits:
+        - `max_bytes` - maximal size of the kept frames, 8 MiB by default
+        - `max_duration` - maximal span of the kept frames, 10 seconds by default
+    - `socket_options` - additional options of the sockets, such as `recbuf` or `nodelay`,
+      inherited by the accepted connections
+    - `tls` - options of the TLS server, such as `certfile` and `keyfile`, RTMPS is not used
+      if not set
+    - `max_session_memory` - maximal number of bytes of the buffers and the GOP cache of
+      a single session, unbounded by default
+    - `memory_budget` - maximal number of bytes of the buffers of all the sessions of the node,
+      unbounded by default. When the listeners of a node are given different budgets, each
+      session is held to the budget of its own listener.
+  """
+  @spec start_link([option_t]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    opts = Keyword.put_new(opts, :handler, self())
+    GenServer.start_link(__MODULE__, opts)
+  end
+
+  @doc """
+  Returns the port on which the listener accepts connections.
+  """
+  @spec port(GenServer.server()) :: :inet.port_number()
+  def port(listener) do
+    GenServer.call(listener, :port)
+  end
+
+  @doc """
+  Returns the number of bytes of the buffers held by all the sessions of the node.
+  """
+  @spec total_memory() :: non_neg_integer()
+  def total_memory() do
+    {:ok, memory} = Native.get_total_memory()
+    memory
+  end
+
+  @impl true
+  def init(opts) do
+    {:ok, ip} =
+      opts
+      |> Keyword.get(:local_ip, "127.0.0.1")
+      |> to_charlist()
+      |> :inet.getaddr(:inet)
+
+    socket_opts =
+      Keyword.get(opts, :socket_options, []) ++
+        [:binary, packet: :raw, active: false, reuseaddr: true, ip: ip]
+
+    {transport, result} = listen(Keyword.get(opts, :port, 0), socket_opts, opts[:tls])
+
+    case result do
+      {:ok, socket} ->
+        handler = Keyword.fetch!(opts, :handler)
+
+        session_opts =
+          [transport: transport] ++
+            Keyword.take(opts, [:gop_cache, :max_session_memory, :memory_budget])
+
+        acceptor = spawn_link(fn -> accept_loop(socket, transport, handler, session_opts) end)
+        {:ok, %{socket: socket, transport: transport, acceptor: acceptor}}
+
+      {:error, reason} ->
+        {:stop, reason}
+    end
+  end
+
+  @impl true
+  def handle_call(:port, _from, %{transport: :ssl} = state) do
+    {:ok, {_ip, port}} = :ssl.sockname(state.socket)
+    {:reply, port, state}
+  end
+
+  @impl true
+  def handle_call(:port, _from, state) do
+    {:ok, port} = :inet.port(state.socket)
+    {:reply, port, state}
+  end
+
+  defp listen(port, socket_opts, nil), do: {:gen_tcp, :gen_tcp.listen(port, socket_opts)}
+
+  defp listen(port, socket_opts, tls_opts) do
+    tls_opts = Keyword.put_new(tls_opts, :session_tickets, :stateless)
+    {:ssl, :ssl.listen(port, socket_opts ++ tls_opts)}
+  end
+
+  # The TLS handshake is left to the session
+  defp accept(:ssl, socket), do: :ssl.transport_accept(socket)
+  defp accept(:gen_tcp, socket), do: :gen_tcp.accept(socket)
+
+  defp accept_loop(socket, transport, handler, session_opts) do
+    case accept(transport, socket) do
+      {:ok, client} ->
+        {:ok, session} = Session.start(client, handler, session_opts)
+        :ok = transport.controlling_process(client, session)
+        Session.activate(session)
+        accept_loop(socket, transport, handler, session_opts)
+
+      {:error, :closed} ->
+        :ok
+
+      {:error, reason} ->
+        Logger.warn("Failed to accept RTMP connection: #{inspect(reason)}")
+        accept_loop(socket, transport, handler, session_opts)
+    end
+  end
+end
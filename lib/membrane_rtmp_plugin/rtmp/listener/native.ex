@@ -0,0 +1,4 @@
+defmodule Membrane.RTMP.Listener.Native do
+  @moduledoc false
+  use Unifex.Loader
+end
@@ -0,0 +1,468 @@
+defmodule Membrane.RTMP.Listener.Session do
+  @moduledoc false
+  # Process serving a single RTMP connection accepted by `Membrane.RTMP.Listener`.
+  #
+  # Once the stream is published and a consumer is attached, it serves frames with the same
+  # protocol as `Membrane.RTMP.Source.Native`: it replies to each `{:get_frames, consumer}`
+  # message with a single batch of frames, so the socket is read only when there's demand.
+  #
+  # Many consumers can be attached to a single session. Each of them receives all the frames,
+  # and the socket is read only once all of them are waiting for the next batch, so the stream
+  # is received at the pace of the slowest one. With the GOP cache enabled, the batches since
+  # the last keyframe are kept, so that the consumers attaching to a running stream receive
+  # them first and can start decoding right away. The frames are binaries shared by all
+  # the consumers and the cache, so they aren't copied for each of them.
+  #
+  # The cache is bounded by the duration and the size of the kept frames, which are charged
+  # to the session's memory. Once it would exceed any of the limits, it's dropped until
+  # the next keyframe.
+  #
+  # With the `:ssl` transport, the socket is accepted before the TLS handshake, which is done
+  # once the session is activated.
+  use GenServer
+
+  require Logger
+
+  alias Membrane.RTMP.Listener
+  alias Membrane.RTMP.Listener.Native
+  alias Membrane.RTMP.Source
+
+  @tls_handshake_timeout 10_000
+  @default_gop_cache [max_bytes: 8 * 1024 * 1024, max_duration: Membrane.Time.seconds(10)]
+
+  @spec start(:gen_tcp.socket() | :ssl.sslsocket(), pid(), Keyword.t()) :: GenServer.on_start()
+  def start(socket, handler, opts \\ []) do
+    GenServer.start(__MODULE__, {socket, handler, opts})
+  end
+
+  @spec activate(pid()) :: :ok
+  def activate(session) do
+    send(session, :activate)
+    :ok
+  end
+
+  @doc """
+  Makes the calling process a consumer of the published stream.
+
+  All the consumers have to use the same `video_payload_format`.
+  """
+  @spec attach(pid(), Keyword.t()) :: :ok | {:error, :video_payload_format_mismatch}
+  def attach(session, opts) do
+    GenServer.call(session, {:attach, self(), opts})
+  end
+
+  @doc """
+  Returns the number of bytes held by the session: those of the `buffers` in which
+  the messages are reassembled, limited by the listener's `max_session_memory`,
+  and those of the frames kept in the `gop_cache`.
+  """
+  @spec memory(pid()) :: %{buffers: non_neg_integer(), gop_cache: non_neg_integer()}
+  def memory(session) do
+    GenServer.call(session, :memory)
+  end
+
+  @doc """
+  Returns whether the client resumed a previous TLS session instead of doing a full handshake,
+  `false` for the connections without TLS.
+  """
+  @spec tls_session_resumed?(pid()) :: boolean()
+  def tls_session_resumed?(session) do
+    GenServer.call(session, :tls_session_resumed?)
+  end
+
+  @doc """
+  Stops sending the stream to the calling process. The session terminates once
+  the last consumer detaches.
+  """
+  @spec detach(pid()) :: :ok
+  def detach(session) do
+    GenServer.cast(session, {:detach, self()})
+  end
+
+  @impl true
+  def init({socket, handler, opts}) do
+    # Limits of 0 leave the memory unbounded
+    {:ok, native} =
+      Native.create(
+        Keyword.get(opts, :max_session_memory) || 0,
+        Keyword.get(opts, :memory_budget) || 0
+      )
+
+    transport = Keyword.get(opts, :transport, :gen_tcp)
+
+    {:ok,
+     %{
+       socket: socket,
+       transport: transport,
+       handler: handler,
+       native: native,
+       status: if(transport == :ssl, do: :tls_handshake, else: :handshake),
+       annex_b?: nil,
+       consumers: %{},
+       # Batches since the last keyframe, most recent first, or nil if the cache is disabled
+       # or there hasn't been any keyframe since it was dropped
+       gop: nil,
+       gop_bytes: 0,
+       gop_start_dts: nil,
+       gop_cache: gop_cache_limits(Keyword.get(opts, :gop_cache, false)),
+       closed?: false
+     }}
+  end
+
+  @impl true
+  def handle_call(:memory, _from, state) do
+    # The cached frames are charged to the native memory too
+    {:ok, memory} = Native.get_memory(state.native)
+    {:reply, %{buffers: memory - state.gop_bytes, gop_cache: state.gop_bytes}, state}
+  end
+
+  @impl true
+  def handle_call(:tls_session_resumed?, _from, %{transport: :ssl} = state) do
+    resumed? =
+      case :ssl.connection_information(state.socket, [:session_resumption]) do
+        {:ok, [session_resumption: resumed?]} -> resumed?
+        _other -> false
+      end
+
+    {:reply, resumed?, state}
+  end
+
+  @impl true
+  def handle_call(:tls_session_resumed?, _from, state) do
+    {:reply, false, state}
+  end
+
+  @impl true
+  def handle_call({:attach, consumer, opts}, _from, state) do
+    annex_b? = Keyword.get(opts, :video_payload_format, :annexb) == :annexb
+
+    cond do
+      state.annex_b? == nil ->
+        :ok = Native.set_annex_b(state.native, annex_b?)
+        state = %{state | annex_b?: annex_b?} |> add_consumer(consumer)
+        # The consumer expects the first batch of frames without asking for it.
+        # Parse whatever has been received after the publish command.
+        {:reply, :ok, state, {:continue, {:data, <<>>}}}
+
+      state.annex_b? == annex_b? ->
+        state = state |> add_consumer(consumer) |> serve(consumer)
+        {:reply, :ok, maybe_end_stream(state)}
+
+      true ->
+        {:reply, {:error, :video_payload_format_mismatch}, state}
+    end
+  end
+
+  @impl true
+  def handle_cast({:detach, consumer}, state) do
+    remove_consumer(consumer, state)
+  end
+
+  @impl true
+  def handle_continue({:data, data}, state) do
+    handle_data(data, state)
+  end
+
+  @impl true
+  def handle_info(:activate, %{status: :tls_handshake} = state) do
+    case :ssl.handshake(state.socket, @tls_handshake_timeout) do
+      {:ok, socket} ->
+        {:noreply, maybe_activate(%{state | socket: socket, status: :handshake})}
+
+      {:error, reason} ->
+        Logger.debug("RTMPS handshake failed: #{inspect(reason)}")
+        {:stop, :normal, state}
+    end
+  end
+
+  @impl true
+  def handle_info(:activate, state) do
+    {:noreply, maybe_activate(state)}
+  end
+
+  @impl true
+  def handle_info({transport, _socket, data}, state) when transport in [:tcp, :ssl] do
+    handle_data(data, state)
+  end
+
+  @impl true
+  def handle_info({closed, _socket}, %{consumers: consumers} = state)
+      when closed in [:tcp_closed, :ssl_closed] and consumers == %{} do
+    {:stop, :normal, state}
+  end
+
+  @impl true
+  def handle_info({closed, _socket}, state) when closed in [:tcp_closed, :ssl_closed] do
+    state = %{state | closed?: true}
+    {:noreply, maybe_end_stream(state)}
+  end
+
+  @impl true
+  def handle_info({:get_frames, consumer}, %{consumers: consumers} = state)
+      when is_map_key(consumers, consumer) do
+    state =
+      state
+      |> update_consumer(consumer, &%{&1 | demand?: true})
+      |> serve(consumer)
+
+    {:noreply, state |> maybe_end_stream() |> maybe_activate()}
+  end
+
+  @impl true
+  def handle_info({:get_frames, _consumer}, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:DOWN, _ref, :process, consumer, _reason}, state) do
+    remove_consumer(consumer, state)
+  end
+
+  defp add_consumer(state, consumer) do
+    monitor = Process.monitor(consumer)
+    pending = if state.gop, do: :queue.from_list(Enum.reverse(state.gop)), else: :queue.new()
+
+    consumer_state = %{
+      monitor: monitor,
+      demand?: true,
+      pending: pending,
+      format_info_sent?: false,
+      ended?: false
+    }
+
+    put_in(state, [:consumers, consumer], consumer_state)
+  end
+
+  defp remove_consumer(consumer, state) do
+    case Map.pop(state.consumers, consumer) do
+      {nil, _consumers} ->
+        {:noreply, state}
+
+      {%{monitor: monitor}, consumers} when consumers == %{} ->
+        Process.demonitor(monitor, [:flush])
+        {:stop, :normal, %{state | consumers: consumers}}
+
+      {%{monitor: monitor}, consumers} ->
+        Process.demonitor(monitor, [:flush])
+        # The consumer might have been the only one holding back reading the socket
+        {:noreply, maybe_activate(%{state | consumers: consumers})}
+    end
+  end
+
+  defp update_consumer(state, consumer, fun) do
+    update_in(state, [:consumers, consumer], fun)
+  end
+
+  defp handle_data(data, state) do
+    case Native.feed(state.native, data) do
+      {:ok, status, response, video_pts, video_dts, video_frames, audio_pts, audio_dts,
+       audio_frames, keyframe_index} ->
+        if response != <<>>, do: state.transport.send(state.socket, response)
+
+        # All the frames are stamped with the time the data completing them was received
+        receive_time = System.monotonic_time(:microsecond)
+        video_receive_times = List.duplicate(receive_time, length(video_frames))
+        audio_receive_times = List.duplicate(receive_time, length(audio_frames))
+
+        batch =
+          {:ok, video_pts, video_dts, video_frames, video_receive_times, audio_pts, audio_dts,
+           audio_frames, audio_receive_times}
+
+        state =
+          state
+          |> handle_status(status)
+          |> cache_batch(batch, keyframe_index)
+          |> handle_frames(batch)
+          |> maybe_end_stream()
+          |> maybe_activate()
+
+        {:noreply, state}
+
+      {:error, reason} ->
+        Logger.error("RTMP session failed: #{reason}")
+
+        Enum.each(Map.keys(state.consumers), fn consumer ->
+          send(consumer, {Source.Native, :read_frames, {:error, reason}})
+        end)
+
+        {:stop, :normal, state}
+    end
+  end
+
+  defp handle_status(%{status: status} = state, :publishing)
+       when status in [:handshake, :connected] do
+    {:ok, app, stream_key} = Native.get_publish_info(state.native)
+    Logger.debug("Stream #{app}/#{stream_key} published")
+
+    send(
+      state.handler,
+      {Listener, :publish, %{app: app, stream_key: stream_key, session: self()}}
+    )
+
+    %{state | status: :publishing}
+  end
+
+  defp handle_status(state, :unpublished) do
+    %{state | status: :unpublished, closed?: true}
+  end
+
+  defp handle_status(state, status) do
+    %{state | status: status}
+  end
+
+  defp gop_cache_limits(false), do: nil
+  defp gop_cache_limits(true), do: gop_cache_limits([])
+  defp gop_cache_limits(opts), do: Map.new(Keyword.merge(@default_gop_cache, opts))
+
+  defp cache_batch(%{gop_cache: nil} = state, _batch, _keyframe_index), do: state
+  defp cache_batch(%{gop: nil} = state, _batch, -1), do: state
+  defp cache_batch(state, {:ok, [], [], [], [], [], [], [], []}, -1), do: state
+  defp cache_batch(state, batch, -1), do: add_to_gop(state, batch)
+
+  # The cache is started over with the part of the batch from the keyframe on
+  defp cache_batch(state, batch, keyframe_index) do
+    {:ok, video_pts, video_dts, video_frames, video_receive_times, audio_pts, audio_dts,
+     audio_frames, audio_receive_times} = batch
+
+    keyframe_dts = Enum.at(video_dts, keyframe_index)
+
+    [video_pts, video_dts, video_frames, video_receive_times] =
+      Enum.map(
+        [video_pts, video_dts, video_frames, video_receive_times],
+        &Enum.drop(&1, keyframe_index)
+      )
+
+    # The audio frames preceding the keyframe would be dropped by the consumers anyway
+    [audio_pts, audio_dts, audio_frames, audio_receive_times] =
+      Enum.map([audio_pts, audio_dts, audio_frames, audio_receive_times], fn list ->
+        list
+        |> Enum.zip(audio_dts)
+        |> Enum.filter(fn {_item, dts} -> dts >= keyframe_dts end)
+        |> Enum.map(fn {item, _dts} -> item end)
+      end)
+
+    batch =
+      {:ok, video_pts, video_dts, video_frames, video_receive_times, audio_pts, audio_dts,
+       audio_frames, audio_receive_times}
+
+    state = drop_gop(state)
+    add_to_gop(%{state | gop: [], gop_start_dts: keyframe_dts}, batch)
+  end
+
+  defp add_to_gop(state, batch) do
+    {:ok, _video_pts, video_dts, video_frames, _video_receive_times, _audio_pts, audio_dts,
+     audio_frames, _audio_receive_times} = batch
+
+    bytes = Enum.reduce(video_frames ++ audio_frames, 0, &(byte_size(&1) + &2))
+    last_dts = Enum.take(video_dts, -1) ++ Enum.take(audio_dts, -1)
+    end_dts = Enum.max([state.gop_start_dts | last_dts])
+
+    cond do
+      state.gop_bytes + bytes > state.gop_cache.max_bytes or
+          end_dts - state.gop_start_dts > state.gop_cache.max_duration ->
+        Logger.debug("GOP cache limits exceeded, dropping it until the next keyframe")
+        drop_gop(state)
+
+      Native.charge_memory(state.native, bytes) != :ok ->
+        Logger.debug("Session memory limits exceeded, dropping the GOP cache")
+        drop_gop(state)
+
+      true ->
+        %{state | gop: [batch | state.gop], gop_bytes: state.gop_bytes + bytes}
+    end
+  end
+
+  defp drop_gop(%{gop: nil} = state), do: state
+
+  defp drop_gop(state) do
+    :ok = Native.discharge_memory(state.native, state.gop_bytes)
+    %{state | gop: nil, gop_bytes: 0, gop_start_dts: nil}
+  end
+
+  defp handle_frames(state, {:ok, [], [], [], [], [], [], [], []}), do: state
+
+  defp handle_frames(state, batch) do
+    Enum.reduce(Map.keys(state.consumers), state, fn consumer, state ->
+      state
+      |> update_consumer(consumer, &%{&1 | pending: :queue.in(batch, &1.pending)})
+      |> serve(consumer)
+    end)
+  end
+
+  # Sends the next pending batch to the consumer, if it's waiting for one
+  defp serve(state, consumer) do
+    with %{demand?: true} = consumer_state <- state.consumers[consumer],
+         {{:value, batch}, pending} <- :queue.out(consumer_state.pending) do
+      consumer_state = %{consumer_state | demand?: false, pending: pending}
+      consumer_state = send_frames(batch, consumer, consumer_state, state)
+
+      put_in(state, [:consumers, consumer], consumer_state)
+    else
+      _other -> state
+    end
+  end
+
+  defp send_frames(batch, consumer, %{format_info_sent?: false} = consumer_state, state) do
+    send(
+      consumer,
+      {Source.Native, :format_info_ready, Native.get_audio_params(state.native),
+       Native.get_video_params(state.native)}
+    )
+
+    send_frames(batch, consumer, %{consumer_state | format_info_sent?: true}, state)
+  end
+
+  defp send_frames(batch, consumer, consumer_state, _state) do
+    send(consumer, {Source.Native, :read_frames, batch})
+    consumer_state
+  end
+
+  defp maybe_end_stream(%{closed?: true} = state) do
+    consumers =
+      Map.new(state.consumers, fn {consumer, consumer_state} ->
+        if ready_for_end?(consumer_state) do
+          send(consumer, {Source.Native, :read_frames, :end_of_stream})
+          {consumer, %{consumer_state | demand?: false, ended?: true}}
+        else
+          {consumer, consumer_state}
+        end
+      end)
+
+    if Enum.all?(consumers, fn {_consumer, %{ended?: ended?}} -> ended? end) do
+      state.transport.close(state.socket)
+    end
+
+    %{state | consumers: consumers}
+  end
+
+  defp maybe_end_stream(state), do: state
+
+  defp ready_for_end?(consumer_state) do
+    consumer_state.demand? and :queue.is_empty(consumer_state.pending) and
+      not consumer_state.ended?
+  end
+
+  # The socket is read when the commands are exchanged and, after publishing,
+  # only when all the consumers are waiting for frames
+  defp maybe_activate(%{closed?: true} = state), do: state
+
+  defp maybe_activate(%{status: status} = state) when status in [:handshake, :connected] do
+    :ok = set_active_once(state)
+    state
+  end
+
+  defp maybe_activate(%{consumers: consumers} = state) when consumers != %{} do
+    if Enum.all?(consumers, fn {_consumer, c} -> c.demand? and :queue.is_empty(c.pending) end) do
+      :ok = set_active_once(state)
+    end
+
+    state
+  end
+
+  defp maybe_activate(state), do: state
+
+  defp set_active_once(%{transport: :ssl, socket: socket}),
+    do: :ssl.setopts(socket, active: :once)
+
+  defp set_active_once(%{socket: socket}), do: :inet.setopts(socket, active: :once)
+end
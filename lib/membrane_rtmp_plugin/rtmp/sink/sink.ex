@@ -5,43 +5,139 @@ defmodule Membrane.RTMP.Sink do
     - RTMP proper - "plain" RTMP protocol
     - RTMPS - RTMP over TLS/SSL
   other RTMP veriants - RTMPT, RTMPE, RTMFP are not supported.
+
+  The stream can be sent to many servers at once by passing a list of URLs as `rtmp_url`.
+  It is then muxed only once and each FLV tag is written to all the servers. Each server
+  has its own send queue written by a separate thread, so that a slow one doesn't hold
+  up the others. By default, a server that falls too far behind or fails is disconnected,
+  and the element fails only when all the servers are disconnected.
+
+  With the `send_queue` option, the send queues are used for a single server too, so that
+  network stalls don't block the element. While the queues are in use, their state is
+  reported every second with a notification
+  `{:send_queues, [%{url: url, queued_bytes: bytes, queued_duration: duration, dropped_frames: count, congestion_drops: count}]}`.
+  The queues of all the sinks running on the node are written by a shared pool of native
+  threads, two per online core, so the number of threads doesn't grow with the number of sinks.
+  The connections are established by extra threads of the pool, so that servers slow to answer
+  don't hold up the queues. A write to a server that stops reading is moved to an extra thread
+  too. At most 128 connections and writes on the node can be blocked at a time, the servers
+  whose writes block beyond that fail as if their `write_timeout` passed.
+
+  By default the stream is sent with FFmpeg's RTMP protocol. With `io_mode: :native`, the streams
+  are sent by a native client instead, which announces a larger chunk size to the server and
+  writes each frame with a single vectored write. Its rtmps:// connections share a single TLS
+  context, which keeps the last session of each server, so that reconnecting to it or opening
+  further connections to it resume the session instead of doing a full handshake. With
+  the `kernel_tls` connection option, the encryption is offloaded to the kernel where it's
+  supported, and the frames are written to the socket without being copied.
+
+  With the `reconnect` option, a server that fails mid-stream is connected again with
+  exponential backoff, by the threads writing the send queues, so that the element isn't
+  blocked by the attempts. In the meantime, its send queue keeps the frames since the last key
+  frame. Once the server is back, the stream header is sent again, followed by the kept frames,
+  so that the stream resumes from a key frame. The reconnections use the send queues, so they
+  are enabled for a single server too.
+
+  All the servers are connected to at once, so that the handshakes don't add up. With
+  `prewarm: true`, they're connected to as soon as the element is prepared. A pipeline can
+  then keep sinks prepared as warm connections and play them when the streams start.
+
+  The stream parameters may change mid-stream. The new AVC or AAC configuration is then sent
+  over the same connection in a sequence header preceding the next video key frame or audio
+  frame respectively.
+
+  Streams received by `Membrane.RTMP.Source` with `video_payload_format: :avcc` can be relayed
+  by linking its outputs straight to the sink. The AVC payloads and the AAC frames are then
+  muxed as they are received, along with the configurations from the `Membrane.H264.RemoteStream`
+  and `Membrane.AAC.RemoteStream` caps, without parsing or converting them. The key frames
+  are found by the NAL unit types of the payloads.
+
+  The frames of both streams are interleaved by their timestamps before they're muxed. A stream
+  is let ahead of the other one by at most `max_interleave_delta`, unless the other one hasn't
+  received any frames for that long, so that a silent stream doesn't hold up the stream nor
+  make the frames pile up. With `discontinuity_threshold`, the timestamps going back or jumping
+  forward are repaired by shifting the rest of the stream, so that it continues right after
+  the previous frame.
+
+  Video frames are muxed in the decoding order, with the difference between their PTS and DTS
+  written as the FLV composition time, so streams with B-frames are sent as they are.
+
+  Statistics of the stream are emitted every `stats_interval` as
+  a `[:membrane_rtmp_plugin, :sink, :stats]` telemetry event with the following measurements:
+  `video_frames`, `video_bytes`, `audio_frames`, `audio_bytes`, `muxed_bytes`, `write_time`
+  (time spent muxing and, without the send queues, sending the frames), `allocations`,
+  `interleaver_depth` (number of frames waiting to be interleaved), `last_video_dts` and
+  `last_audio_dts`. Times and timestamps are in `Membrane.Time` units. The metadata holds
+  the `element` name and the `urls`.
+
+  With `trace_latency: true`, the time from passing each frame to the native muxer until it's
+  handed to the socket is measured. The latencies are emitted every `stats_interval` as
+  cumulative histograms in `[:membrane_rtmp_plugin, :sink, :latency]` telemetry events, one
+  per server, with the `count` of the frames and the `histogram` given as a list of
+  `{upper_bound, count}` tuples. The buckets' upper bounds are consecutive powers of two
+  milliseconds and `:infinity`. The metadata holds the `element` name and the `url`.
+
   Implementation based on FFmpeg.
   """
   use Membrane.Sink
 
   require Membrane.Logger
 
-  alias __MODULE__.Native
-  alias Membrane.{AAC, MP4}
+  alias __MODULE__.{Native, Timestamps}
+  alias Membrane.{AAC, Buffer, H264, MP4, Time}
+  alias Membrane.RTMP.{ConnectionOptions, LatencyHistogram}
 
   @supported_protocols ["rtmp://", "rtmps://"]
+  @max_chunk_size 0x7FFFFFFF
   @connection_attempt_interval 500
+  @max_connection_attempt_interval 8_000
+  @frames_per_write 32
+  @queue_stats_interval 1000
+  @default_send_queue [
+    max_bytes: 32 * 1024 * 1024,
+    max_duration: 0,
+    max_latency: 0,
+    write_timeout: Time.seconds(10),
+    overflow: :drop_non_key_frames
+  ]
+  @fan_out_send_queue Keyword.put(@default_send_queue, :overflow, :disconnect)
+  @default_reconnect [
+    max_attempts: 10,
+    initial_delay: Time.milliseconds(500),
+    max_delay: Time.seconds(10)
+  ]
   @default_state %{
     attempts: 0,
     native: nil,
-    buffered_frame: nil,
+    buffered_frames: [],
     ready: false,
-    current_timestamps: %{}
+    current_timestamps: %{},
+    last_write_times: %{},
+    interleaving_check_scheduled?: false,
+    timestamp_offsets: %{},
+    failed_urls: [],
+    reconnect_attempts: %{},
+    nal_length_size: 4
   }
 
   def_input_pad :audio,
     availability: :always,
-    caps: AAC,
+    caps: [AAC, AAC.RemoteStream],
     mode: :pull,
     demand_unit: :buffers
 
   def_input_pad :video,
     availability: :always,
-    caps: MP4.Payload,
+    caps: [MP4.Payload, {H264.RemoteStream, stream_format: :avc1}],
     mode: :pull,
     demand_unit: :buffers
 
   def_options rtmp_url: [
-                type: :string,
-                spec: String.t(),
+                spec: String.t() | [String.t()],
                 description:
                   "Destination URL of the stream. It needs to start with rtmp:// or rtmps:// depending on the protocol variant.
-                This URL should be provided by your streaming service."
+                This URL should be provided by your streaming service. A list of URLs can be given
+                to stream to many destinations at once."
               ],
               max_attempts: [
                 type: :integer,
@@ -49,13 +145,126 @@ defmodule Membrane.RTMP.Sink do
                 default: 1,
                 description: """
                 Maximum number of connection attempts before failing with an error.
-                The attempts will happen every #{@connection_attempt_interval} ms
+                The attempts are retried with exponential backoff, starting from
+                #{@connection_attempt_interval} ms, up to #{@max_connection_attempt_interval} ms
+                """
+              ],
+              send_queue: [
+                spec: nil | Keyword.t(),
+                default: nil,
+                description: """
+                Makes the stream written to the servers from bounded send queues by separate threads.
+                Supported options:
+                  - `max_bytes` - maximal size of the queued data, 32 MiB by default
+                  - `max_duration` - maximal duration of the queued media, unlimited by default
+                  - `max_latency` - with the dropping policies, all the queued video is dropped once its
+                    oldest frame has waited longer than that, and the stream resumes at the next key frame,
+                    while the audio is kept. The number of such drops is reported as `congestion_drops`.
+                    Unlimited by default.
+                  - `write_timeout` - the server is given up, or reconnected when `reconnect` is set,
+                    once writing a single frame to it takes longer than that, for instance because it
+                    stopped reading. 10 seconds by default, `0` disables the timeout.
+                  - `overflow` - what happens to the frames that don't fit in the queue: `:block` waits for
+                    the queue to drain, `:drop_non_key_frames` drops video until the next key frame that fits,
+                    `:drop_audio_last` additionally drops audio when there's no video left to drop,
+                    `:disconnect` gives up the server. `:drop_non_key_frames` by default.
+
+                When streaming to many servers, the send queues are always used, by default
+                with the `overflow: :disconnect` policy.
+                """
+              ],
+              reconnect: [
+                spec: nil | Keyword.t(),
+                default: nil,
+                description: """
+                Makes the servers that fail mid-stream connected again, instead of giving them up.
+                Supported options:
+                  - `max_attempts` - number of reconnection attempts before giving up the server, 10 by default
+                  - `initial_delay` - delay of the first attempt, doubled with each subsequent one,
+                    500 ms by default
+                  - `max_delay` - maximal delay between the attempts, 10 seconds by default
+
+                The delays are randomized by up to a half, so that streams broken at once aren't
+                reconnected at once. While a server is disconnected, the frames since the last key frame
+                are kept in its send queue, up to its `max_bytes`.
+                """
+              ],
+              io_mode: [
+                spec: :ffmpeg | :native,
+                default: :ffmpeg,
+                description: """
+                Determines how the stream is sent to the servers. `:ffmpeg` uses FFmpeg's RTMP protocol,
+                `:native` uses a native RTMP client supporting large chunk sizes, compressed
+                chunk headers and the resumption of the TLS sessions of rtmps:// servers.
+                """
+              ],
+              chunk_size: [
+                spec: pos_integer(),
+                default: 65_536,
+                description: """
+                Size of the chunks the RTMP messages are split into, announced to the server with
+                the Set Chunk Size message. Larger chunks mean fewer headers to send.
+                Applies only to `io_mode: :native`.
+                """
+              ],
+              connect_timeout: [
+                spec: Time.t(),
+                default: Time.seconds(10),
+                description: """
+                Time given to connecting to a server and publishing the stream, including
+                the reconnections, after which the attempt fails. `0` disables the timeout.
+                """
+              ],
+              prewarm: [
+                spec: boolean(),
+                default: false,
+                description: """
+                If true, the connections to the servers, including publishing the stream, are
+                established in the background as soon as the element is prepared, so that
+                the stream starts without waiting for them once it's playing.
+                """
+              ],
+              connection_options: [
+                spec: ConnectionOptions.t(),
+                default: [],
+                description: ConnectionOptions.description()
+              ],
+              stats_interval: [
+                spec: Time.t() | nil,
+                default: Time.seconds(1),
+                description: "Interval of the stats and latency telemetry events, `nil` disables them."
+              ],
+              trace_latency: [
+                spec: boolean(),
+                default: false,
+                description: """
+                If true, the latency of sending the frames is measured and emitted with telemetry.
+                """
+              ],
+              max_interleave_delta: [
+                spec: Time.t(),
+                default: Time.seconds(10),
+                description: """
+                Maximal difference between the timestamps of the streams while they're interleaved.
+                Bounds the memory and latency taken by waiting for a stream that goes silent.
+                """
+              ],
+              discontinuity_threshold: [
+                spec: Time.t() | nil,
+                default: nil,
+                description: """
+                If set, a timestamp lower than the previous one of the same stream, or greater than
+                it by more than the threshold, is treated as a discontinuity. The stream's following
+                timestamps are then shifted, so that it continues right after the previous frame.
                 """
               ]
 
   @impl true
   def handle_init(options) do
-    unless String.starts_with?(options.rtmp_url, @supported_protocols) do
+    rtmp_urls = List.wrap(options.rtmp_url)
+
+    unless rtmp_urls != [] and
+             Enum.all?(rtmp_urls, &String.starts_with?(&1, @supported_protocols)) do
       raise ArgumentError, "Invalid destination URL provided"
     end
 
@@ -63,15 +272,59 @@ defmodule Membrane.RTMP.Sink do
       raise ArgumentError, "Invalid max_attempts option value: #{options.max_attempts}"
     end
 
-    {:ok, options |> Map.from_struct() |> Map.merge(@default_state)}
+    unless is_integer(options.chunk_size) and options.chunk_size in 1..@max_chunk_size do
+      raise ArgumentError, "Invalid chunk_size option value: #{options.chunk_size}"
+    end
+
+    ConnectionOptions.validate!(options.connection_options)
+
+    unless is_integer(options.connect_timeout) and options.connect_timeout >= 0 do
+      raise ArgumentError, "Invalid connect_timeout option value: #{options.connect_timeout}"
+    end
+
+    unless is_integer(options.max_interleave_delta) and options.max_interleave_delta > 0 do
+      raise ArgumentError,
+            "Invalid max_interleave_delta option value: #{options.max_interleave_delta}"
+    end
+
+    send_queue =
+      cond do
+        options.send_queue != nil -> Keyword.merge(@default_send_queue, options.send_queue)
+        length(rtmp_urls) > 1 -> @fan_out_send_queue
+        options.reconnect != nil -> @default_send_queue
+        true -> nil
+      end
+
+    reconnect = options.reconnect && Keyword.merge(@default_reconnect, options.reconnect)
+
+    {:ok,
+     options
+     |> Map.from_struct()
+     |> Map.delete(:rtmp_url)
+     |> Map.merge(%{rtmp_urls: rtmp_urls, send_queue: send_queue, reconnect: reconnect})
+     |> Map.merge(@default_state)}
+  end
+
+  @impl true
+  def handle_stopped_to_prepared(_ctx, %{prewarm: true} = state) do
+    state = create_native(state)
+
+    case Native.start_connecting(state.native) do
+      :ok -> {:ok, state}
+      {:error, reason} -> raise "Failed to connect to '#{urls(state)}': #{reason}"
+    end
+  end
+
+  @impl true
+  def handle_stopped_to_prepared(_ctx, state) do
+    {:ok, state}
   end
 
   @impl true
   def handle_prepared_to_playing(_ctx, state) do
-    {:ok, native} = Native.create(state.rtmp_url)
+    state = if state.native, do: state, else: create_native(state)
     send(self(), :try_connect)
-
-    {{:ok, playback_change: :suspend}, %{state | native: native}}
+    {{:ok, playback_change: :suspend}, state}
   end
 
   @impl true
@@ -85,26 +338,29 @@ defmodule Membrane.RTMP.Sink do
   def handle_caps(
         :video,
         %MP4.Payload{content: %MP4.Payload.AVC1{avcc: avc_config}} = caps,
-        _ctx,
+        ctx,
         state
       ) do
-    case Native.init_video_stream(state.native, caps.width, caps.height, avc_config) do
-      {:ok, ready, native} ->
-        Membrane.Logger.debug("Correctly initialized video stream.")
-        state = Map.merge(state, %{native: native, ready: ready})
-        {:ok, state}
+    {:ok, ready, native} =
+      Native.init_video_stream(state.native, caps.width, caps.height, avc_config)
 
-      {:error, :caps_resent} ->
-        Membrane.Logger.error(
-          "Input caps redefined on pad :video. RTMP Sink does not support changing stream parameters"
-        )
+    log_stream_init(:video, ctx)
+    {:ok, Map.merge(state, %{native: native, ready: ready})}
+  end
 
-        {:ok, state}
-    end
+  @impl true
+  def handle_caps(:video, %H264.RemoteStream{decoder_configuration_record: dcr}, ctx, state) do
+    # The dimensions are taken by the clients from the SPS
+    {:ok, ready, native} = Native.init_video_stream(state.native, 0, 0, dcr)
+    <<_version_and_profile::binary-size(4), _reserved::6, length_size_minus_one::2, _::bits>> = dcr
+    nal_length_size = length_size_minus_one + 1
+
+    log_stream_init(:video, ctx)
+    {:ok, Map.merge(state, %{native: native, ready: ready, nal_length_size: nal_length_size})}
   end
 
   @impl true
-  def handle_caps(:audio, %Membrane.AAC{} = caps, _ctx, state) do
+  def handle_caps(:audio, %Membrane.AAC{} = caps, ctx, state) do
     profile = AAC.profile_to_aot_id(caps.profile)
     sr_index = AAC.sample_rate_to_sampling_frequency_id(caps.sample_rate)
     channel_configuration = AAC.channels_to_channel_config_id(caps.channels)
@@ -113,42 +369,36 @@ defmodule Membrane.RTMP.Sink do
     aac_config =
       <<profile::5, sr_index::4, channel_configuration::4, frame_length_id::1, 0::1, 0::1>>
 
-    case Native.init_audio_stream(state.native, caps.channels, caps.sample_rate, aac_config) do
-      {:ok, ready, native} ->
-        Membrane.Logger.debug("Correctly initialized audio stream.")
-        state = Map.merge(state, %{native: native, ready: ready})
-        {:ok, state}
-
-      {:error, :caps_resent} ->
-        Membrane.Logger.error(
-          "Input caps redefined on pas :audio. RTMP Sink does not support changing stream paremeters"
-        )
+    {:ok, ready, native} =
+      Native.init_audio_stream(state.native, caps.channels, caps.sample_rate, aac_config)
 
-        {:ok, state}
-    end
+    log_stream_init(:audio, ctx)
+    {:ok, Map.merge(state, %{native: native, ready: ready})}
   end
 
   @impl true
-  def handle_write(pad, buffer, _ctx, %{ready: false} = state) do
-    state = Map.put(state, :buffered_frame, {pad, buffer})
-    {:ok, state}
+  def handle_caps(:audio, %AAC.RemoteStream{audio_specific_config: asc}, ctx, state) do
+    <<_profile::5, sr_index::4, channel_configuration::4, _rest::bits>> = asc
+    channels = AAC.channel_config_id_to_channels(channel_configuration)
+    sample_rate = AAC.sampling_frequency_id_to_sample_rate(sr_index)
+
+    {:ok, ready, native} = Native.init_audio_stream(state.native, channels, sample_rate, asc)
+
+    log_stream_init(:audio, ctx)
+    {:ok, Map.merge(state, %{native: native, ready: ready})}
   end
 
   @impl true
-  def handle_write(
-        pad,
-        buffer,
-        _ctx,
-        %{ready: true, buffered_frame: {frame_pad, frame}} = state
-      ) do
-    state = write_frame(state, frame_pad, frame) |> write_frame(pad, buffer)
-    {{:ok, demand: get_demand(state)}, Map.put(state, :buffered_frame, nil)}
+  def handle_write_list(pad, buffers, _ctx, %{ready: false} = state) do
+    state = Map.update!(state, :buffered_frames, &(&1 ++ [{pad, buffers}]))
+    {:ok, state}
   end
 
   @impl true
-  def handle_write(pad, buffer, _ctx, state) do
-    state = write_frame(state, pad, buffer)
-    {{:ok, demand: get_demand(state)}, state}
+  def handle_write_list(pad, buffers, _ctx, %{ready: true} = state) do
+    state = write_frames(state, state.buffered_frames ++ [{pad, buffers}])
+    {demands, state} = get_demands(%{state | buffered_frames: []})
+    {{:ok, demands}, state}
   end
 
   @impl true
@@ -158,14 +408,15 @@ defmodule Membrane.RTMP.Sink do
       {:ok, state}
     else
       state = Map.update!(state, :current_timestamps, &Map.delete(&1, pad))
-      {{:ok, demand: get_demand(state)}, state}
+      {demands, state} = get_demands(state)
+      {{:ok, demands}, state}
     end
   end
 
   @impl true
   def handle_other(:try_connect, _ctx, %{attempts: attempts, max_attempts: max_attempts} = state)
       when attempts >= max_attempts do
-    raise "Failed to connect to '#{state.rtmp_url}' #{attempts} times, aborting"
+    raise "Failed to connect to '#{urls(state)}' #{attempts} times, aborting"
   end
 
   def handle_other(:try_connect, ctx, state) do
@@ -173,61 +424,339 @@ defmodule Membrane.RTMP.Sink do
 
     case Native.try_connect(state.native) do
       :ok ->
-        Membrane.Logger.debug("Correctly initialized connection with: #{state.rtmp_url}")
-        demands = ctx.pads |> Map.keys() |> Enum.map(&{:demand, &1})
+        Membrane.Logger.debug("Correctly initialized connection with: #{urls(state)}")
+        demands = ctx.pads |> Map.keys() |> Enum.map(&{:demand, {&1, @frames_per_write}})
+        if state.send_queue, do: Process.send_after(self(), :report_queues, @queue_stats_interval)
+        schedule_stats_report(state)
         {{:ok, [{:playback_change, :resume} | demands]}, state}
 
       {:error, :econnrefused} ->
-        Process.send_after(self(), :try_connect, @connection_attempt_interval)
-
-        Membrane.Logger.warn(
-          "Connection to #{state.rtmp_url} refused, retrying in #{@connection_attempt_interval}ms"
-        )
-
+        delay =
+          backoff_delay(
+            state.attempts,
+            @connection_attempt_interval,
+            @max_connection_attempt_interval
+          )
+
+        Process.send_after(self(), :try_connect, delay)
+        Membrane.Logger.warn("Connection to #{urls(state)} refused, retrying in #{delay}ms")
         {:ok, state}
 
       {:error, reason} ->
-        raise "Failed to connect to '#{state.rtmp_url}': #{reason}"
+        raise "Failed to connect to '#{urls(state)}': #{reason}"
     end
   end
 
-  defp write_frame(state, :audio, buffer) do
-    buffer_pts = buffer.pts |> Ratio.ceil()
+  @impl true
+  def handle_other({:destination_failed, url, reason}, _ctx, %{reconnect: nil} = state) do
+    Membrane.Logger.warn("Streaming to #{url} failed: #{reason}")
+    {:ok, give_up_destination(state, url)}
+  end
 
-    case Native.write_audio_frame(state.native, buffer.payload, buffer_pts) do
-      {:ok, native} ->
-        Map.put(state, :native, native)
-        |> Map.update!(:current_timestamps, fn curr_tmps ->
-          Map.put(curr_tmps, :audio, buffer_pts)
-        end)
+  @impl true
+  def handle_other({:destination_failed, url, reason}, _ctx, state) do
+    Membrane.Logger.warn("Streaming to #{url} failed: #{reason}, reconnecting")
+    {:ok, schedule_reconnect(state, url)}
+  end
 
-      {:error, reason} ->
-        raise("Writing audio frame failed with reason: #{reason}")
+  @impl true
+  def handle_other({:reconnect, url}, %{playback_state: :playing}, state) do
+    # The result of connecting in the background is sent as a message
+    case Native.reconnect(state.native, url) do
+      :ok -> {:ok, state}
+      {:error, reason} -> handle_reconnection_failure(state, url, reason)
+    end
+  end
+
+  @impl true
+  def handle_other({:reconnect, _url}, _ctx, state) do
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other({:reconnected, url}, _ctx, state) do
+    Membrane.Logger.info("Reconnected to #{url}")
+    {:ok, Map.update!(state, :reconnect_attempts, &Map.delete(&1, url))}
+  end
+
+  @impl true
+  def handle_other({:reconnection_failed, url, reason}, _ctx, state) do
+    handle_reconnection_failure(state, url, reason)
+  end
+
+  @impl true
+  def handle_other(:check_interleaving, %{playback_state: :playing}, state) do
+    {demands, state} = get_demands(%{state | interleaving_check_scheduled?: false})
+    {{:ok, demands}, state}
+  end
+
+  @impl true
+  def handle_other(:check_interleaving, _ctx, state) do
+    {:ok, %{state | interleaving_check_scheduled?: false}}
+  end
+
+  @impl true
+  def handle_other(:report_queues, %{playback_state: :playing}, state) do
+    {:ok, queued_bytes, queued_durations, dropped_frames, congestion_drops} =
+      Native.get_queue_stats(state.native)
+
+    queues =
+      [state.rtmp_urls, queued_bytes, queued_durations, dropped_frames, congestion_drops]
+      |> Enum.zip_with(fn [url, bytes, duration, dropped, congestion_drops] ->
+        %{
+          url: url,
+          queued_bytes: bytes,
+          queued_duration: duration,
+          dropped_frames: dropped,
+          congestion_drops: congestion_drops
+        }
+      end)
+
+    Process.send_after(self(), :report_queues, @queue_stats_interval)
+    {{:ok, notify: {:send_queues, queues}}, state}
+  end
+
+  @impl true
+  def handle_other(:report_queues, _ctx, state) do
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other(:report_stats, %{playback_state: :playing} = ctx, state) do
+    {:ok, video_frames, video_bytes, audio_frames, audio_bytes, muxed_bytes, write_time,
+     allocations, interleaver_depth, last_video_dts, last_audio_dts} =
+      Native.get_stats(state.native)
+
+    :telemetry.execute(
+      [:membrane_rtmp_plugin, :sink, :stats],
+      %{
+        video_frames: video_frames,
+        video_bytes: video_bytes,
+        audio_frames: audio_frames,
+        audio_bytes: audio_bytes,
+        muxed_bytes: muxed_bytes,
+        write_time: Time.microseconds(write_time),
+        allocations: allocations,
+        interleaver_depth: interleaver_depth,
+        last_video_dts: last_video_dts,
+        last_audio_dts: last_audio_dts
+      },
+      %{element: ctx.name, urls: state.rtmp_urls}
+    )
+
+    report_latency(ctx, state)
+    schedule_stats_report(state)
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other(:report_stats, _ctx, state) do
+    {:ok, state}
+  end
+
+  defp create_native(state) do
+    send_queue = state.send_queue || @default_send_queue
+    {option_names, option_values} = ConnectionOptions.to_ffmpeg(state.connection_options)
+
+    {:ok, native} =
+      Native.create(
+        state.rtmp_urls,
+        state.send_queue != nil,
+        Keyword.fetch!(send_queue, :max_bytes),
+        Keyword.fetch!(send_queue, :max_duration),
+        Keyword.fetch!(send_queue, :max_latency),
+        Keyword.fetch!(send_queue, :write_timeout),
+        Keyword.fetch!(send_queue, :overflow),
+        state.reconnect != nil,
+        state.io_mode == :native,
+        state.chunk_size,
+        state.connect_timeout,
+        state.trace_latency,
+        state.max_interleave_delta,
+        option_names,
+        option_values
+      )
+
+    %{state | native: native}
+  end
+
+  defp report_latency(_ctx, %{trace_latency: false}), do: :ok
+
+  defp report_latency(ctx, state) do
+    {:ok, histograms} = Native.get_latency_histograms(state.native)
+
+    histograms
+    |> Enum.chunk_every(LatencyHistogram.buckets())
+    |> Enum.zip(state.rtmp_urls)
+    |> Enum.each(fn {histogram, url} ->
+      :telemetry.execute(
+        [:membrane_rtmp_plugin, :sink, :latency],
+        LatencyHistogram.to_measurements(histogram),
+        %{element: ctx.name, url: url}
+      )
+    end)
+  end
+
+  defp log_stream_init(pad, %{old_caps: nil}) do
+    Membrane.Logger.debug("Correctly initialized #{pad} stream.")
+  end
+
+  defp log_stream_init(:video, _state) do
+    Membrane.Logger.debug("Video stream parameters changed, sending them with the next key frame")
+  end
+
+  defp log_stream_init(:audio, _state) do
+    Membrane.Logger.debug("Audio stream parameters changed, sending them with the next frame")
+  end
+
+  defp give_up_destination(state, url) do
+    state = Map.update!(state, :failed_urls, &[url | &1])
+
+    if length(state.failed_urls) == length(state.rtmp_urls) do
+      raise "Streaming to all the destinations failed"
+    end
+
+    state
+  end
+
+  defp handle_reconnection_failure(state, url, reason) do
+    attempts = state.reconnect_attempts[url]
+
+    if attempts >= Keyword.fetch!(state.reconnect, :max_attempts) do
+      Membrane.Logger.warn("Failed to reconnect to #{url} #{attempts} times: #{reason}")
+      {:ok, give_up_destination(state, url)}
+    else
+      Membrane.Logger.warn("Failed to reconnect to #{url}: #{reason}")
+      {:ok, schedule_reconnect(state, url)}
     end
   end
 
-  defp write_frame(state, :video, buffer) do
-    case Native.write_video_frame(
+  defp schedule_reconnect(state, url) do
+    attempts = Map.get(state.reconnect_attempts, url, 0) + 1
+
+    delay =
+      backoff_delay(
+        attempts,
+        div(Keyword.fetch!(state.reconnect, :initial_delay), Time.millisecond()),
+        div(Keyword.fetch!(state.reconnect, :max_delay), Time.millisecond())
+      )
+
+    Process.send_after(self(), {:reconnect, url}, delay)
+    put_in(state, [:reconnect_attempts, url], attempts)
+  end
+
+  # Delay in milliseconds growing exponentially with the attempts, randomized by up to a half
+  defp backoff_delay(attempt, initial_delay, max_delay) do
+    delay = min(initial_delay * Integer.pow(2, attempt - 1), max_delay)
+    div(delay, 2) + :rand.uniform(div(delay, 2) + 1) - 1
+  end
+
+  defp schedule_stats_report(%{stats_interval: nil}), do: :ok
+
+  defp schedule_stats_report(state) do
+    Process.send_after(self(), :report_stats, div(state.stats_interval, Time.millisecond()))
+  end
+
+  defp write_frames(state, buffers_by_pad) do
+    video = buffers_by_pad |> Keyword.get_values(:video) |> List.flatten()
+    audio = buffers_by_pad |> Keyword.get_values(:audio) |> List.flatten()
+
+    audio_timestamps = Enum.map(audio, &Ratio.ceil(&1.pts))
+    {video_offsets, state} = repair_timestamps(state, :video, Enum.map(video, & &1.dts))
+    {audio_offsets, state} = repair_timestamps(state, :audio, audio_timestamps)
+
+    video_dts = Enum.zip_with(video, video_offsets, &(&1.dts + &2))
+    video_pts = Enum.zip_with(video, video_offsets, &(video_pts(&1) + &2))
+    audio_pts = Enum.zip_with(audio_timestamps, audio_offsets, &(&1 + &2))
+
+    case Native.write_frames(
            state.native,
-           buffer.payload,
-           buffer.dts,
-           buffer.metadata.h264.key_frame?
+           Enum.map(video, & &1.payload),
+           video_dts,
+           video_pts,
+           Enum.map(video, &key_frame?(&1, state)),
+           Enum.map(audio, & &1.payload),
+           audio_pts
          ) do
       {:ok, native} ->
-        Map.put(state, :native, native)
-        |> Map.update!(:current_timestamps, fn curr_tmps ->
-          Map.put(curr_tmps, :video, buffer.dts)
-        end)
+        timestamps =
+          [video: List.last(video_dts), audio: List.last(audio_pts)]
+          |> Enum.reject(fn {_pad, timestamp} -> timestamp == nil end)
+          |> Map.new()
+
+        now = Time.monotonic_time()
+        write_times = Map.new(timestamps, fn {pad, _timestamp} -> {pad, now} end)
+
+        state
+        |> Map.put(:native, native)
+        |> Map.update!(:current_timestamps, &Map.merge(&1, timestamps))
+        |> Map.update!(:last_write_times, &Map.merge(&1, write_times))
 
       {:error, reason} ->
-        raise("Writing video frame failed with reason: #{reason}")
+        raise("Writing frames failed with reason: #{reason}")
+    end
+  end
+
+  # Buffers without PTS are presented as soon as they're decoded
+  defp video_pts(%Buffer{pts: nil, dts: dts}), do: dts
+  defp video_pts(%Buffer{pts: pts}), do: Ratio.ceil(pts)
+
+  defp key_frame?(%Buffer{metadata: %{h264: %{key_frame?: key_frame?}}}, _state), do: key_frame?
+  defp key_frame?(%Buffer{payload: payload}, state), do: idr?(payload, state.nal_length_size)
+
+  # Whether the AVC payload contains an IDR slice, that is a NAL unit of type 5
+  defp idr?(payload, nal_length_size) do
+    case payload do
+      <<size::unit(8)-size(nal_length_size), nal_unit::binary-size(size), rest::binary>> ->
+        match?(<<_forbidden_zero::1, _ref_idc::2, 5::5, _rest::binary>>, nal_unit) or
+          idr?(rest, nal_length_size)
+
+      _other ->
+        false
     end
   end
 
-  defp get_demand(state) do
-    {pad, _timestamp} =
-      state.current_timestamps |> Enum.min_by(fn {_pad, timestamp} -> timestamp end)
+  defp urls(state), do: Enum.join(state.rtmp_urls, ", ")
+
+  defp repair_timestamps(%{discontinuity_threshold: nil} = state, _pad, timestamps) do
+    {List.duplicate(0, length(timestamps)), state}
+  end
+
+  defp repair_timestamps(state, pad, timestamps) do
+    initial = Map.get(state.timestamp_offsets, pad, Timestamps.new_repair())
+    {offsets, repair} = Timestamps.repair(timestamps, initial, state.discontinuity_threshold)
+
+    if repair.offset != initial.offset do
+      Membrane.Logger.warn("Discontinuity of the #{pad} timestamps, repairing them")
+    end
+
+    {offsets, put_in(state, [:timestamp_offsets, pad], repair)}
+  end
+
+  # Demands the streams that can be written without breaking the interleaving. While any is
+  # held back, the demands are checked again after max_interleave_delta, in case the stream
+  # it waits for has gone silent.
+  defp get_demands(state) do
+    delta = state.max_interleave_delta
+
+    {demanded, held} =
+      Timestamps.split_demanded(
+        state.current_timestamps,
+        state.last_write_times,
+        delta,
+        Time.monotonic_time()
+      )
+
+    demands = Enum.map(demanded, &{:demand, {&1, @frames_per_write}})
+
+    state =
+      if held != [] and not state.interleaving_check_scheduled? do
+        Process.send_after(self(), :check_interleaving, div(delta, Time.millisecond()))
+        %{state | interleaving_check_scheduled?: true}
+      else
+        state
+      end
 
-    {pad, 1}
+    {demands, state}
   end
 end
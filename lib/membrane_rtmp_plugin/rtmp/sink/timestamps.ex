@@ -0,0 +1,54 @@
+defmodule Membrane.RTMP.Sink.Timestamps do
+  @moduledoc false
+  # Timestamps of the streams written by the sink: repairing their discontinuities and choosing
+  # the streams to be demanded, so that they're interleaved.
+
+  alias Membrane.Time
+
+  @type repair_t :: %{offset: integer(), last: integer() | nil, duration: non_neg_integer()}
+
+  @spec new_repair() :: repair_t()
+  def new_repair(), do: %{offset: 0, last: nil, duration: 0}
+
+  # Returns the offsets to be added to the timestamps of the stream, so that it continues
+  # right after the previous frame after each discontinuity: a timestamp lower than the previous
+  # one or greater than it by more than the threshold.
+  @spec repair([integer()], repair_t(), Time.t()) :: {[integer()], repair_t()}
+  def repair(timestamps, repair, threshold) do
+    Enum.map_reduce(timestamps, repair, fn timestamp, repair ->
+      shifted = timestamp + repair.offset
+
+      repair =
+        if repair.last != nil and (shifted < repair.last or shifted - repair.last > threshold) do
+          %{repair | offset: repair.last + repair.duration - timestamp}
+        else
+          duration = if repair.last == nil, do: 0, else: shifted - repair.last
+          %{repair | duration: duration}
+        end
+
+      {repair.offset, %{repair | last: timestamp + repair.offset}}
+    end)
+  end
+
+  # Splits the streams, given their last timestamps and the times they were written, into those
+  # to be demanded and those held back: the stream that's behind is demanded along with the ones
+  # ahead of it by at most `max_delta`. The streams too far ahead are demanded as well once
+  # the one behind hasn't been written for `max_delta`.
+  @spec split_demanded(%{pad => Time.t()}, %{pad => Time.t()}, Time.t(), Time.t()) ::
+          {demanded :: [pad], held :: [pad]}
+        when pad: atom()
+  def split_demanded(timestamps, _write_times, _max_delta, _now) when timestamps == %{},
+    do: {[], []}
+
+  def split_demanded(timestamps, write_times, max_delta, now) do
+    {lagging_pad, min_timestamp} = Enum.min_by(timestamps, fn {_pad, timestamp} -> timestamp end)
+    stalled? = now - write_times[lagging_pad] > max_delta
+
+    {demanded, held} =
+      Enum.split_with(timestamps, fn {pad, timestamp} ->
+        pad == lagging_pad or stalled? or timestamp - min_timestamp <= max_delta
+      end)
+
+    {Enum.map(demanded, &elem(&1, 0)), Enum.map(held, &elem(&1, 0))}
+  end
+end
@@ -1,16 +1,22 @@
 defmodule Membrane.RTMP.SourceBin do
   @moduledoc """
-  Bin responsible for spawning new RTMP server.
+  Bin responsible for spawning new RTMP server or receiving a stream from a session
+  accepted by `Membrane.RTMP.Listener`.
 
   It will receive RTMP stream from the client, parse it and demux it, outputting single audio and video which are ready for further processing with Membrane Elements.
   At this moment only AAC and H264 codecs are support
+
+  With `video_payload_format: :avcc`, the video is output with the NAL units prefixed with
+  their length, as it's received from the client, in `Membrane.H264.RemoteStream` caps holding
+  the decoder configuration record. It's not parsed, as each RTMP message holds a single access
+  unit, and it can be passed to `Membrane.RTMP.Sink` without converting it back from Annex-B.
   """
   use Membrane.Bin
 
   alias Membrane.{AAC, H264, RTMP}
 
   def_output_pad :video,
-    caps: H264,
+    caps: [H264, {H264.RemoteStream, stream_format: :avc1}],
     availability: :always,
     mode: :pull,
     demand_unit: :buffers
@@ -22,7 +28,8 @@ defmodule Membrane.RTMP.SourceBin do
     demand_unit: :buffers
 
   def_options port: [
-                spec: 1..65_535,
+                spec: 1..65_535 | nil,
+                default: nil,
                 description: "Port on which the server will listen"
               ],
               local_ip: [
@@ -39,32 +46,147 @@ defmodule Membrane.RTMP.SourceBin do
 
                 Duration given must be a multiply of one second or atom `:infinity`.
                 """
+              ],
+              io_mode: [
+                spec: :ffmpeg | :native,
+                default: :ffmpeg,
+                description: """
+                Determines how the connection on `port` is handled, see `Membrane.RTMP.Source` for details.
+                """
+              ],
+              video_payload_format: [
+                spec: :annexb | :avcc,
+                default: :annexb,
+                description: """
+                Format of the video payloads. `:annexb` outputs parsed H264 in Annex-B format,
+                `:avcc` outputs the length-prefixed NAL units received from the client.
+                """
+              ],
+              fast_start: [
+                spec: boolean(),
+                default: false,
+                description: """
+                Sets up the streams as soon as their sequence headers are received,
+                see `Membrane.RTMP.Source` for details.
+                """
+              ],
+              probe_size: [
+                spec: pos_integer() | nil,
+                default: nil,
+                description: "Maximal number of bytes read to probe the stream, see `Membrane.RTMP.Source`"
+              ],
+              analyze_duration: [
+                spec: Time.t() | nil,
+                default: nil,
+                description: "Maximal duration of the stream analyzed when probing it, see `Membrane.RTMP.Source`"
+              ],
+              fps_probe_size: [
+                spec: non_neg_integer() | nil,
+                default: nil,
+                description: "Number of frames used to probe the frame rate, see `Membrane.RTMP.Source`"
+              ],
+              connection_options: [
+                spec: RTMP.ConnectionOptions.t(),
+                default: [],
+                description:
+                  "Options of the connection when listening on `port`, see `Membrane.RTMP.Source`"
+              ],
+              tls_options: [
+                spec: [:ssl.tls_server_option()] | nil,
+                default: nil,
+                description:
+                  "Options of the TLS server accepting RTMPS on `port`, see `Membrane.RTMP.Source`"
+              ],
+              prefetch: [
+                spec: Keyword.t(),
+                default: [max_frames: 0],
+                description:
+                  "Limits of the queues of frames read ahead of the demand, see `Membrane.RTMP.Source`"
+              ],
+              stats_interval: [
+                spec: Time.t() | nil,
+                default: Membrane.Time.seconds(1),
+                description: "Interval of the stats telemetry events, see `Membrane.RTMP.Source`"
+              ],
+              trace_latency: [
+                spec: boolean(),
+                default: false,
+                description: "Whether the latency of the frames is traced, see `Membrane.RTMP.Source`"
+              ],
+              session: [
+                spec: pid() | nil,
+                default: nil,
+                description: """
+                Session announced by `Membrane.RTMP.Listener` to receive the stream from,
+                instead of listening on `port`. Many bins can receive the stream from
+                a single session, see `Membrane.RTMP.Listener` for details.
+                """
               ]
 
   @impl true
   def handle_init(%__MODULE__{} = options) do
-    url = "rtmp://#{options.local_ip}:#{options.port}"
-    source = %RTMP.Source{url: url, timeout: options.timeout}
+    source =
+      if options.session do
+        %RTMP.Source{
+          session: options.session,
+          video_payload_format: options.video_payload_format,
+          prefetch: options.prefetch,
+          stats_interval: options.stats_interval,
+          trace_latency: options.trace_latency
+        }
+      else
+        url = "rtmp://#{options.local_ip}:#{options.port}"
+        %RTMP.Source{
+          url: url,
+          timeout: options.timeout,
+          io_mode: options.io_mode,
+          video_payload_format: options.video_payload_format,
+          fast_start: options.fast_start,
+          probe_size: options.probe_size,
+          analyze_duration: options.analyze_duration,
+          fps_probe_size: options.fps_probe_size,
+          connection_options: options.connection_options,
+          tls_options: options.tls_options,
+          prefetch: options.prefetch,
+          stats_interval: options.stats_interval,
+          trace_latency: options.trace_latency
+        }
+      end
 
     spec = %ParentSpec{
-      children: %{
-        src: source,
-        video_parser: %Membrane.H264.FFmpeg.Parser{
-          alignment: :au,
-          attach_nalus?: true,
-          skip_until_keyframe?: true
-        },
-        audio_parser: %Membrane.AAC.Parser{
-          in_encapsulation: :none,
-          out_encapsulation: :none
+      children:
+        %{
+          src: source,
+          audio_parser: %Membrane.AAC.Parser{
+            in_encapsulation: :none,
+            out_encapsulation: :none
+          }
         }
-      },
+        |> Map.merge(video_parser(options.video_payload_format)),
       links: [
         link(:src) |> via_out(:audio) |> to(:audio_parser) |> to_bin_output(:audio),
-        link(:src) |> via_out(:video) |> to(:video_parser) |> to_bin_output(:video)
+        video_link(options.video_payload_format)
       ]
     }
 
     {{:ok, spec: spec}, %{}}
   end
+
+  defp video_parser(:annexb) do
+    %{
+      video_parser: %Membrane.H264.FFmpeg.Parser{
+        alignment: :au,
+        attach_nalus?: true,
+        skip_until_keyframe?: true
+      }
+    }
+  end
+
+  # The parser accepts only Annex-B, while the AVC payloads are already aligned to access units
+  defp video_parser(:avcc), do: %{}
+
+  defp video_link(:annexb),
+    do: link(:src) |> via_out(:video) |> to(:video_parser) |> to_bin_output(:video)
+
+  defp video_link(:avcc), do: link(:src) |> via_out(:video) |> to_bin_output(:video)
 end
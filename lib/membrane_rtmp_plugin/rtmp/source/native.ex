@@ -4,13 +4,34 @@ defmodule Membrane.RTMP.Source.Native do
 
   require Logger
 
+  alias Membrane.RTMP.ConnectionOptions
   alias Membrane.Time
 
   @one_second Time.second()
+  @max_frames_per_read 64
+  @max_bytes_per_read 1_048_576
+
+  @spec start_link(url :: String.t(), timeout :: integer() | :infinity, opts :: Keyword.t()) ::
+          pid()
+  def start_link(url, timeout, opts \\ []) do
+    annex_b? = Keyword.get(opts, :video_payload_format, :annexb) == :annexb
+    fast_start? = Keyword.get(opts, :fast_start, false)
+
+    analyze_duration =
+      case Keyword.get(opts, :analyze_duration) do
+        nil -> -1
+        duration -> duration |> Time.as_microseconds() |> Ratio.trunc()
+      end
+
+    {:ok, native_ref} =
+      create(
+        annex_b?,
+        fast_start?,
+        Keyword.get(opts, :probe_size) || -1,
+        analyze_duration,
+        Keyword.get(opts, :fps_probe_size) || -1
+      )
 
-  @spec start_link(url :: String.t(), timeout :: integer()) :: pid()
-  def start_link(url, timeout) do
-    {:ok, native_ref} = create()
     caller_pid = self()
 
     spawn(fn ->
@@ -22,10 +43,11 @@ defmodule Membrane.RTMP.Source.Native do
     end)
 
     timeout = get_int_timeout(timeout)
+    options = opts |> Keyword.get(:connection_options, []) |> ConnectionOptions.to_ffmpeg()
 
     spawn_link(fn ->
       Process.monitor(caller_pid)
-      send(self(), {:await_connection, url, timeout})
+      send(self(), {:await_connection, url, timeout, options})
       receive_loop(native_ref, caller_pid)
     end)
   end
@@ -43,12 +65,12 @@ defmodule Membrane.RTMP.Source.Native do
 
   defp receive_loop(native_ref, target) do
     receive do
-      {:await_connection, url, timeout} ->
-        await_connection(native_ref, target, url, timeout)
+      {:await_connection, url, timeout, options} ->
+        await_connection(native_ref, target, url, timeout, options)
 
-      :get_frame ->
-        result = read_frame(native_ref)
-        send(target, {__MODULE__, :read_frame, result})
+      {:get_frames, _consumer} ->
+        result = read_frames(native_ref, @max_frames_per_read, @max_bytes_per_read)
+        send(target, {__MODULE__, :read_frames, result})
         if result == :end_of_stream, do: :stop, else: :continue
 
       {:DOWN, _ref, :process, _pid, _reason} ->
@@ -63,12 +85,19 @@ defmodule Membrane.RTMP.Source.Native do
     end
   end
 
-  defp await_connection(native, target, url, timeout) do
-    case await_open(native, url, timeout) do
+  defp await_connection(native, target, url, timeout, {option_names, option_values}) do
+    case await_open(native, url, timeout, option_names, option_values) do
       {:ok, native_ref} ->
         Logger.debug("Connection established @ #{url}")
-        send(self(), :get_frame)
-        send(target, {__MODULE__, :format_info_ready, native_ref})
+        send(self(), {:get_frames, target})
+        send(target, {__MODULE__, :connected, native_ref})
+
+        send(
+          target,
+          {__MODULE__, :format_info_ready, get_audio_params(native_ref),
+           get_video_params(native_ref)}
+        )
+
         :continue
 
       {:error, :interrupted} ->
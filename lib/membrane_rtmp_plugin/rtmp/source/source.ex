@@ -3,6 +3,38 @@ defmodule Membrane.RTMP.Source do
   Membrane Element for receiving RTMP streams. Acts as a RTMP Server.
   This implementation is limited to only AAC and H264 streams.
 
+  The element either listens for a single client on `url` or receives the stream
+  from a `session` accepted by `Membrane.RTMP.Listener`.
+
+  When listening on `url`, the connection is by default handled by FFmpeg, which blocks
+  a dirty IO scheduler for the whole lifetime of the stream. With `io_mode: :native`
+  the connection is served by a `Membrane.RTMP.Listener` session instead, reading from
+  the socket only once data arrives. With `tls_options`, such a connection is accepted
+  as RTMPS, issuing stateless session tickets with which the clients resume their sessions
+  on reconnection.
+
+  When the stream is read by FFmpeg, its statistics are emitted every `stats_interval`
+  as a `[:membrane_rtmp_plugin, :source, :stats]` telemetry event with the following
+  measurements: `video_frames`, `video_bytes`, `audio_frames`, `audio_bytes`, `read_time`
+  (time spent reading the stream, including waiting for the client), `conversion_time`
+  (time spent converting the video to Annex-B), `allocations`, `last_video_dts` and
+  `last_audio_dts`. Times and timestamps are in `Membrane.Time` units. The metadata holds
+  the `element` name and the `url`.
+
+  With `trace_latency: true`, each buffer carries the monotonic time at which its frame was
+  received in `metadata.rtmp_receive_time`, comparable with `Membrane.Time.monotonic_time/0`.
+  The latencies between receiving the frames and
+  sending them downstream are then emitted every `stats_interval` as a cumulative histogram
+  in a `[:membrane_rtmp_plugin, :source, :latency]` telemetry event, with the `count` of
+  the frames and the `histogram` given as a list of `{upper_bound, count}` tuples.
+  The buckets' upper bounds are consecutive powers of two milliseconds and `:infinity`.
+
+  The frames of each output are queued until there's demand for them. With the `prefetch`
+  option, the stream is read ahead of the demand as long as the queues are within their
+  limits, so that short stalls of one output don't stop receiving the stream for the other
+  one. By default, the reads pause until the queues are empty, so the stream is received
+  at the pace of the slower output.
+
   Implementation based on FFmpeg
   """
   use Membrane.Source
@@ -10,7 +42,9 @@ defmodule Membrane.RTMP.Source do
   require Membrane.Logger
 
   alias __MODULE__.Native
-  alias Membrane.{AVC, Buffer, Time}
+  alias Membrane.{Buffer, Time}
+  alias Membrane.RTMP.{ConnectionOptions, LatencyHistogram, Listener}
+  alias Membrane.RTMP.Listener.Session
 
   def_output_pad :audio,
     availability: :always,
@@ -23,11 +57,20 @@ defmodule Membrane.RTMP.Source do
     mode: :pull
 
   def_options url: [
-                spec: binary(),
+                spec: binary() | nil,
+                default: nil,
                 description: """
                 URL on which the FFmpeg instance will be created
                 """
               ],
+              session: [
+                spec: pid() | nil,
+                default: nil,
+                description: """
+                Session announced by `Membrane.RTMP.Listener` to receive the stream from.
+                Has to be set if and only if `url` is not.
+                """
+              ],
               timeout: [
                 spec: Time.t() | :infinity,
                 default: :infinity,
@@ -36,27 +79,216 @@ defmodule Membrane.RTMP.Source do
 
                 Duration given must be a multiply of one second or atom `:infinity`.
                 """
+              ],
+              io_mode: [
+                spec: :ffmpeg | :native,
+                default: :ffmpeg,
+                description: """
+                Determines how the connection on `url` is handled. `:ffmpeg` reads the stream
+                with FFmpeg on a dirty IO scheduler, `:native` uses non-blocking sockets, so that
+                idle or slow publishers don't occupy any scheduler threads.
+                """
+              ],
+              video_payload_format: [
+                spec: :annexb | :avcc,
+                default: :annexb,
+                description: """
+                Format of the video payloads. `:annexb` outputs NAL units separated with start codes,
+                while `:avcc` outputs them prefixed with their length, as they are received from the client.
+                """
+              ],
+              fast_start: [
+                spec: boolean(),
+                default: false,
+                description: """
+                If true, the streams are set up as soon as the AVC and AAC sequence headers are received,
+                instead of probing the first frames with `avformat_find_stream_info`, which reduces
+                the startup latency. A stream whose sequence header doesn't arrive within
+                `analyze_duration` (5 seconds by default) is ignored.
+
+                Applies only to `io_mode: :ffmpeg`.
+                """
+              ],
+              probe_size: [
+                spec: pos_integer() | nil,
+                default: nil,
+                description: """
+                Maximal number of bytes read to probe the stream (FFmpeg's `probesize`).
+                Defaults to the FFmpeg default if not set. Applies only to `io_mode: :ffmpeg`.
+                """
+              ],
+              analyze_duration: [
+                spec: Time.t() | nil,
+                default: nil,
+                description: """
+                Maximal duration of the stream analyzed when probing it (FFmpeg's `analyzeduration`).
+                Defaults to the FFmpeg default if not set. Applies only to `io_mode: :ffmpeg`.
+                """
+              ],
+              fps_probe_size: [
+                spec: non_neg_integer() | nil,
+                default: nil,
+                description: """
+                Number of frames used to probe the frame rate (FFmpeg's `fpsprobesize`).
+                Defaults to the FFmpeg default if not set. Applies only to `io_mode: :ffmpeg`.
+                """
+              ],
+              connection_options: [
+                spec: ConnectionOptions.t(),
+                default: [],
+                description: """
+                #{ConnectionOptions.description()}
+                Applies only when listening on `url`.
+                """
+              ],
+              tls_options: [
+                spec: [:ssl.tls_server_option()] | nil,
+                default: nil,
+                description: """
+                If set, the connection on `url` is accepted as RTMPS, with these options of
+                the TLS server, such as `certfile` and `keyfile`. See `:ssl.listen/2` for
+                the available options. Applies only to `io_mode: :native`.
+                """
+              ],
+              prefetch: [
+                spec: [
+                  max_frames: non_neg_integer() | nil,
+                  max_duration: Time.t() | nil,
+                  overflow: :block | :raise
+                ],
+                default: [max_frames: 0],
+                description: """
+                Limits of the queue of frames waiting for demand, kept for each output:
+                  - `max_frames` - maximal number of queued frames
+                  - `max_duration` - maximal span of the queued frames' timestamps
+
+                The limits that aren't set don't apply, but at least one has to be set.
+                `overflow` determines what happens once a queue exceeds them. With `:block`,
+                the default, the stream isn't read until the queue is back within the limits,
+                so the publisher is eventually held back by TCP. With `:raise`, the stream is
+                read regardless of the demand and the element raises when a queue overflows.
+                """
+              ],
+              stats_interval: [
+                spec: Time.t() | nil,
+                default: Time.seconds(1),
+                description: """
+                Interval of the stats and latency telemetry events, `nil` disables them.
+                The stats are emitted only with `io_mode: :ffmpeg`.
+                """
+              ],
+              trace_latency: [
+                spec: boolean(),
+                default: false,
+                description: """
+                If true, the buffers are stamped with the time their frames were received and
+                the latency histogram is emitted with telemetry.
+                """
               ]
 
   @impl true
   def handle_init(%__MODULE__{} = opts) do
+    if is_nil(opts.url) == is_nil(opts.session) do
+      raise ArgumentError, "Exactly one of the `url` and `session` options has to be provided"
+    end
+
+    ConnectionOptions.validate!(opts.connection_options)
+
+    if opts.tls_options != nil and (opts.url == nil or opts.io_mode != :native) do
+      raise ArgumentError, "TLS options apply only to listening on `url` with io_mode: :native"
+    end
+
     {:ok,
      Map.from_struct(opts)
-     |> Map.merge(%{provider: nil, stale_frame: nil})}
+     |> Map.merge(%{
+       prefetch: validate_prefetch!(opts.prefetch),
+       provider: nil,
+       listener: nil,
+       native: nil,
+       queues: %{audio: :queue.new(), video: :queue.new()},
+       queued_frames: %{audio: 0, video: 0},
+       # The first frames are sent by the provider without being requested
+       awaiting_frames?: true,
+       end_of_stream?: false,
+       latency: LatencyHistogram.new()
+     })}
+  end
+
+  defp validate_prefetch!(prefetch) do
+    prefetch = Keyword.merge([max_frames: nil, max_duration: nil, overflow: :block], prefetch)
+
+    cond do
+      prefetch[:max_frames] == nil and prefetch[:max_duration] == nil ->
+        raise ArgumentError, "At least one of the prefetch limits has to be set"
+
+      prefetch[:overflow] not in [:block, :raise] ->
+        raise ArgumentError, "Invalid prefetch overflow policy: #{inspect(prefetch[:overflow])}"
+
+      true ->
+        Map.new(prefetch)
+    end
   end
 
   @impl true
-  def handle_prepared_to_playing(_ctx, state) do
-    pid = Native.start_link(state.url, state.timeout)
+  def handle_prepared_to_playing(_ctx, %{session: nil, io_mode: :ffmpeg} = state) do
+    pid =
+      Native.start_link(state.url, state.timeout,
+        video_payload_format: state.video_payload_format,
+        fast_start: state.fast_start,
+        probe_size: state.probe_size,
+        analyze_duration: state.analyze_duration,
+        fps_probe_size: state.fps_probe_size,
+        connection_options: state.connection_options
+      )
+
+    schedule_stats_report(state)
     {:ok, %{state | provider: pid}}
   end
 
   @impl true
-  def handle_demand(type, _size, _unit, _ctx, %{stale_frame: {type, buffer}} = state) do
-    # There is stale frame, which indicates that that the source was blocked waiting for demand from one of the outputs
-    # It now arrived, so we request next frame and output the one that blocked us
-    send(state.provider, :get_frame)
-    {{:ok, buffer: {type, buffer}}, %{state | stale_frame: nil}}
+  def handle_prepared_to_playing(_ctx, %{session: nil, io_mode: :native} = state) do
+    %URI{host: host, port: port} = URI.parse(state.url)
+    {:ok, listener} =
+      Listener.start_link(
+        port: port || 1935,
+        local_ip: host,
+        socket_options: ConnectionOptions.to_gen_tcp(state.connection_options),
+        tls: state.tls_options
+      )
+
+    if state.timeout != :infinity do
+      Process.send_after(self(), :connection_timeout, div(state.timeout, Time.millisecond()))
+    end
+
+    schedule_stats_report(state)
+    {:ok, %{state | listener: listener}}
+  end
+
+  @impl true
+  def handle_prepared_to_playing(_ctx, state) do
+    :ok = Session.attach(state.session, video_payload_format: state.video_payload_format)
+    schedule_stats_report(state)
+    {:ok, %{state | provider: state.session}}
+  end
+
+  @impl true
+  def handle_demand(type, _size, _unit, _ctx, %{queued_frames: queued_frames} = state)
+      when :erlang.map_get(type, queued_frames) > 0 do
+    # The queued frames waited for the demand, send them and read further
+    # if it was held back by the queue
+    buffers = :queue.to_list(state.queues[type])
+
+    state =
+      %{
+        state
+        | queues: %{state.queues | type => :queue.new()},
+          queued_frames: %{state.queued_frames | type => 0}
+      }
+      |> record_latency(buffers)
+      |> maybe_request_frames()
+
+    end_of_stream = if state.end_of_stream?, do: [end_of_stream: type], else: []
+    {{:ok, [buffer: {type, buffers}] ++ end_of_stream}, state}
   end
 
   @impl true
@@ -65,84 +297,257 @@ defmodule Membrane.RTMP.Source do
   end
 
   @impl true
-  def handle_other({Native, :format_info_ready, native_ref}, _ctx, state) do
-    actions = get_format_info_actions(native_ref)
+  def handle_other({Listener, :publish, %{session: session}}, _ctx, %{provider: nil} = state) do
+    # Like FFmpeg, serve only the first client and stop listening once it publishes
+    :ok = Session.attach(session, video_payload_format: state.video_payload_format)
+    {:ok, %{stop_listener(state) | provider: session}}
+  end
+
+  @impl true
+  def handle_other({Listener, :publish, _stream}, _ctx, state) do
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other(:connection_timeout, _ctx, %{provider: nil, listener: listener} = state)
+      when listener != nil do
+    raise "Failed to open input from #{state.url}. Reason: `timeout`"
+  end
+
+  @impl true
+  def handle_other(:connection_timeout, _ctx, state) do
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other({Native, :connected, native}, _ctx, state) do
+    {:ok, %{state | native: native}}
+  end
+
+  @impl true
+  def handle_other(:report_stats, %{playback_state: :playing} = ctx, state) do
+    report_stats(ctx, state)
+    report_latency(ctx, state)
+    schedule_stats_report(state)
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other(:report_stats, _ctx, state) do
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_other({Native, :format_info_ready, audio_params, video_params}, _ctx, state) do
+    actions = get_audio_caps(audio_params) ++ get_video_caps(video_params, state)
     {{:ok, actions}, state}
   end
 
   @impl true
-  def handle_other({Native, :read_frame, {:ok, type, pts, dts, frame}}, ctx, state)
+  def handle_other(
+        {Native, :read_frames,
+         {:ok, video_pts, video_dts, video_frames, video_receive_times, audio_pts, audio_dts,
+          audio_frames, audio_receive_times}},
+        ctx,
+        state
+      )
       when ctx.playback_state == :playing do
-    pts = Time.milliseconds(pts)
-    dts = Time.milliseconds(dts)
+    {actions, state} =
+      [
+        video: prepare_buffers(video_pts, video_dts, video_frames, video_receive_times, state),
+        audio: prepare_buffers(audio_pts, audio_dts, audio_frames, audio_receive_times, state)
+      ]
+      |> Enum.reject(fn {_type, buffers} -> buffers == [] end)
+      |> Enum.flat_map_reduce(state, fn {type, buffers}, state ->
+        # The queue is emptied whenever there's demand, so it's empty here if there's
+        # demand for the frames
+        if get_in(ctx.pads, [type, :demand]) > 0 do
+          {[buffer: {type, buffers}], record_latency(state, buffers)}
+        else
+          {[], enqueue(state, type, buffers)}
+        end
+      end)
 
-    buffer = %Buffer{
-      pts: pts,
-      dts: dts,
-      payload: prepare_payload(type, frame)
-    }
-
-    if get_in(ctx.pads, [type, :demand]) > 0 do
-      send(state.provider, :get_frame)
-      {{:ok, buffer: {type, buffer}}, state}
-    else
-      # if there is no demand for element of this type so we wait until it appears
-      # effectively, it results in source adapting to the slower of the two outputs
-      {:ok, %{state | stale_frame: {type, buffer}}}
-    end
+    state = maybe_request_frames(%{state | awaiting_frames?: false})
+    {{:ok, actions}, state}
   end
 
   @impl true
-  def handle_other({Native, :read_frame, :end_of_stream}, _ctx, state) do
+  def handle_other({Native, :read_frames, :end_of_stream}, _ctx, state) do
     Membrane.Logger.debug("Received end of stream")
-    {{:ok, end_of_stream: :audio, end_of_stream: :video}, state}
+
+    # The outputs with queued frames end once the frames are sent
+    actions =
+      for type <- [:audio, :video], state.queued_frames[type] == 0, do: {:end_of_stream, type}
+
+    {{:ok, actions}, %{state | awaiting_frames?: false, end_of_stream?: true}}
   end
 
   @impl true
-  def handle_other({Native, :read_frame, {:error, reason}}, _ctx, _state) do
+  def handle_other({Native, :read_frames, {:error, reason}}, _ctx, _state) do
     raise "Fetching of the frame failed. Reason: #{inspect(reason)}"
   end
 
   @impl true
-  def handle_playing_to_prepared(_ctx, state) do
+  def handle_playing_to_prepared(_ctx, %{provider: nil} = state) do
+    {:ok, stop_listener(state)}
+  end
+
+  @impl true
+  def handle_playing_to_prepared(_ctx, %{session: nil, io_mode: :ffmpeg} = state) do
     send(state.provider, :terminate)
     Process.unlink(state.provider)
+    {:ok, %{state | provider: nil, native: nil}}
+  end
+
+  @impl true
+  def handle_playing_to_prepared(_ctx, state) do
+    # Other consumers might still be receiving the stream from the session
+    :ok = Session.detach(state.provider)
     {:ok, %{state | provider: nil}}
   end
 
-  defp prepare_payload(:video, payload), do: AVC.Utils.to_annex_b(payload)
-  defp prepare_payload(:audio, payload), do: payload
+  defp report_stats(_ctx, %{native: nil}), do: :ok
+
+  defp report_stats(ctx, %{native: native} = state) do
+    {:ok, video_frames, video_bytes, audio_frames, audio_bytes, read_time, conversion_time,
+     allocations, last_video_dts, last_audio_dts} = Native.get_stats(native)
 
-  defp get_format_info_actions(native) do
-    [
-      get_audio_params(native),
-      get_video_params(native)
-    ]
-    |> Enum.concat()
+    :telemetry.execute(
+      [:membrane_rtmp_plugin, :source, :stats],
+      %{
+        video_frames: video_frames,
+        video_bytes: video_bytes,
+        audio_frames: audio_frames,
+        audio_bytes: audio_bytes,
+        read_time: Time.microseconds(read_time),
+        conversion_time: Time.microseconds(conversion_time),
+        allocations: allocations,
+        last_video_dts: last_video_dts,
+        last_audio_dts: last_audio_dts
+      },
+      %{element: ctx.name, url: state.url}
+    )
   end
 
-  defp get_audio_params(native) do
-    with {:ok, asc} <- Native.get_audio_params(native) do
-      caps = %Membrane.AAC.RemoteStream{
-        audio_specific_config: asc
-      }
+  defp report_latency(_ctx, %{trace_latency: false}), do: :ok
 
-      [caps: {:audio, caps}]
-    else
-      {:error, _reason} -> []
+  defp report_latency(ctx, state) do
+    :telemetry.execute(
+      [:membrane_rtmp_plugin, :source, :latency],
+      LatencyHistogram.to_measurements(state.latency),
+      %{element: ctx.name, url: state.url}
+    )
+  end
+
+  # Records the time since the frames were received, when they're sent downstream
+  defp record_latency(%{trace_latency: false} = state, _buffers), do: state
+
+  defp record_latency(state, buffers) do
+    now = Time.monotonic_time()
+
+    latency =
+      Enum.reduce(buffers, state.latency, fn buffer, latency ->
+        LatencyHistogram.record(latency, now - buffer.metadata.rtmp_receive_time)
+      end)
+
+    %{state | latency: latency}
+  end
+
+  defp schedule_stats_report(%{stats_interval: nil}), do: :ok
+
+  defp schedule_stats_report(state) do
+    Process.send_after(self(), :report_stats, div(state.stats_interval, Time.millisecond()))
+  end
+
+  defp stop_listener(%{listener: nil} = state), do: state
+
+  defp stop_listener(state) do
+    Process.unlink(state.listener)
+    :ok = GenServer.stop(state.listener)
+    %{state | listener: nil}
+  end
+
+  defp enqueue(state, type, buffers) do
+    state = %{
+      state
+      | queues: Map.update!(state.queues, type, &:queue.join(&1, :queue.from_list(buffers))),
+        queued_frames: Map.update!(state.queued_frames, type, &(&1 + length(buffers)))
+    }
+
+    if state.prefetch.overflow == :raise and not within_prefetch_limits?(state, type) do
+      raise "Prefetch queue of the #{type} output overflowed, there's no demand for its frames"
     end
+
+    state
   end
 
-  defp get_video_params(native) do
-    with {:ok, config} <- Native.get_video_params(native) do
-      caps = %Membrane.H264.RemoteStream{
-        decoder_configuration_record: config,
-        stream_format: :byte_stream
-      }
+  defp within_prefetch_limits?(state, type) do
+    %{max_frames: max_frames, max_duration: max_duration} = state.prefetch
+    queue = state.queues[type]
 
-      [caps: {:video, caps}]
+    duration =
+      case {:queue.peek(queue), :queue.peek_r(queue)} do
+        {{:value, first}, {:value, last}} -> last.dts - first.dts
+        {:empty, :empty} -> 0
+      end
+
+    (max_frames == nil or state.queued_frames[type] <= max_frames) and
+      (max_duration == nil or duration <= max_duration)
+  end
+
+  defp maybe_request_frames(%{awaiting_frames?: true} = state), do: state
+  defp maybe_request_frames(%{end_of_stream?: true} = state), do: state
+
+  defp maybe_request_frames(state) do
+    if state.prefetch.overflow == :raise or
+         Enum.all?([:audio, :video], &within_prefetch_limits?(state, &1)) do
+      send(state.provider, {:get_frames, self()})
+      %{state | awaiting_frames?: true}
     else
-      {:error, _reason} -> []
+      state
     end
   end
+
+  # The timestamps come from the native code in Membrane time units
+  defp prepare_buffers(pts_list, dts_list, frames, _receive_times, %{trace_latency: false}) do
+    [pts_list, dts_list, frames]
+    |> Enum.zip_with(fn [pts, dts, frame] -> %Buffer{pts: pts, dts: dts, payload: frame} end)
+  end
+
+  defp prepare_buffers(pts_list, dts_list, frames, receive_times, _state) do
+    [pts_list, dts_list, frames, receive_times]
+    |> Enum.zip_with(fn [pts, dts, frame, receive_time] ->
+      %Buffer{
+        pts: pts,
+        dts: dts,
+        payload: frame,
+        metadata: %{rtmp_receive_time: Time.microseconds(receive_time)}
+      }
+    end)
+  end
+
+  defp get_audio_caps({:ok, asc}) do
+    caps = %Membrane.AAC.RemoteStream{
+      audio_specific_config: asc
+    }
+
+    [caps: {:audio, caps}]
+  end
+
+  defp get_audio_caps({:error, _reason}), do: []
+
+  defp get_video_caps({:ok, config}, state) do
+    caps = %Membrane.H264.RemoteStream{
+      decoder_configuration_record: config,
+      stream_format: stream_format(state.video_payload_format)
+    }
+
+    [caps: {:video, caps}]
+  end
+
+  defp get_video_caps({:error, _reason}, _state), do: []
+
+  defp stream_format(:annexb), do: :byte_stream
+  defp stream_format(:avcc), do: :avc1
 end
@@ -29,7 +29,7 @@ defmodule Membrane.RTMP.Mixfile do
 
   def application do
     [
-      extra_applications: []
+      extra_applications: [:ssl]
     ]
   end
 
@@ -40,6 +40,7 @@ defmodule Membrane.RTMP.Mixfile do
     [
       {:membrane_core, "~> 0.10.0"},
       {:unifex, "~> 1.0"},
+      {:telemetry, "~> 1.0"},
       {:membrane_h264_ffmpeg_plugin, "~> 0.21.1"},
       {:membrane_aac_plugin, "~> 0.12.1"},
       {:membrane_mp4_plugin, "~> 0.16.0"},
@@ -0,0 +1,221 @@
+defmodule Membrane.RTMP.Listener.Test do
+  use ExUnit.Case
+  import ExUnit.CaptureLog
+  import Membrane.Testing.Assertions
+
+  require Logger
+
+  alias Membrane.RTMP.Listener
+  alias Membrane.Testing
+  alias Membrane.Testing.Pipeline
+
+  @input_file "test/fixtures/testsrc.flv"
+
+  test "Check if streams published to a single port are received" do
+    {:ok, listener} = Listener.start_link()
+    port = Listener.port(listener)
+
+    ffmpeg_tasks =
+      for stream_key <- ["first", "second"] do
+        Task.async(fn -> start_ffmpeg("rtmp://127.0.0.1:#{port}/app/#{stream_key}") end)
+      end
+
+    pipelines =
+      for _i <- 1..2 do
+        assert_receive {Listener, :publish, %{app: "app", stream_key: stream_key, session: session}},
+                       5_000
+
+        assert stream_key in ["first", "second"]
+        assert {:ok, pipeline} = get_testing_pipeline(session)
+        pipeline
+      end
+
+    for pipeline <- pipelines do
+      assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+      assert_sink_buffer(pipeline, :audio_sink, %Membrane.Buffer{})
+      assert_end_of_stream(pipeline, :audio_sink, :input, 11_000)
+      assert_end_of_stream(pipeline, :video_sink, :input)
+      Pipeline.terminate(pipeline, blocking?: true)
+    end
+
+    for task <- ffmpeg_tasks, do: assert(:ok = Task.await(task, 15_000))
+  end
+
+  test "Check if a source attached to a running stream is primed from the GOP cache" do
+    {:ok, listener} = Listener.start_link(gop_cache: true)
+    port = Listener.port(listener)
+
+    ffmpeg_task = Task.async(fn -> start_ffmpeg("rtmp://127.0.0.1:#{port}/app/stream") end)
+    assert_receive {Listener, :publish, %{session: session}}, 5_000
+
+    assert {:ok, first} = get_testing_pipeline(session)
+    assert_sink_buffer(first, :video_sink, %Membrane.Buffer{})
+    Process.sleep(1_000)
+
+    # Without the cache, the parser would drop the frames until the next keyframe
+    assert {:ok, second} = get_testing_pipeline(session)
+    assert_sink_buffer(second, :video_sink, %Membrane.Buffer{}, 1_000)
+    assert_sink_buffer(second, :audio_sink, %Membrane.Buffer{})
+
+    for pipeline <- [first, second] do
+      assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+      Pipeline.terminate(pipeline, blocking?: true)
+    end
+
+    assert :ok = Task.await(ffmpeg_task, 15_000)
+  end
+
+  test "Check if the GOP cache exceeding its limits is dropped" do
+    {:ok, listener} = Listener.start_link(gop_cache: [max_bytes: 1024])
+    port = Listener.port(listener)
+
+    ffmpeg_task = Task.async(fn -> start_ffmpeg("rtmp://127.0.0.1:#{port}/app/stream") end)
+    assert_receive {Listener, :publish, %{session: session}}, 5_000
+
+    assert {:ok, pipeline} = get_testing_pipeline(session)
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert %{gop_cache: 0} = Listener.Session.memory(session)
+
+    assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task, 15_000)
+  end
+
+  test "Check if a stream published over RTMPS is received" do
+    {:ok, listener} =
+      Listener.start_link(
+        tls: [certfile: "test/fixtures/tls_cert.pem", keyfile: "test/fixtures/tls_key.pem"]
+      )
+
+    port = Listener.port(listener)
+    ffmpeg_task = Task.async(fn -> start_ffmpeg("rtmps://127.0.0.1:#{port}/app/stream") end)
+    assert_receive {Listener, :publish, %{app: "app", stream_key: "stream", session: session}},
+                   5_000
+
+    assert {:ok, pipeline} = get_testing_pipeline(session)
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert_sink_buffer(pipeline, :audio_sink, %Membrane.Buffer{})
+    assert_end_of_stream(pipeline, :audio_sink, :input, 11_000)
+    assert_end_of_stream(pipeline, :video_sink, :input)
+    Pipeline.terminate(pipeline, blocking?: true)
+
+    assert :ok = Task.await(ffmpeg_task, 15_000)
+  end
+
+  test "Check if the memory of the sessions is accounted within the limits" do
+    max_session_memory = 4 * 1024 * 1024
+
+    {:ok, listener} =
+      Listener.start_link(
+        gop_cache: true,
+        max_session_memory: max_session_memory,
+        memory_budget: 16 * 1024 * 1024
+      )
+
+    port = Listener.port(listener)
+    ffmpeg_task = Task.async(fn -> start_ffmpeg("rtmp://127.0.0.1:#{port}/app/stream") end)
+    assert_receive {Listener, :publish, %{session: session}}, 5_000
+
+    assert {:ok, pipeline} = get_testing_pipeline(session)
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+
+    assert %{buffers: buffers, gop_cache: gop_cache} = Listener.Session.memory(session)
+    assert buffers > 0 and buffers <= max_session_memory
+    assert gop_cache > 0
+    assert Listener.total_memory() >= buffers
+
+    assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task, 15_000)
+    await_memory_released()
+  end
+
+  # The limits are smaller than the connect command, so the sessions fail before
+  # the stream is published
+  test "Check if a session exceeding its memory limit fails" do
+    {:ok, listener} = Listener.start_link(max_session_memory: 100)
+    port = Listener.port(listener)
+
+    log =
+      capture_log(fn ->
+        assert :error = start_ffmpeg("rtmp://127.0.0.1:#{port}/app/stream")
+      end)
+
+    assert log =~ "Session memory limit exceeded"
+    refute_received {Listener, :publish, _info}
+    await_memory_released()
+  end
+
+  test "Check if a session exceeding the memory budget fails" do
+    {:ok, listener} = Listener.start_link(memory_budget: 100)
+    port = Listener.port(listener)
+
+    log =
+      capture_log(fn ->
+        assert :error = start_ffmpeg("rtmp://127.0.0.1:#{port}/app/stream")
+      end)
+
+    assert log =~ "Memory budget exceeded"
+    refute_received {Listener, :publish, _info}
+    await_memory_released()
+  end
+
+  # The native state of a session is freed once its process is gone
+  defp await_memory_released(attempts \\ 50) do
+    cond do
+      Listener.total_memory() == 0 ->
+        :ok
+
+      attempts == 0 ->
+        flunk("The memory of the sessions hasn't been released")
+
+      true ->
+        Process.sleep(100)
+        await_memory_released(attempts - 1)
+    end
+  end
+
+  defp get_testing_pipeline(session) do
+    import Membrane.ParentSpec
+
+    options = [
+      children: [
+        src: %Membrane.RTMP.SourceBin{session: session},
+        audio_sink: Testing.Sink,
+        video_sink: Testing.Sink
+      ],
+      links: [
+        link(:src) |> via_out(:audio) |> to(:audio_sink),
+        link(:src) |> via_out(:video) |> to(:video_sink)
+      ],
+      test_process: self()
+    ]
+
+    Pipeline.start_link(options)
+  end
+
+  defp start_ffmpeg(url) do
+    import FFmpex
+    use FFmpex.Options
+    Logger.debug("Starting ffmpeg")
+
+    command =
+      FFmpex.new_command()
+      |> add_global_option(option_y())
+      |> add_input_file(@input_file)
+      |> add_file_option(option_re())
+      |> add_output_file(url)
+      |> add_file_option(option_f("flv"))
+      |> add_file_option(option_vcodec("copy"))
+      |> add_file_option(option_acodec("copy"))
+
+    case FFmpex.execute(command) do
+      {:ok, ""} ->
+        :ok
+
+      error ->
+        Logger.error(inspect(error))
+        :error
+    end
+  end
+end
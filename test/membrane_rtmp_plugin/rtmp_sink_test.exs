@@ -10,8 +10,45 @@ defmodule Membrane.RTMP.Sink.Test do
   @input_audio_url "https://raw.githubusercontent.com/membraneframework/static/gh-pages/samples/big-buck-bunny/bun33s.aac"
 
   @rtmp_server_url "rtmp://localhost:49500/app/sink_test"
+  @second_rtmp_server_url "rtmp://localhost:49501/app/sink_test"
   @reference_flv_path "test/fixtures/bun33s.flv"
 
+  defmodule CapsChanger do
+    # Passes the video through, sending its caps again with a different AVC level
+    # once `after_buffers` buffers have passed
+    use Membrane.Filter
+
+    alias Membrane.MP4.Payload
+
+    def_input_pad :input, caps: :any, demand_unit: :buffers
+    def_output_pad :output, caps: :any
+
+    def_options after_buffers: [spec: pos_integer()]
+
+    @impl true
+    def handle_init(opts), do: {:ok, %{after_buffers: opts.after_buffers, count: 0, caps: nil}}
+
+    @impl true
+    def handle_demand(:output, size, :buffers, _ctx, state),
+      do: {{:ok, demand: {:input, size}}, state}
+
+    @impl true
+    def handle_caps(:input, caps, _ctx, state), do: {{:ok, forward: caps}, %{state | caps: caps}}
+
+    @impl true
+    def handle_process(:input, buffer, _ctx, %{count: count, after_buffers: count} = state) do
+      %Payload{content: %Payload.AVC1{avcc: avcc} = content} = state.caps
+      <<head::binary-size(3), level, rest::binary>> = avcc
+      caps = %{state.caps | content: %{content | avcc: <<head::binary, level + 1, rest::binary>>}}
+
+      {{:ok, caps: {:output, caps}, buffer: {:output, buffer}}, %{state | count: count + 1}}
+    end
+
+    @impl true
+    def handle_process(:input, buffer, _ctx, state),
+      do: {{:ok, buffer: {:output, buffer}}, %{state | count: state.count + 1}}
+  end
+
   setup ctx do
     flv_output_file = Path.join(ctx.tmp_dir, "rtmp_sink_test.flv")
     %{flv_output_file: flv_output_file}
@@ -43,9 +80,294 @@ defmodule Membrane.RTMP.Sink.Test do
     assert File.stat!(flv_output_file).size == File.stat!(@reference_flv_path).size
   end
 
-  defp start_sink_pipeline(rtmp_url) do
+  @tag :tmp_dir
+  test "Check if the stream is correctly received with native IO", %{
+    flv_output_file: flv_output_file
+  } do
+    rtmp_server = Task.async(fn -> start_rtmp_server(flv_output_file) end)
+
+    {:ok, sink_pipeline_pid} = start_sink_pipeline(@rtmp_server_url, io_mode: :native)
+
+    assert_pipeline_playback_changed(sink_pipeline_pid, :prepared, :playing, 5000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :audio, 5_000)
+
+    Membrane.Testing.Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+    assert :ok = Task.await(rtmp_server)
+
+    assert File.stat!(flv_output_file).size == File.stat!(@reference_flv_path).size
+  end
+
+  @tag :tmp_dir
+  test "Check if the stream is correctly received with prewarmed connections", %{
+    flv_output_file: flv_output_file
+  } do
+    rtmp_server = Task.async(fn -> start_rtmp_server(flv_output_file) end)
+
+    {:ok, sink_pipeline_pid} = start_sink_pipeline(@rtmp_server_url, prewarm: true)
+
+    assert_pipeline_playback_changed(sink_pipeline_pid, :prepared, :playing, 5000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :audio, 5_000)
+
+    Membrane.Testing.Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+    assert :ok = Task.await(rtmp_server)
+
+    assert File.stat!(flv_output_file).size == File.stat!(@reference_flv_path).size
+  end
+
+  @tag :tmp_dir
+  test "Check if the stream is correctly received by many RTMP server instances", %{
+    tmp_dir: tmp_dir
+  } do
+    servers =
+      for {url, idx} <- Enum.with_index([@rtmp_server_url, @second_rtmp_server_url]) do
+        flv_output_file = Path.join(tmp_dir, "rtmp_sink_test_#{idx}.flv")
+        {flv_output_file, Task.async(fn -> start_rtmp_server(flv_output_file, url) end)}
+      end
+
+    {:ok, sink_pipeline_pid} = start_sink_pipeline([@rtmp_server_url, @second_rtmp_server_url])
+
+    assert_pipeline_playback_changed(sink_pipeline_pid, :prepared, :playing, 5000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :audio, 5_000)
+
+    Membrane.Testing.Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+
+    for {flv_output_file, rtmp_server} <- servers do
+      assert :ok = Task.await(rtmp_server)
+      assert File.stat!(flv_output_file).size == File.stat!(@reference_flv_path).size
+    end
+  end
+
+  @tag :tmp_dir
+  test "Check if a new sequence header is sent when the video caps change", %{
+    flv_output_file: flv_output_file
+  } do
+    rtmp_server = Task.async(fn -> start_rtmp_server(flv_output_file) end)
+
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline(@rtmp_server_url, [], caps_changer: %CapsChanger{after_buffers: 100})
+
+    assert_pipeline_playback_changed(sink_pipeline_pid, :prepared, :playing, 5000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :audio, 5_000)
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+    assert :ok = Task.await(rtmp_server)
+
+    # The initial one and the one sent with the first key frame after the change
+    assert count_avc_sequence_headers(flv_output_file) == 2
+  end
+
+  test "Check if the stream is resumed after the connection breaks" do
+    {:ok, listener} = Membrane.RTMP.Listener.start_link()
+    url = "rtmp://127.0.0.1:#{Membrane.RTMP.Listener.port(listener)}/app/sink_test"
+
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline(url, reconnect: [initial_delay: Membrane.Time.milliseconds(100)])
+
+    # Break the first connection as soon as the stream is published
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: session}}, 5_000
+    Process.exit(session, :kill)
+
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: session}}, 5_000
+    {:ok, source_pipeline_pid} = start_source_pipeline(session)
+
+    assert_sink_buffer(source_pipeline_pid, :video_sink, %Membrane.Buffer{}, 5_000)
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(source_pipeline_pid, :video_sink, :input, 5_000)
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+    Pipeline.terminate(source_pipeline_pid, blocking?: true)
+  end
+
+  test "Check if the TLS session is resumed when reconnecting over RTMPS" do
+    {:ok, listener} =
+      Membrane.RTMP.Listener.start_link(
+        tls: [certfile: "test/fixtures/tls_cert.pem", keyfile: "test/fixtures/tls_key.pem"]
+      )
+
+    url = "rtmps://127.0.0.1:#{Membrane.RTMP.Listener.port(listener)}/app/sink_test"
+
+    # The certificate is self-signed
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline(url,
+        io_mode: :native,
+        connection_options: [tls_verify: false],
+        reconnect: [initial_delay: Membrane.Time.milliseconds(100)]
+      )
+
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: session}}, 5_000
+    refute Membrane.RTMP.Listener.Session.tls_session_resumed?(session)
+    Process.exit(session, :kill)
+
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: session}}, 5_000
+    assert Membrane.RTMP.Listener.Session.tls_session_resumed?(session)
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+  end
+
+  test "Check if the video is dropped when the send queue overflows" do
+    # With no consumer attached, the session doesn't read the socket after the stream
+    # is published, so the small socket buffers fill up right away
+    {:ok, listener} = Membrane.RTMP.Listener.start_link(socket_options: [recbuf: 4096])
+    url = "rtmp://127.0.0.1:#{Membrane.RTMP.Listener.port(listener)}/app/sink_test"
+
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline(url,
+        io_mode: :native,
+        connection_options: [send_buffer_size: 4096],
+        send_queue: [max_bytes: 64 * 1024, overflow: :drop_non_key_frames]
+      )
+
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: _session}}, 5_000
+
+    stats = await_send_queue(sink_pipeline_pid, &(&1.dropped_frames > 0))
+    assert stats.congestion_drops == 0
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+  end
+
+  test "Check if the queued video is dropped when its latency exceeds the limit" do
+    {:ok, listener} = Membrane.RTMP.Listener.start_link(socket_options: [recbuf: 4096])
+    url = "rtmp://127.0.0.1:#{Membrane.RTMP.Listener.port(listener)}/app/sink_test"
+
+    # The queue is large enough for the whole stream, so the video can only be dropped
+    # because of the latency
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline(url,
+        io_mode: :native,
+        connection_options: [send_buffer_size: 4096],
+        send_queue: [max_latency: Membrane.Time.milliseconds(100)]
+      )
+
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: _session}}, 5_000
+
+    stats = await_send_queue(sink_pipeline_pid, &(&1.congestion_drops > 0))
+    assert stats.dropped_frames > 0
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+  end
+
+  test "Check if connecting times out when the server doesn't answer" do
+    # The connections are accepted by the kernel, but nothing is ever read nor sent
+    {:ok, socket} = :gen_tcp.listen(0, [:binary, active: false])
+    {:ok, port} = :inet.port(socket)
+    Process.flag(:trap_exit, true)
+
+    {:ok, sink_pipeline_pid} =
+      start_sink_pipeline("rtmp://127.0.0.1:#{port}/app/sink_test",
+        io_mode: :native,
+        connect_timeout: Membrane.Time.milliseconds(500)
+      )
+
+    assert_receive {:EXIT, ^sink_pipeline_pid, _reason}, 5_000
+    :gen_tcp.close(socket)
+  end
+
+  @tag :tmp_dir
+  test "Check if the stream is relayed from the source without parsing", %{
+    flv_output_file: flv_output_file
+  } do
+    rtmp_server = Task.async(fn -> start_rtmp_server(flv_output_file) end)
+    {:ok, listener} = Membrane.RTMP.Listener.start_link()
+    url = "rtmp://127.0.0.1:#{Membrane.RTMP.Listener.port(listener)}/app/sink_test"
+
+    {:ok, sink_pipeline_pid} = start_sink_pipeline(url)
+    assert_receive {Membrane.RTMP.Listener, :publish, %{session: session}}, 5_000
+    {:ok, relay_pipeline_pid} = start_relay_pipeline(session, @rtmp_server_url)
+
+    assert_end_of_stream(sink_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(relay_pipeline_pid, :rtmp_sink, :video, 5_000)
+    assert_end_of_stream(relay_pipeline_pid, :rtmp_sink, :audio, 5_000)
+
+    Pipeline.terminate(sink_pipeline_pid, blocking?: true)
+    Pipeline.terminate(relay_pipeline_pid, blocking?: true)
+    assert :ok = Task.await(rtmp_server)
+    assert File.stat!(flv_output_file).size > 0
+  end
+
+  # Waits for the first report of the send queue satisfying `condition`, the queues
+  # are reported every second
+  defp await_send_queue(pipeline_pid, condition, reports \\ 10) do
+    assert reports > 0, "No report of the send queue satisfied the condition"
+    assert_pipeline_notified(pipeline_pid, :rtmp_sink, {:send_queues, [stats]}, 5_000)
+
+    if condition.(stats) do
+      stats
+    else
+      await_send_queue(pipeline_pid, condition, reports - 1)
+    end
+  end
+
+  defp start_relay_pipeline(session, rtmp_url) do
+    import Membrane.ParentSpec
+
+    options = [
+      children: [
+        src: %Membrane.RTMP.Source{session: session, video_payload_format: :avcc},
+        rtmp_sink: %Membrane.RTMP.Sink{rtmp_url: rtmp_url, max_attempts: 5}
+      ],
+      links: [
+        link(:src) |> via_out(:audio) |> via_in(:audio) |> to(:rtmp_sink),
+        link(:src) |> via_out(:video) |> via_in(:video) |> to(:rtmp_sink)
+      ],
+      test_process: self()
+    ]
+
+    Pipeline.start_link(options)
+  end
+
+  defp start_source_pipeline(session) do
+    import Membrane.ParentSpec
+
+    options = [
+      children: [
+        src: %Membrane.RTMP.SourceBin{session: session},
+        audio_sink: Membrane.Testing.Sink,
+        video_sink: Membrane.Testing.Sink
+      ],
+      links: [
+        link(:src) |> via_out(:audio) |> to(:audio_sink),
+        link(:src) |> via_out(:video) |> to(:video_sink)
+      ],
+      test_process: self()
+    ]
+
+    Pipeline.start_link(options)
+  end
+
+  # Counts the video tags of the FLV file carrying an AVC sequence header
+  defp count_avc_sequence_headers(flv_file) do
+    <<"FLV", _version, _flags, header_size::32, _rest::binary>> = data = File.read!(flv_file)
+    <<_header::binary-size(header_size), tags::binary>> = data
+    count_avc_sequence_headers(tags, 0)
+  end
+
+  defp count_avc_sequence_headers(tags, count) do
+    case tags do
+      <<_previous_tag_size::32, type, size::24, _timestamp::32, _stream_id::24,
+        body::binary-size(size), rest::binary>> ->
+        sequence_header? = type == 9 and match?(<<_frame_type::4, 7::4, 0, _rest::binary>>, body)
+        count_avc_sequence_headers(rest, if(sequence_header?, do: count + 1, else: count))
+
+      _trailing ->
+        count
+    end
+  end
+
+  # The video filters are linked between the payloader and the sink
+  defp start_sink_pipeline(rtmp_url, sink_opts \\ [], video_filters \\ []) do
     import Membrane.ParentSpec
 
+    video_link =
+      Enum.reduce(
+        Keyword.keys(video_filters),
+        link(:video_source) |> to(:video_parser) |> to(:video_payloader),
+        &to(&2, &1)
+      )
+
     options = [
       children: [
         video_parser: %Membrane.H264.FFmpeg.Parser{
@@ -66,14 +388,11 @@ defmodule Membrane.RTMP.Sink.Test do
           hackney_opts: [follow_redirect: true]
         },
         video_payloader: Membrane.MP4.Payloader.H264,
-        rtmp_sink: %Membrane.RTMP.Sink{rtmp_url: rtmp_url, max_attempts: 5}
-      ],
+        rtmp_sink:
+          struct!(Membrane.RTMP.Sink, [rtmp_url: rtmp_url, max_attempts: 5] ++ sink_opts)
+      ] ++ video_filters,
       links: [
-        link(:video_source)
-        |> to(:video_parser)
-        |> to(:video_payloader)
-        |> via_in(:video)
-        |> to(:rtmp_sink),
+        video_link |> via_in(:video) |> to(:rtmp_sink),
         link(:audio_source) |> to(:audio_parser) |> via_in(:audio) |> to(:rtmp_sink)
       ],
       test_process: self()
@@ -82,8 +401,8 @@ defmodule Membrane.RTMP.Sink.Test do
     Pipeline.start_link(options)
   end
 
-  @spec start_rtmp_server(Path.t()) :: {:ok, pid()}
-  def start_rtmp_server(out_file) do
+  @spec start_rtmp_server(Path.t(), String.t()) :: {:ok, pid()}
+  def start_rtmp_server(out_file, url \\ @rtmp_server_url) do
     import FFmpex
     use FFmpex.Options
 
@@ -95,7 +414,7 @@ defmodule Membrane.RTMP.Sink.Test do
         require_arg: true,
         contexts: [:global]
       })
-      |> add_input_file(@rtmp_server_url)
+      |> add_input_file(url)
       |> add_file_option(option_f("flv"))
       |> add_output_file(out_file)
       |> add_file_option(option_c("copy"))
@@ -0,0 +1,60 @@
+defmodule Membrane.RTMP.Sink.Timestamps.Test do
+  use ExUnit.Case, async: true
+
+  alias Membrane.RTMP.Sink.Timestamps
+  alias Membrane.Time
+
+  @max_delta Time.seconds(10)
+  @threshold Time.seconds(1)
+
+  test "Check if the streams within the interleaving bound are demanded" do
+    timestamps = %{video: Time.seconds(8), audio: Time.seconds(2)}
+    write_times = %{video: Time.seconds(100), audio: Time.seconds(100)}
+
+    assert {demanded, []} =
+             Timestamps.split_demanded(timestamps, write_times, @max_delta, Time.seconds(101))
+
+    assert Enum.sort(demanded) == [:audio, :video]
+  end
+
+  test "Check if the stream ahead of a silent one is demanded again after the bound" do
+    timestamps = %{video: Time.seconds(15), audio: Time.seconds(2)}
+    write_times = %{video: Time.seconds(100), audio: Time.seconds(95)}
+
+    assert {[:audio], [:video]} =
+             Timestamps.split_demanded(timestamps, write_times, @max_delta, Time.seconds(100))
+
+    # The audio hasn't been written for longer than the bound
+    assert {demanded, []} =
+             Timestamps.split_demanded(timestamps, write_times, @max_delta, Time.seconds(106))
+
+    assert Enum.sort(demanded) == [:audio, :video]
+  end
+
+  test "Check if the timestamps going back are repaired" do
+    timestamps = Enum.map([0, 40, 80, 20, 60], &Time.milliseconds/1)
+    {offsets, _repair} = Timestamps.repair(timestamps, Timestamps.new_repair(), @threshold)
+
+    assert Enum.zip_with(timestamps, offsets, &+/2) ==
+             Enum.map([0, 40, 80, 120, 160], &Time.milliseconds/1)
+  end
+
+  test "Check if the timestamps jumping forward beyond the threshold are repaired" do
+    first = Enum.map([0, 40, 80], &Time.milliseconds/1)
+    second = Enum.map([80 + 5_000, 120 + 5_000], &Time.milliseconds/1)
+
+    # The shift is carried over to the next batch of the stream
+    {first_offsets, repair} = Timestamps.repair(first, Timestamps.new_repair(), @threshold)
+    {second_offsets, _repair} = Timestamps.repair(second, repair, @threshold)
+
+    assert Enum.zip_with(first ++ second, first_offsets ++ second_offsets, &+/2) ==
+             Enum.map([0, 40, 80, 120, 160], &Time.milliseconds/1)
+  end
+
+  test "Check if the timestamps jumping forward within the threshold are kept" do
+    timestamps = Enum.map([0, 40, 80, 800], &Time.milliseconds/1)
+    {offsets, _repair} = Timestamps.repair(timestamps, Timestamps.new_repair(), @threshold)
+
+    assert offsets == [0, 0, 0, 0]
+  end
+end
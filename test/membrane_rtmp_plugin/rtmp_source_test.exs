@@ -27,6 +27,127 @@ defmodule Membrane.RTMP.Source.Test do
     assert :ok = Task.await(ffmpeg_task)
   end
 
+  test "Check if the stream is received with native IO" do
+    assert {:ok, pipeline} = get_testing_pipeline(io_mode: :native)
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert_sink_buffer(pipeline, :audio_sink, %Membrane.Buffer{})
+    assert_end_of_stream(pipeline, :audio_sink, :input, 11_000)
+    assert_end_of_stream(pipeline, :video_sink, :input)
+
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
+  test "Check if the stream is received with fast start" do
+    assert {:ok, pipeline} = get_testing_pipeline(fast_start: true)
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert_sink_buffer(pipeline, :audio_sink, %Membrane.Buffer{})
+    assert_end_of_stream(pipeline, :audio_sink, :input, 11_000)
+    assert_end_of_stream(pipeline, :video_sink, :input)
+
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
+  test "Check if the video is received in AVCC format" do
+    assert {:ok, pipeline} = get_testing_pipeline(video_payload_format: :avcc)
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_sink_caps(pipeline, :video_sink, %Membrane.H264.RemoteStream{stream_format: :avc1})
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
+  test "Check if the stream is received with prefetch" do
+    assert {:ok, pipeline} =
+             get_testing_pipeline(prefetch: [max_duration: Membrane.Time.seconds(2)])
+
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_sink_buffer(pipeline, :video_sink, %Membrane.Buffer{})
+    assert_sink_buffer(pipeline, :audio_sink, %Membrane.Buffer{})
+    assert_end_of_stream(pipeline, :audio_sink, :input, 11_000)
+    assert_end_of_stream(pipeline, :video_sink, :input)
+
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
+  test "stream stats are emitted with telemetry" do
+    test_pid = self()
+    handler_id = "rtmp-source-stats-test"
+
+    :ok =
+      :telemetry.attach(
+        handler_id,
+        [:membrane_rtmp_plugin, :source, :stats],
+        fn _event, measurements, _metadata, _config -> send(test_pid, {:stats, measurements}) end,
+        nil
+      )
+
+    on_exit(fn -> :telemetry.detach(handler_id) end)
+
+    assert {:ok, pipeline} = get_testing_pipeline(stats_interval: Membrane.Time.milliseconds(100))
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_receive {:stats, %{video_frames: video_frames, audio_frames: audio_frames}}
+                   when video_frames > 0 and audio_frames > 0,
+                   5_000
+
+    assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
+  test "frame latency is emitted with telemetry" do
+    test_pid = self()
+    handler_id = "rtmp-source-latency-test"
+
+    :ok =
+      :telemetry.attach(
+        handler_id,
+        [:membrane_rtmp_plugin, :source, :latency],
+        fn _event, measurements, _metadata, _config -> send(test_pid, {:latency, measurements}) end,
+        nil
+      )
+
+    on_exit(fn -> :telemetry.detach(handler_id) end)
+
+    assert {:ok, pipeline} =
+             get_testing_pipeline(
+               stats_interval: Membrane.Time.milliseconds(100),
+               trace_latency: true
+             )
+
+    assert_pipeline_playback_changed(pipeline, :prepared, :playing)
+
+    ffmpeg_task = Task.async(&start_ffmpeg/0)
+
+    assert_receive {:latency, %{count: count, histogram: histogram}} when count > 0, 5_000
+    assert histogram |> Enum.map(&elem(&1, 1)) |> Enum.sum() == count
+
+    assert_end_of_stream(pipeline, :video_sink, :input, 11_000)
+    Pipeline.terminate(pipeline, blocking?: true)
+    assert :ok = Task.await(ffmpeg_task)
+  end
+
   test "blocking calls are cancelled properly" do
     alias Membrane.RTMP.Source.Native
 
@@ -55,13 +176,13 @@ defmodule Membrane.RTMP.Source.Test do
     assert :gen_tcp.connect('127.0.0.1', @port, [:binary]) == {:error, :econnrefused}
   end
 
-  defp get_testing_pipeline() do
+  defp get_testing_pipeline(source_opts \\ []) do
     import Membrane.ParentSpec
     timeout = Membrane.Time.seconds(10)
 
     options = [
       children: [
-        src: %Membrane.RTMP.SourceBin{port: @port, timeout: timeout},
+        src: struct!(Membrane.RTMP.SourceBin, [port: @port, timeout: timeout] ++ source_opts),
         audio_sink: Testing.Sink,
         video_sink: Testing.Sink
       ],